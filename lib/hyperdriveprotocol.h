@@ -35,6 +35,7 @@ Q_DECL_CONSTEXPR quint8 fluctuation() { return 'f'; }
 Q_DECL_CONSTEXPR quint8 interfaces() { return 'c'; }
 Q_DECL_CONSTEXPR quint8 messageTerminator() { return 'T'; }
 Q_DECL_CONSTEXPR quint8 bigBang() { return 'B'; }
+Q_DECL_CONSTEXPR quint8 producerProperties() { return 'p'; }
 }
 
 namespace Discovery
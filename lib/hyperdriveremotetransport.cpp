@@ -168,6 +168,19 @@ public:
 
                     op->m_result = interfaces;
                     op->setFinished();
+                } else if (command == Hyperdrive::Protocol::Control::producerProperties()) {
+                    QList< QByteArray > payloads;
+                    QUuid requestId;
+                    in >> requestId >> payloads;
+
+                    RemoteByteArrayListOperation *op = baListOperations.take(requestId);
+                    if (!op) {
+                        qCWarning(hyperdriveRemoteTransportDC) << "Bad request on the remote transport!";
+                        return;
+                    }
+
+                    op->m_result = payloads;
+                    op->setFinished();
                 } else if (command == Hyperdrive::Protocol::Control::hyperdriveHasInterface()) {
                     bool ret;
                     QUuid requestId;
@@ -237,6 +250,11 @@ QHash< QByteArray, Interface > RemoteTransport::introspection() const
     return d->introspection;
 }
 
+bool RemoteTransport::reloadConfiguration()
+{
+    return false;
+}
+
 void RemoteTransport::routeWave(const Hyperspace::Wave &wave, int fd)
 {
     Q_D(RemoteTransport);
@@ -295,6 +313,22 @@ RemoteBoolOperation *RemoteTransport::hyperdriveHasInterface(const QByteArray& i
     return ret;
 }
 
+RemoteByteArrayListOperation *RemoteTransport::producerProperties(const QList< QByteArray > &targets)
+{
+    Q_D(RemoteTransport);
+
+    RemoteByteArrayListOperation *ret = new RemoteByteArrayListOperation(this);
+    QUuid requestId = QUuid::createUuid();
+    d->baListOperations.insert(requestId, ret);
+
+    QByteArray msg;
+    QDataStream out(&msg, QIODevice::WriteOnly);
+    out << Hyperdrive::Protocol::Control::producerProperties() << requestId << targets;
+    d->socket->write(msg);
+
+    return ret;
+}
+
 }
 
 #include "moc_hyperdriveremotetransport.cpp"
@@ -74,12 +74,18 @@ public:
 
     QHash< QByteArray, Interface > introspection() const;
 
+    /// Called on SIGHUP. Implementations apply configuration changes to the running transport and return true, or return false
+    /// if the changes require the transport to be restarted. The default implementation always asks for a restart.
+    virtual bool reloadConfiguration();
+
 protected:
     virtual void routeWave(const Hyperspace::Wave &wave, int fd);
 
     RemoteByteArrayListOperation *listHyperdriveInterfaces();
     RemoteByteArrayListOperation *listGatesForHyperdriveInterface(const QByteArray &interface);
     RemoteBoolOperation *hyperdriveHasInterface(const QByteArray &interface);
+    // Cached payloads of the given producer property targets, in the same order. Unknown targets yield an empty payload.
+    RemoteByteArrayListOperation *producerProperties(const QList< QByteArray > &targets);
 
 Q_SIGNALS:
     void introspectionChanged();
@@ -4,6 +4,7 @@
 
 #include "hyperdrivetransportmanager.h"
 
+#include "hyperdrivecache.h"
 #include "hyperdrivecore.h"
 #include "hyperdriveremotetransport.h"
 #include "hyperdrivetransport.h"
@@ -228,6 +229,28 @@ void TransportManager::addRemoteTransport(Hyperspace::Socket *socket)
 
                 out << Hyperdrive::Protocol::Control::hyperdriveHasInterface() << requestId << d->core->hasInterface(interface);
                 socket->write(msg);
+            } else if (command == Hyperdrive::Protocol::Control::producerProperties()) {
+                QUuid requestId;
+                QList< QByteArray > targets;
+                in >> requestId >> targets;
+
+                // Targets are in the /interface/path form
+                QList< QByteArray > payloads;
+                payloads.reserve(targets.size());
+                for (const QByteArray &target : targets) {
+                    int pathStart = target.indexOf('/', 1);
+                    if (pathStart < 0) {
+                        payloads.append(QByteArray());
+                        continue;
+                    }
+                    payloads.append(Cache::instance()->producerProperty(target.mid(1, pathStart - 1), target.mid(pathStart)));
+                }
+
+                QByteArray msg;
+                QDataStream out(&msg, QIODevice::WriteOnly);
+
+                out << Hyperdrive::Protocol::Control::producerProperties() << requestId << payloads;
+                socket->write(msg);
             } else {
                 qCWarning(hyperdriveTransportManagerDC) << "Message malformed!";
                 return;
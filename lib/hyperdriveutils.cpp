@@ -16,6 +16,12 @@ qreal randomizedInterval(qreal minimumInterval, qreal delayCoefficient)
     return minimumInterval + (minimumInterval * delayCoefficient * ((qreal)qrand() / RAND_MAX));
 }
 
+QByteArray interfaceFromTarget(const QByteArray &target)
+{
+    int end = target.indexOf('/', 1);
+    return end < 0 ? target.mid(1) : target.mid(1, end - 1);
+}
+
 } // Utils
 
 } // Hyperdrive
@@ -1,6 +1,7 @@
 #ifndef _HYPERDRIVEUTILS_H_
 #define _HYPERDRIVEUTILS_H_
 
+#include <QtCore/QByteArray>
 #include <QtCore/QtGlobal>
 
 namespace Hyperdrive {
@@ -9,6 +10,8 @@ namespace Utils {
 
     void seedRNG();
     qreal randomizedInterval(qreal minimumInterval, qreal delayCoefficient);
+    // Extracts "interface" out of a "/interface/path" target
+    QByteArray interfaceFromTarget(const QByteArray &target);
 
 }
 
@@ -0,0 +1,301 @@
+#include "astartedatastreamaggregator.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QStringList>
+#include <QtCore/QTimer>
+
+#include <hyperdriveutils.h>
+
+#include <HyperspaceCore/BSONDocument>
+#include <HyperspaceCore/BSONSerializer>
+
+Q_LOGGING_CATEGORY(astarteAggregatorDC, "hyperdrive.transport.astarte.aggregator", DEBUG_MESSAGES_DEFAULT_LEVEL)
+
+namespace {
+
+// Compact per-path window state. Min/Max keep the whole payload of the extreme sample,
+// so that the original BSON type and timestamp are published untouched.
+struct WindowState {
+    WindowState() : windowStart(0), count(0), sum(0), min(0), max(0), mean(false) {}
+
+    qint64 windowStart;
+    quint32 count;
+    double sum;
+    double min;
+    double max;
+    bool mean;
+    Hyperdrive::CacheMessage selected;
+};
+
+Hyperdrive::CacheMessage windowMessage(const WindowState &state)
+{
+    if (!state.mean) {
+        return state.selected;
+    }
+
+    Hyperspace::Util::BSONSerializer serializer;
+    serializer.appendDoubleValue("v", state.sum / state.count);
+    // Keep the explicit timestamp of the last sample in the window, if any
+    Hyperspace::Util::BSONDocument last(state.selected.payload());
+    if (last.contains("t")) {
+        serializer.appendDateTime("t", last.value("t").toDateTime());
+    }
+    serializer.appendEndOfDocument();
+
+    Hyperdrive::CacheMessage message = state.selected;
+    message.setPayload(serializer.document());
+    return message;
+}
+
+bool extractNumericValue(const QByteArray &payload, double *value)
+{
+    Hyperspace::Util::BSONDocument doc(payload);
+    if (!doc.isValid() || !doc.contains("v")) {
+        return false;
+    }
+
+    QVariant v = doc.value("v");
+    switch (v.type()) {
+        case QVariant::Int:
+        case QVariant::UInt:
+        case QVariant::LongLong:
+        case QVariant::ULongLong:
+        case QVariant::Double:
+            *value = v.toDouble();
+            return true;
+        default:
+            return false;
+    }
+}
+
+}
+
+class AstarteDatastreamAggregator::Private
+{
+public:
+    Private() : flushTimer(nullptr) {}
+
+    QHash< QByteArray, Policy > policies;
+    QHash< QByteArray, WindowState > windows;
+    QHash< QByteArray, quint32 > decimationCounters;
+    QTimer *flushTimer;
+
+    void updateFlushInterval();
+};
+
+void AstarteDatastreamAggregator::Private::updateFlushInterval()
+{
+    int interval = 0;
+    for (const Policy &policy : policies) {
+        if (policy.mode == Mode::Decimate) {
+            continue;
+        }
+        if (interval == 0 || policy.parameter < interval) {
+            interval = policy.parameter;
+        }
+    }
+
+    if (interval > 0) {
+        flushTimer->start(interval);
+    } else {
+        flushTimer->stop();
+    }
+}
+
+AstarteDatastreamAggregator::AstarteDatastreamAggregator(QObject *parent)
+    : QObject(parent)
+    , d(new Private)
+{
+    d->flushTimer = new QTimer(this);
+    d->flushTimer->setTimerType(Qt::CoarseTimer);
+    connect(d->flushTimer, &QTimer::timeout, this, &AstarteDatastreamAggregator::flushExpired);
+}
+
+AstarteDatastreamAggregator::~AstarteDatastreamAggregator()
+{
+    delete d;
+}
+
+AstarteDatastreamAggregator::Policy AstarteDatastreamAggregator::policyFromString(const QString &policy)
+{
+    QStringList parts = policy.trimmed().split(QLatin1Char(':'));
+    if (parts.size() != 2) {
+        return Policy();
+    }
+
+    bool ok;
+    int parameter = parts.at(1).toInt(&ok);
+    if (!ok || parameter <= 0) {
+        return Policy();
+    }
+
+    QString mode = parts.at(0).toLower();
+    if (mode == QStringLiteral("last")) {
+        return Policy(Mode::Last, parameter);
+    } else if (mode == QStringLiteral("min")) {
+        return Policy(Mode::Min, parameter);
+    } else if (mode == QStringLiteral("max")) {
+        return Policy(Mode::Max, parameter);
+    } else if (mode == QStringLiteral("mean")) {
+        return Policy(Mode::Mean, parameter);
+    } else if (mode == QStringLiteral("decimate")) {
+        return Policy(Mode::Decimate, parameter);
+    }
+
+    return Policy();
+}
+
+void AstarteDatastreamAggregator::setPolicy(const QByteArray &interface, const Policy &policy)
+{
+    if (!policy.isValid()) {
+        qCWarning(astarteAggregatorDC) << "Ignoring invalid datastream policy for" << interface;
+        return;
+    }
+
+    qCInfo(astarteAggregatorDC) << "Datastream policy for" << interface << static_cast<int>(policy.mode) << policy.parameter;
+    d->policies.insert(interface, policy);
+    d->updateFlushInterval();
+}
+
+void AstarteDatastreamAggregator::clearPolicies()
+{
+    flushAll();
+    d->policies.clear();
+    d->decimationCounters.clear();
+    d->updateFlushInterval();
+}
+
+void AstarteDatastreamAggregator::retainInterfaces(const QSet< QByteArray > &interfaces)
+{
+    QHash< QByteArray, quint32 >::iterator it = d->decimationCounters.begin();
+    while (it != d->decimationCounters.end()) {
+        if (!interfaces.contains(Hyperdrive::Utils::interfaceFromTarget(it.key()))) {
+            it = d->decimationCounters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    // Windows of interfaces which went away are published as they are
+    QHash< QByteArray, WindowState >::iterator windowIt = d->windows.begin();
+    while (windowIt != d->windows.end()) {
+        if (!interfaces.contains(Hyperdrive::Utils::interfaceFromTarget(windowIt.key()))) {
+            Hyperdrive::CacheMessage message = windowMessage(windowIt.value());
+            windowIt = d->windows.erase(windowIt);
+            Q_EMIT messageReady(message);
+        } else {
+            ++windowIt;
+        }
+    }
+}
+
+bool AstarteDatastreamAggregator::hasPolicies() const
+{
+    return !d->policies.isEmpty();
+}
+
+bool AstarteDatastreamAggregator::process(const Hyperdrive::CacheMessage &message)
+{
+    if (d->policies.isEmpty() || message.interfaceType() != Hyperdrive::Interface::Type::DataStream) {
+        return false;
+    }
+
+    QHash< QByteArray, Policy >::const_iterator policyIt = d->policies.constFind(Hyperdrive::Utils::interfaceFromTarget(message.target()));
+    if (policyIt == d->policies.constEnd()) {
+        return false;
+    }
+    const Policy &policy = policyIt.value();
+
+    if (policy.mode == Mode::Decimate) {
+        // Let through the first sample out of every "parameter" ones
+        quint32 &counter = d->decimationCounters[message.target()];
+        bool pass = (counter == 0);
+        counter = (counter + 1) % policy.parameter;
+        if (pass) {
+            return false;
+        }
+        qCDebug(astarteAggregatorDC) << "Decimating sample for" << message.target();
+        return true;
+    }
+
+    double value = 0;
+    if (policy.mode != Mode::Last && !extractNumericValue(message.payload(), &value)) {
+        // Nothing we can aggregate, publish it as it is
+        return false;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QHash< QByteArray, WindowState >::iterator it = d->windows.find(message.target());
+    if (it != d->windows.end() && now - it.value().windowStart >= policy.parameter) {
+        // The window is over: publish it and start a fresh one with this sample
+        WindowState expired = it.value();
+        d->windows.erase(it);
+        it = d->windows.end();
+        Q_EMIT messageReady(windowMessage(expired));
+    }
+
+    if (it == d->windows.end()) {
+        WindowState state;
+        state.windowStart = now;
+        state.min = value;
+        state.max = value;
+        it = d->windows.insert(message.target(), state);
+    }
+
+    WindowState &state = it.value();
+    ++state.count;
+    state.sum += value;
+
+    switch (policy.mode) {
+        case Mode::Min:
+            if (state.count == 1 || value < state.min) {
+                state.min = value;
+                state.selected = message;
+            }
+            break;
+        case Mode::Max:
+            if (state.count == 1 || value > state.max) {
+                state.max = value;
+                state.selected = message;
+            }
+            break;
+        case Mode::Mean:
+            // The mean payload is built only once, when the window gets published
+            state.mean = true;
+            state.selected = message;
+            break;
+        default:
+            state.selected = message;
+            break;
+    }
+
+    return true;
+}
+
+void AstarteDatastreamAggregator::flushExpired()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QHash< QByteArray, WindowState >::iterator it = d->windows.begin();
+    while (it != d->windows.end()) {
+        int window = d->policies.value(Hyperdrive::Utils::interfaceFromTarget(it.key())).parameter;
+        if (now - it.value().windowStart >= window) {
+            Hyperdrive::CacheMessage message = windowMessage(it.value());
+            it = d->windows.erase(it);
+            Q_EMIT messageReady(message);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void AstarteDatastreamAggregator::flushAll()
+{
+    QHash< QByteArray, WindowState > windows = d->windows;
+    d->windows.clear();
+    for (const WindowState &state : windows) {
+        Q_EMIT messageReady(windowMessage(state));
+    }
+}
+
+#include "moc_astartedatastreamaggregator.cpp"
@@ -0,0 +1,68 @@
+#ifndef ASTARTE_DATASTREAM_AGGREGATOR_H
+#define ASTARTE_DATASTREAM_AGGREGATOR_H
+
+#include <cachemessage.h>
+
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+
+class QTimer;
+
+class AstarteDatastreamAggregator : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(AstarteDatastreamAggregator)
+
+public:
+    enum class Mode {
+        None = 0,
+        Last = 1,
+        Min = 2,
+        Max = 3,
+        Mean = 4,
+        Decimate = 5
+    };
+
+    struct Policy {
+        Policy() : mode(Mode::None), parameter(0) {}
+        Policy(Mode m, int p) : mode(m), parameter(p) {}
+
+        bool isValid() const { return mode != Mode::None && parameter > 0; }
+
+        Mode mode;
+        // Window length in milliseconds, or decimation factor for Mode::Decimate
+        int parameter;
+    };
+
+    explicit AstarteDatastreamAggregator(QObject *parent = nullptr);
+    virtual ~AstarteDatastreamAggregator();
+
+    // Parses policies in the form "mean:5000", "last:1000", "decimate:10"
+    static Policy policyFromString(const QString &policy);
+
+    void setPolicy(const QByteArray &interface, const Policy &policy);
+    void clearPolicies();
+    bool hasPolicies() const;
+    // Drops the state kept for paths of interfaces not in the given set
+    void retainInterfaces(const QSet< QByteArray > &interfaces);
+
+    // Returns true if the message has been taken over by the aggregator, and
+    // must not be published by the caller.
+    bool process(const Hyperdrive::CacheMessage &message);
+
+public Q_SLOTS:
+    void flushAll();
+
+Q_SIGNALS:
+    void messageReady(const Hyperdrive::CacheMessage &message);
+
+private Q_SLOTS:
+    void flushExpired();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif // ASTARTE_DATASTREAM_AGGREGATOR_H
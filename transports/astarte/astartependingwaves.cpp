@@ -0,0 +1,152 @@
+#include "astartependingwaves.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QMap>
+#include <QtCore/QTimer>
+
+#include <HyperspaceCore/Global>
+
+#define DEFAULT_CAPACITY 1024
+#define DEFAULT_TIMEOUT (60 * 1000)
+#define EXPIRY_CHECK_INTERVAL (5 * 1000)
+
+Q_LOGGING_CATEGORY(astartePendingWavesDC, "hyperdrive.transport.astarte.pendingwaves", DEBUG_MESSAGES_DEFAULT_LEVEL)
+
+class AstartePendingWaves::Private
+{
+public:
+    Private()
+        : capacity(DEFAULT_CAPACITY)
+        , timeout(DEFAULT_TIMEOUT)
+        , orphanedWaves(0)
+    {
+        clock.start();
+    }
+
+    struct Entry {
+        Hyperspace::Wave wave;
+        QByteArray commandId;
+        qint64 deadline;
+    };
+
+    QHash< quint64, Entry > entries;
+    // Ids by deadline. It's not the insertion order, as the timeout can change while waves are pending.
+    QMultiMap< qint64, quint64 > deadlines;
+    // Monotonic, deadlines must not move with the wall clock
+    QElapsedTimer clock;
+    int capacity;
+    int timeout;
+    quint64 orphanedWaves;
+    QTimer *expiryTimer;
+
+    Entry takeFirst();
+};
+
+AstartePendingWaves::Private::Entry AstartePendingWaves::Private::takeFirst()
+{
+    QMultiMap< qint64, quint64 >::iterator first = deadlines.begin();
+    Entry entry = entries.take(first.value());
+    deadlines.erase(first);
+    return entry;
+}
+
+AstartePendingWaves::AstartePendingWaves(QObject *parent)
+    : QObject(parent)
+    , d(new Private)
+{
+    d->expiryTimer = new QTimer(this);
+    d->expiryTimer->setInterval(EXPIRY_CHECK_INTERVAL);
+    connect(d->expiryTimer, &QTimer::timeout, this, [this] {
+        qint64 now = d->clock.elapsed();
+        while (!d->deadlines.isEmpty() && d->deadlines.firstKey() <= now) {
+            Private::Entry entry = d->takeFirst();
+            ++d->orphanedWaves;
+            qCWarning(astartePendingWavesDC) << "No rebound for wave" << entry.wave.id() << entry.wave.target() << "- orphaned so far:" << d->orphanedWaves;
+            Q_EMIT waveOrphaned(entry.wave, entry.commandId);
+        }
+
+        if (d->entries.isEmpty()) {
+            d->expiryTimer->stop();
+        }
+    });
+}
+
+AstartePendingWaves::~AstartePendingWaves()
+{
+    delete d;
+}
+
+void AstartePendingWaves::setCapacity(int capacity)
+{
+    d->capacity = qMax(1, capacity);
+}
+
+int AstartePendingWaves::capacity() const
+{
+    return d->capacity;
+}
+
+void AstartePendingWaves::setTimeout(int msecs)
+{
+    d->timeout = qMax(1000, msecs);
+}
+
+int AstartePendingWaves::timeout() const
+{
+    return d->timeout;
+}
+
+void AstartePendingWaves::insert(const Hyperspace::Wave &wave, const QByteArray &commandId)
+{
+    while (d->entries.count() >= d->capacity && !d->deadlines.isEmpty()) {
+        Private::Entry entry = d->takeFirst();
+        ++d->orphanedWaves;
+        qCWarning(astartePendingWavesDC) << "Too many waves pending, dropping" << entry.wave.id() << entry.wave.target()
+                                         << "- orphaned so far:" << d->orphanedWaves;
+        Q_EMIT waveOrphaned(entry.wave, entry.commandId);
+    }
+
+    Private::Entry entry;
+    entry.wave = wave;
+    entry.commandId = commandId;
+    entry.deadline = d->clock.elapsed() + d->timeout;
+    // A wave sent again with the same id replaces the pending one
+    QHash< quint64, Private::Entry >::const_iterator previous = d->entries.constFind(wave.id());
+    if (previous != d->entries.constEnd()) {
+        d->deadlines.remove(previous.value().deadline, wave.id());
+    }
+    d->entries.insert(wave.id(), entry);
+    d->deadlines.insert(entry.deadline, wave.id());
+
+    if (!d->expiryTimer->isActive()) {
+        d->expiryTimer->start();
+    }
+}
+
+bool AstartePendingWaves::take(quint64 waveId, Hyperspace::Wave *wave, QByteArray *commandId)
+{
+    QHash< quint64, Private::Entry >::iterator i = d->entries.find(waveId);
+    if (i == d->entries.end()) {
+        return false;
+    }
+
+    *wave = i.value().wave;
+    *commandId = i.value().commandId;
+    d->deadlines.remove(i.value().deadline, waveId);
+    d->entries.erase(i);
+    return true;
+}
+
+int AstartePendingWaves::count() const
+{
+    return d->entries.count();
+}
+
+quint64 AstartePendingWaves::orphanedWaves() const
+{
+    return d->orphanedWaves;
+}
+
+#include "moc_astartependingwaves.cpp"
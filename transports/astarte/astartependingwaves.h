@@ -0,0 +1,40 @@
+#ifndef ASTARTE_PENDING_WAVES_H
+#define ASTARTE_PENDING_WAVES_H
+
+#include <HyperspaceCore/Wave>
+
+#include <QtCore/QObject>
+
+// Inbound waves waiting for their rebound. The table is bounded both in size and in time: waves whose rebound
+// never comes are dropped and accounted as orphans, so that a misbehaving consumer can't make us grow forever.
+class AstartePendingWaves : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(AstartePendingWaves)
+
+public:
+    explicit AstartePendingWaves(QObject *parent = nullptr);
+    virtual ~AstartePendingWaves();
+
+    // When full, the wave closest to its deadline gets orphaned to make room
+    void setCapacity(int capacity);
+    int capacity() const;
+    void setTimeout(int msecs);
+    int timeout() const;
+
+    // commandId is empty when the sender doesn't expect a response
+    void insert(const Hyperspace::Wave &wave, const QByteArray &commandId = QByteArray());
+    bool take(quint64 waveId, Hyperspace::Wave *wave, QByteArray *commandId);
+
+    int count() const;
+    quint64 orphanedWaves() const;
+
+Q_SIGNALS:
+    void waveOrphaned(const Hyperspace::Wave &wave, const QByteArray &commandId);
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif // ASTARTE_PENDING_WAVES_H
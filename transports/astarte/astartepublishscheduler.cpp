@@ -0,0 +1,332 @@
+#include "astartepublishscheduler.h"
+
+#include "astartetransportcache.h"
+
+#include <hyperdriveutils.h>
+
+#include <QtCore/QDateTime>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QQueue>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
+
+#include <HyperspaceCore/Global>
+
+// How many messages each queue can send in a scheduling round
+#define HIGH_PRIORITY_WEIGHT 8
+#define RELIABLE_PRIORITY_WEIGHT 3
+#define UNRELIABLE_PRIORITY_WEIGHT 1
+
+#define DEFAULT_IN_FLIGHT_WINDOW 32
+#define DEFAULT_MAXIMUM_DEFERRED 1024
+#define BUDGET_CHECK_INTERVAL (10 * 60 * 1000)
+
+Q_LOGGING_CATEGORY(astarteSchedulerDC, "hyperdrive.transport.astarte.scheduler", DEBUG_MESSAGES_DEFAULT_LEVEL)
+
+class AstartePublishScheduler::Private
+{
+public:
+    Private()
+        : inFlightWindow(DEFAULT_IN_FLIGHT_WINDOW)
+        , peerReceiveMaximum(0)
+        , current(0)
+        , droppedMessages(0)
+        , maximumDeferred(DEFAULT_MAXIMUM_DEFERRED)
+        , handedOverDeferred(false)
+        , budgetDay(QDate::currentDate())
+    {
+        for (int i = 0; i < PriorityCount; ++i) {
+            queuedBytes[i] = 0;
+            sentMessages[i] = 0;
+            sentBytes[i] = 0;
+            credits[i] = weights[i];
+        }
+    }
+
+    static const int weights[PriorityCount];
+
+    QQueue< Hyperdrive::CacheMessage > queues[PriorityCount];
+    qint64 queuedBytes[PriorityCount];
+    quint64 sentMessages[PriorityCount];
+    quint64 sentBytes[PriorityCount];
+    int credits[PriorityCount];
+
+    QSet< int > inFlight;
+    int inFlightWindow;
+    int peerReceiveMaximum;
+    int current;
+
+    QHash< QByteArray, qint64 > budgets;
+    QHash< QByteArray, qint64 > usage;
+    QList< Hyperdrive::CacheMessage > deferred;
+    quint64 droppedMessages;
+    int maximumDeferred;
+    // Whether deferred messages went to the transport cache since the last budget reset
+    bool handedOverDeferred;
+    QDate budgetDay;
+
+    int nextQueue();
+    void defer(const Hyperdrive::CacheMessage &message);
+    bool isOverBudget(const QByteArray &interface) const;
+    bool checkBudgetDay();
+};
+
+const int AstartePublishScheduler::Private::weights[PriorityCount] = { HIGH_PRIORITY_WEIGHT, RELIABLE_PRIORITY_WEIGHT, UNRELIABLE_PRIORITY_WEIGHT };
+
+int AstartePublishScheduler::Private::nextQueue()
+{
+    bool empty = true;
+    for (int i = 0; i < PriorityCount; ++i) {
+        empty = empty && queues[i].isEmpty();
+    }
+    if (empty) {
+        return -1;
+    }
+
+    // Weighted round robin: as long as there's something queued, this terminates within two rounds
+    Q_FOREVER {
+        if (!queues[current].isEmpty() && credits[current] > 0) {
+            --credits[current];
+            return current;
+        }
+
+        current = (current + 1) % PriorityCount;
+        if (current == 0) {
+            for (int i = 0; i < PriorityCount; ++i) {
+                credits[i] = weights[i];
+            }
+        }
+    }
+}
+
+bool AstartePublishScheduler::Private::isOverBudget(const QByteArray &interface) const
+{
+    qint64 budget = budgets.value(interface);
+    return budget > 0 && usage.value(interface) >= budget;
+}
+
+void AstartePublishScheduler::Private::defer(const Hyperdrive::CacheMessage &message)
+{
+    // Stored messages must survive a restart, and memory is bounded: the transport cache takes care of those
+    if (message.attributes().value("retention").toInt() == static_cast<int>(Hyperspace::Retention::Stored)
+            || deferred.count() >= maximumDeferred) {
+        AstarteTransportCache::instance()->addRetryEntry(message);
+        handedOverDeferred = true;
+        return;
+    }
+
+    deferred.append(message);
+}
+
+bool AstartePublishScheduler::Private::checkBudgetDay()
+{
+    if (budgetDay == QDate::currentDate()) {
+        return false;
+    }
+
+    qCInfo(astarteSchedulerDC) << "New budget day, resetting byte usage and requeueing" << deferred.count() << "deferred messages";
+    budgetDay = QDate::currentDate();
+    usage.clear();
+
+    for (const Hyperdrive::CacheMessage &message : deferred) {
+        queues[static_cast<int>(Priority::Reliable)].enqueue(message);
+        queuedBytes[static_cast<int>(Priority::Reliable)] += message.payload().size();
+    }
+    bool hadDeferred = !deferred.isEmpty() || handedOverDeferred;
+    deferred.clear();
+    handedOverDeferred = false;
+
+    return hadDeferred;
+}
+
+AstartePublishScheduler::AstartePublishScheduler(QObject *parent)
+    : QObject(parent)
+    , d(new Private)
+{
+    QTimer *budgetTimer = new QTimer(this);
+    budgetTimer->setTimerType(Qt::VeryCoarseTimer);
+    budgetTimer->setInterval(BUDGET_CHECK_INTERVAL);
+    connect(budgetTimer, &QTimer::timeout, this, [this] {
+        logStatistics();
+        if (d->checkBudgetDay()) {
+            Q_EMIT messagesAvailable();
+        }
+    });
+    budgetTimer->start();
+}
+
+AstartePublishScheduler::~AstartePublishScheduler()
+{
+    delete d;
+}
+
+AstartePublishScheduler::Priority AstartePublishScheduler::priorityFor(const Hyperdrive::CacheMessage &message)
+{
+    if (message.interfaceType() != Hyperdrive::Interface::Type::DataStream) {
+        return Priority::High;
+    }
+
+    switch (static_cast<Hyperspace::Reliability>(message.attributes().value("reliability").toInt())) {
+        case Hyperspace::Reliability::Guaranteed:
+        case Hyperspace::Reliability::Unique:
+            return Priority::Reliable;
+        default:
+            return Priority::Unreliable;
+    }
+}
+
+void AstartePublishScheduler::setInFlightWindow(int window)
+{
+    d->inFlightWindow = window > 0 ? window : DEFAULT_IN_FLIGHT_WINDOW;
+}
+
+int AstartePublishScheduler::inFlightWindow() const
+{
+    return d->inFlightWindow;
+}
+
+void AstartePublishScheduler::setPeerReceiveMaximum(int receiveMaximum)
+{
+    d->peerReceiveMaximum = receiveMaximum;
+}
+
+void AstartePublishScheduler::setMaximumDeferred(int maximumDeferred)
+{
+    d->maximumDeferred = maximumDeferred >= 0 ? maximumDeferred : DEFAULT_MAXIMUM_DEFERRED;
+}
+
+void AstartePublishScheduler::setByteBudget(const QByteArray &interface, qint64 bytesPerDay)
+{
+    if (bytesPerDay > 0) {
+        qCInfo(astarteSchedulerDC) << "Daily byte budget for" << interface << "is" << bytesPerDay;
+        d->budgets.insert(interface, bytesPerDay);
+    } else {
+        d->budgets.remove(interface);
+    }
+}
+
+qint64 AstartePublishScheduler::usedBytes(const QByteArray &interface) const
+{
+    return d->usage.value(interface);
+}
+
+void AstartePublishScheduler::enqueue(const Hyperdrive::CacheMessage &message)
+{
+    int priority = static_cast<int>(priorityFor(message));
+    d->queues[priority].enqueue(message);
+    d->queuedBytes[priority] += message.payload().size();
+}
+
+bool AstartePublishScheduler::takeNext(Hyperdrive::CacheMessage *message)
+{
+    d->checkBudgetDay();
+
+    // Anything beyond the broker's receive maximum would just sit in libmosquitto's queue, out of our priorities
+    int window = d->peerReceiveMaximum > 0 ? qMin(d->inFlightWindow, d->peerReceiveMaximum) : d->inFlightWindow;
+
+    while (d->inFlight.size() < window) {
+        int priority = d->nextQueue();
+        if (priority < 0) {
+            return false;
+        }
+
+        Hyperdrive::CacheMessage next = d->queues[priority].dequeue();
+        d->queuedBytes[priority] -= next.payload().size();
+
+        if (priority != static_cast<int>(Priority::High) && d->isOverBudget(Hyperdrive::Utils::interfaceFromTarget(next.target()))) {
+            if (priority == static_cast<int>(Priority::Unreliable)) {
+                qCDebug(astarteSchedulerDC) << "Byte budget exhausted, dropping" << next.target();
+                ++d->droppedMessages;
+            } else {
+                qCDebug(astarteSchedulerDC) << "Byte budget exhausted, deferring" << next.target();
+                d->defer(next);
+            }
+            continue;
+        }
+
+        *message = next;
+        return true;
+    }
+
+    return false;
+}
+
+void AstartePublishScheduler::trackInFlight(int messageId, const Hyperdrive::CacheMessage &message, int wireSize)
+{
+    if (messageId < 0) {
+        return;
+    }
+
+    int priority = static_cast<int>(priorityFor(message));
+    ++d->sentMessages[priority];
+    d->sentBytes[priority] += wireSize;
+    d->usage[Hyperdrive::Utils::interfaceFromTarget(message.target())] += wireSize;
+    d->inFlight.insert(messageId);
+}
+
+void AstartePublishScheduler::confirm(int messageId)
+{
+    d->inFlight.remove(messageId);
+}
+
+void AstartePublishScheduler::resetInFlight()
+{
+    d->inFlight.clear();
+}
+
+int AstartePublishScheduler::inFlightCount() const
+{
+    return d->inFlight.size();
+}
+
+bool AstartePublishScheduler::isEmpty() const
+{
+    for (int i = 0; i < PriorityCount; ++i) {
+        if (!d->queues[i].isEmpty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int AstartePublishScheduler::queuedMessages(Priority priority) const
+{
+    return d->queues[static_cast<int>(priority)].count();
+}
+
+qint64 AstartePublishScheduler::queuedBytes(Priority priority) const
+{
+    return d->queuedBytes[static_cast<int>(priority)];
+}
+
+quint64 AstartePublishScheduler::sentMessages(Priority priority) const
+{
+    return d->sentMessages[static_cast<int>(priority)];
+}
+
+quint64 AstartePublishScheduler::sentBytes(Priority priority) const
+{
+    return d->sentBytes[static_cast<int>(priority)];
+}
+
+quint64 AstartePublishScheduler::droppedMessages() const
+{
+    return d->droppedMessages;
+}
+
+int AstartePublishScheduler::deferredMessages() const
+{
+    return d->deferred.count();
+}
+
+void AstartePublishScheduler::logStatistics() const
+{
+    static const char *names[PriorityCount] = { "high", "reliable", "unreliable" };
+    for (int i = 0; i < PriorityCount; ++i) {
+        qCInfo(astarteSchedulerDC) << "Queue" << names[i] << "- queued:" << d->queues[i].count() << "messages," << d->queuedBytes[i] << "bytes"
+                                   << "- sent:" << d->sentMessages[i] << "messages," << d->sentBytes[i] << "bytes";
+    }
+    qCInfo(astarteSchedulerDC) << "In flight:" << d->inFlight.size() << "- deferred:" << d->deferred.count() << "- dropped:" << d->droppedMessages;
+}
+
+#include "moc_astartepublishscheduler.cpp"
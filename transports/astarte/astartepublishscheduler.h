@@ -0,0 +1,71 @@
+#ifndef ASTARTE_PUBLISH_SCHEDULER_H
+#define ASTARTE_PUBLISH_SCHEDULER_H
+
+#include <cachemessage.h>
+
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+
+class AstartePublishScheduler : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(AstartePublishScheduler)
+
+public:
+    enum class Priority {
+        // Properties and control messages
+        High = 0,
+        // Guaranteed and unique datastreams
+        Reliable = 1,
+        // Unreliable datastreams
+        Unreliable = 2
+    };
+    static const int PriorityCount = 3;
+
+    explicit AstartePublishScheduler(QObject *parent = nullptr);
+    virtual ~AstartePublishScheduler();
+
+    static Priority priorityFor(const Hyperdrive::CacheMessage &message);
+
+    void setInFlightWindow(int window);
+    int inFlightWindow() const;
+    // The broker's receive maximum further limits the window. 0 means no limit.
+    void setPeerReceiveMaximum(int receiveMaximum);
+
+    // Bytes per day an interface may use before its low priority traffic gets deferred or dropped. <= 0 disables it.
+    void setByteBudget(const QByteArray &interface, qint64 bytesPerDay);
+    qint64 usedBytes(const QByteArray &interface) const;
+    // Deferred messages kept in memory. Further ones, and stored ones, go to the transport cache retry queue.
+    void setMaximumDeferred(int maximumDeferred);
+
+    void enqueue(const Hyperdrive::CacheMessage &message);
+    bool takeNext(Hyperdrive::CacheMessage *message);
+
+    // messageId as returned by publish. Negative values are not tracked.
+    void trackInFlight(int messageId, const Hyperdrive::CacheMessage &message, int wireSize);
+    void confirm(int messageId);
+    void resetInFlight();
+    int inFlightCount() const;
+
+    bool isEmpty() const;
+    int queuedMessages(Priority priority) const;
+    qint64 queuedBytes(Priority priority) const;
+    quint64 sentMessages(Priority priority) const;
+    quint64 sentBytes(Priority priority) const;
+    quint64 droppedMessages() const;
+    int deferredMessages() const;
+
+public Q_SLOTS:
+    void logStatistics() const;
+
+Q_SIGNALS:
+    // Emitted when deferred messages become available again after the budget reset. Those handed over
+    // to the transport cache are waiting among its retry entries.
+    void messagesAvailable();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+#endif // ASTARTE_PUBLISH_SCHEDULER_H
@@ -4,6 +4,9 @@
 
 #include "astartetransport.h"
 
+#include "astartedatastreamaggregator.h"
+#include "astartependingwaves.h"
+#include "astartepublishscheduler.h"
 #include "astartetransportcache.h"
 
 #include <HemeraCore/DeviceManagement>
@@ -40,6 +43,8 @@
 #include <astartegatewayendpoint.h>
 #include <astartehttpendpoint.h>
 
+#include <HyperspaceCore/BSONDocument>
+
 #include <HyperspaceProducerConsumer/ProducerAbstractInterface>
 
 #include <signal.h>
@@ -55,6 +60,13 @@
 #define METHOD_ERROR "ERROR"
 
 #define CERTIFICATE_RENEWAL_DAYS 8
+#define CERTIFICATE_CHECK_INTERVAL (12 * 60 * 60 * 1000)
+// How long the old session gets to see its in-flight messages confirmed before being replaced
+#define SWITCHOVER_TIMEOUT (30 * 1000)
+
+// Bursts of command responses are paced: at most RESPONSE_BATCH_SIZE of them go out every RESPONSE_BATCH_INTERVAL ms
+#define RESPONSE_BATCH_INTERVAL 200
+#define RESPONSE_BATCH_SIZE 32
 
 Q_LOGGING_CATEGORY(astarteTransportDC, "hyperdrive.transport.astarte", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
@@ -63,20 +75,65 @@ namespace Hyperdrive
 
 AstarteTransport::AstarteTransport(QObject* parent)
     : RemoteTransport(QStringLiteral("Astarte"), parent)
+    , m_datastreamAggregator(new AstarteDatastreamAggregator(this))
+    , m_publishScheduler(new AstartePublishScheduler(this))
+    , m_pendingWaves(new AstartePendingWaves(this))
     , m_rebootTimer(new QTimer(this))
+    , m_certificateCheckTimer(new QTimer(this))
+    , m_switchOverTimer(new QTimer(this))
+    , m_responseTimer(new QTimer(this))
     , m_rebootWhenConnectionFails(false)
+    , m_renewingCertificate(false)
+    , m_switchingBroker(false)
+    , m_mqttLoopMode(MQTTClientWrapper::ThreadedLoopMode)
+    , m_mqttProtocolVersion(MQTTClientWrapper::MQTT311ProtocolVersion)
+    , m_mqttTopicAliasMaximum(64)
     , m_rebootDelayMinutes(600)
+    , m_responseBatchSize(RESPONSE_BATCH_SIZE)
     , m_inFlightIntrospectionMessageId(-1)
+    , m_inFlightProducerPropertiesMessageId(-1)
 {
     qRegisterMetaType<MQTTClientWrapper::Status>();
     connect(this, &AstarteTransport::introspectionChanged, this, [this] {
+            m_datastreamAggregator->retainInterfaces(QSet< QByteArray >::fromList(introspection().keys()));
             publishIntrospection();
             setupClientSubscriptions();
     });
+    connect(m_datastreamAggregator, &AstarteDatastreamAggregator::messageReady, this, &AstarteTransport::publishCacheMessage);
+    connect(m_publishScheduler, &AstartePublishScheduler::messagesAvailable, this, [this] {
+            // Deferred messages which overflowed into the retry queue go again too. When offline, reconnecting does that.
+            if (!m_mqttBroker.isNull() && m_mqttBroker->status() == MQTTClientWrapper::ConnectedStatus) {
+                resendFailedMessages();
+            }
+            drainPublishQueue();
+    });
+
+    // Certificates might expire while we are happily connected
+    m_certificateCheckTimer->setTimerType(Qt::VeryCoarseTimer);
+    m_certificateCheckTimer->setInterval(CERTIFICATE_CHECK_INTERVAL);
+    connect(m_certificateCheckTimer, &QTimer::timeout, this, &AstarteTransport::checkCertificateExpiry);
+    m_certificateCheckTimer->start();
+
+    m_switchOverTimer->setSingleShot(true);
+    m_switchOverTimer->setInterval(SWITCHOVER_TIMEOUT);
+    connect(m_switchOverTimer, &QTimer::timeout, this, &AstarteTransport::switchOver);
+
+    m_responseTimer->setSingleShot(true);
+    m_responseTimer->setInterval(RESPONSE_BATCH_INTERVAL);
+    connect(m_responseTimer, &QTimer::timeout, this, &AstarteTransport::flushCommandResponses);
+
+    // Whoever sent a command still deserves an answer if our consumer never replies
+    connect(m_pendingWaves, &AstartePendingWaves::waveOrphaned, this, [this] (const Hyperspace::Wave &wave, const QByteArray &commandId) {
+        if (!commandId.isEmpty()) {
+            queueCommandResponse(wave.target(), commandId, Hyperspace::ResponseCode::InternalError);
+        }
+    });
 }
 
 AstarteTransport::~AstarteTransport()
 {
+    // Don't lose the pending aggregation windows: they either get published or end up in the retry queue
+    m_datastreamAggregator->flushAll();
 }
 
 void AstarteTransport::initImpl()
@@ -109,21 +166,52 @@ void AstarteTransport::initImpl()
             if (settings.childKeys().contains(QStringLiteral("endpoint"))) {
                 m_astarteEndpoint = new Astarte::HTTPEndpoint(settings.value(QStringLiteral("endpoint")).toUrl(), QSslConfiguration::defaultConfiguration(), this);
             } else {
-                m_astarteEndpoint = new Astarte::GatewayEndpoint(settings.value(QStringLiteral("gateway")).toUrl(), this);
+                Astarte::GatewayEndpoint *gatewayEndpoint = new Astarte::GatewayEndpoint(settings.value(QStringLiteral("gateway")).toUrl(), this);
+                // Overrides the automatic detection of the local gateway socket. Empty disables it.
+                if (settings.childKeys().contains(QStringLiteral("gatewaySocket"))) {
+                    gatewayEndpoint->setLocalSocketPath(settings.value(QStringLiteral("gatewaySocket")).toString());
+                }
+                m_astarteEndpoint = gatewayEndpoint;
             }
 
-            m_rebootWhenConnectionFails = settings.value(QStringLiteral("rebootWhenConnectionFails"), false).toBool();
-            m_rebootDelayMinutes = settings.value(QStringLiteral("rebootDelayMinutes"), 600).toInt();
-            m_rebootTimer->setTimerType(Qt::VeryCoarseTimer);
-            int randomizedRebootDelayms = Hyperdrive::Utils::randomizedInterval(m_rebootDelayMinutes * 60 * 1000, 0.1);
-            m_rebootTimer->setInterval(randomizedRebootDelayms);
-
-            if (m_rebootWhenConnectionFails) {
-                qCDebug(astarteTransportDC) << "Activating the reboot timer with delay " << (randomizedRebootDelayms / (60 * 1000)) << " minutes";
-                m_rebootTimer->start();
+            // "eventloop" drives the MQTT socket from our own thread, "thread" lets libmosquitto spawn its own
+            if (settings.value(QStringLiteral("mqttLoopMode")).toString() == QStringLiteral("eventloop")) {
+                m_mqttLoopMode = MQTTClientWrapper::EventLoopMode;
             }
+            // MQTT 5 saves bandwidth with topic aliases, and falls back to 3.1.1 if the broker doesn't support it
+            if (settings.value(QStringLiteral("mqttProtocolVersion")).toInt() == 5) {
+                m_mqttProtocolVersion = MQTTClientWrapper::MQTT5ProtocolVersion;
+            }
+            m_mqttTopicAliasMaximum = settings.value(QStringLiteral("mqttTopicAliasMaximum"), 64).toInt();
+
+            m_rebootTimer->setTimerType(Qt::VeryCoarseTimer);
             connect(m_rebootTimer, &QTimer::timeout, this, &AstarteTransport::handleRebootTimerTimeout);
 
+            // We might have started from cached endpoint info which turned out to be stale
+            connect(m_astarteEndpoint, &Astarte::Endpoint::mqttBrokerUrlChanged, this, [this] {
+                if (m_mqttBroker.isNull()) {
+                    return;
+                }
+                qCInfo(astarteTransportDC) << "Broker changed, reconnecting";
+                // Until it's deleted, the old client must not reach us anymore
+                disconnect(m_mqttBroker, nullptr, this, nullptr);
+                m_mqttBroker->disconnectFromBroker();
+                m_mqttBroker->deleteLater();
+                // A session switch towards the old broker is moot
+                if (!m_nextMqttBroker.isNull()) {
+                    m_nextMqttBroker->deleteLater();
+                }
+                m_switchOverTimer->stop();
+                m_switchingBroker = false;
+                m_renewingCertificate = false;
+                // Message ids of the old session will never be confirmed by the new one
+                AstarteTransportCache::instance()->resetInFlightEntries();
+                m_publishScheduler->resetInFlight();
+                m_inFlightIntrospectionMessageId = -1;
+                m_inFlightProducerPropertiesMessageId = -1;
+                setupMqtt();
+            });
+
             connect(m_astarteEndpoint->init(), &Hemera::Operation::finished, this, [this] (Hemera::Operation *op) {
                 if (op->isError()) {
                     // TODO
@@ -143,9 +231,120 @@ void AstarteTransport::initImpl()
                 }
             });
         } settings.endGroup();
+
+        m_configurationPath = confDir.absoluteFilePath(conf);
+        m_restartOnlyConfiguration = restartOnlyConfiguration(m_configurationPath);
+        applyTunables(m_configurationPath);
     }
 }
 
+// Keys of the AstarteTransport group which can be changed on a running transport
+static const char *tunableKeys[] = { "rebootWhenConnectionFails", "rebootDelayMinutes", "inFlightWindow",
+                                     "maximumDeferredMessages", "pendingWavesMaximum", "pendingWaveTimeout", "responseBatchInterval", "responseBatchSize" };
+
+QVariantMap AstarteTransport::restartOnlyConfiguration(const QString &configurationPath)
+{
+    QVariantMap ret;
+    QSettings settings(configurationPath, QSettings::IniFormat);
+    settings.beginGroup(QStringLiteral("AstarteTransport")); {
+        for (const QString &key : settings.childKeys()) {
+            bool tunable = false;
+            for (const char *tunableKey : tunableKeys) {
+                if (key == QLatin1String(tunableKey)) {
+                    tunable = true;
+                    break;
+                }
+            }
+            if (!tunable) {
+                ret.insert(key, settings.value(key));
+            }
+        }
+    } settings.endGroup();
+
+    return ret;
+}
+
+void AstarteTransport::applyTunables(const QString &configurationPath)
+{
+    QSettings settings(configurationPath, QSettings::IniFormat);
+    settings.beginGroup(QStringLiteral("AstarteTransport")); {
+        m_rebootWhenConnectionFails = settings.value(QStringLiteral("rebootWhenConnectionFails"), false).toBool();
+        int rebootDelayMinutes = settings.value(QStringLiteral("rebootDelayMinutes"), 600).toInt();
+        if (rebootDelayMinutes != m_rebootDelayMinutes || m_rebootTimer->interval() == 0) {
+            m_rebootDelayMinutes = rebootDelayMinutes;
+            m_rebootTimer->setInterval(Hyperdrive::Utils::randomizedInterval(m_rebootDelayMinutes * 60 * 1000, 0.1));
+            if (m_rebootTimer->isActive()) {
+                m_rebootTimer->start();
+            }
+        }
+
+        bool connected = !m_mqttBroker.isNull() && m_mqttBroker->status() == MQTTClientWrapper::ConnectedStatus;
+        if (!m_rebootWhenConnectionFails) {
+            m_rebootTimer->stop();
+        } else if (!connected && !m_rebootTimer->isActive()) {
+            qCDebug(astarteTransportDC) << "Activating the reboot timer with delay " << (m_rebootTimer->interval() / (60 * 1000)) << " minutes";
+            m_rebootTimer->start();
+        }
+
+        // How many messages we hand over to the MQTT client before waiting for confirmations
+        m_publishScheduler->setInFlightWindow(settings.value(QStringLiteral("inFlightWindow"), 32).toInt());
+        // Over budget messages waiting in memory for the next budget day
+        m_publishScheduler->setMaximumDeferred(settings.value(QStringLiteral("maximumDeferredMessages"), 1024).toInt());
+        // Inbound waves waiting for a rebound, and how long they may wait
+        m_pendingWaves->setCapacity(settings.value(QStringLiteral("pendingWavesMaximum"), 1024).toInt());
+        m_pendingWaves->setTimeout(settings.value(QStringLiteral("pendingWaveTimeout"), 60).toInt() * 1000);
+        m_responseTimer->setInterval(settings.value(QStringLiteral("responseBatchInterval"), RESPONSE_BATCH_INTERVAL).toInt());
+        m_responseBatchSize = qMax(1, settings.value(QStringLiteral("responseBatchSize"), RESPONSE_BATCH_SIZE).toInt());
+    } settings.endGroup();
+
+    // Client-side aggregation of high-rate datastreams, in the form interface=mode:parameter
+    if (m_datastreamAggregator->hasPolicies()) {
+        // Pending windows get published with the old policy
+        m_datastreamAggregator->clearPolicies();
+    }
+    settings.beginGroup(QStringLiteral("DatastreamPolicies")); {
+        for (const QString &interface : settings.childKeys()) {
+            m_datastreamAggregator->setPolicy(interface.toLatin1(),
+                                              AstarteDatastreamAggregator::policyFromString(settings.value(interface).toString()));
+        }
+    } settings.endGroup();
+
+    // Daily byte budgets for metered links, in the form interface=bytes
+    QSet< QByteArray > budgetedInterfaces;
+    settings.beginGroup(QStringLiteral("ByteBudgets")); {
+        for (const QString &interface : settings.childKeys()) {
+            m_publishScheduler->setByteBudget(interface.toLatin1(), settings.value(interface).toLongLong());
+            budgetedInterfaces.insert(interface.toLatin1());
+        }
+    } settings.endGroup();
+    for (const QByteArray &interface : m_budgetedInterfaces - budgetedInterfaces) {
+        m_publishScheduler->setByteBudget(interface, 0);
+    }
+    m_budgetedInterfaces = budgetedInterfaces;
+}
+
+bool AstarteTransport::reloadConfiguration()
+{
+    QDir confDir(QLatin1String(Hyperdrive::StaticConfig::hyperspaceConfigurationDir()));
+    QString configurationPath = confDir.absoluteFilePath(QStringLiteral("transport-astarte.conf"));
+    if (configurationPath != m_configurationPath || !QFile::exists(configurationPath)) {
+        return false;
+    }
+
+    // Endpoint, pairing and MQTT session settings need a fresh start
+    QVariantMap restartOnly = restartOnlyConfiguration(configurationPath);
+    if (restartOnly != m_restartOnlyConfiguration) {
+        qCInfo(astarteTransportDC) << "Endpoint or session settings changed, a restart is needed";
+        return false;
+    }
+
+    qCInfo(astarteTransportDC) << "Applying the new configuration in place";
+    applyTunables(configurationPath);
+    // The new window might let some more messages go
+    drainPublishQueue();
+    return true;
+}
+
 void AstarteTransport::startPairing(bool forcedPairing) {
     connect(m_astarteEndpoint->pair(forcedPairing), &Hemera::Operation::finished, this, [this, forcedPairing] (Hemera::Operation *pOp) {
         if (pOp->isError()) {
@@ -169,27 +368,153 @@ void AstarteTransport::setupMqtt()
 {
     // Good. Let's set up our MQTT broker.
     m_mqttBroker = m_astarteEndpoint->createMqttClientWrapper();
+    m_activeSubscriptions.clear();
 
     if (m_mqttBroker.isNull()) {
         qCWarning(astarteTransportDC) << "Could not create the MQTT client!!";
         return;
     }
 
+    // An expired certificate won't get us anywhere. One which is about to expire gets renewed once connected.
     if (m_mqttBroker->clientCertificateExpiry().isValid() &&
-        QDateTime::currentDateTime().daysTo(m_mqttBroker->clientCertificateExpiry()) <= CERTIFICATE_RENEWAL_DAYS) {
+        QDateTime::currentDateTime() >= m_mqttBroker->clientCertificateExpiry()) {
         forceNewPairing();
         return;
     }
 
+    configureMqttClient(m_mqttBroker);
+
     connect(m_mqttBroker->init(), &Hemera::Operation::finished, this, [this] {
         m_mqttBroker->setKeepAlive(60);
+        m_mqttBroker->setLoopMode(m_mqttLoopMode);
         m_mqttBroker->connectToBroker();
     });
-    connect(m_mqttBroker, &MQTTClientWrapper::statusChanged, this, &AstarteTransport::onStatusChanged);
-    connect(m_mqttBroker, &MQTTClientWrapper::messageReceived, this, &AstarteTransport::onMQTTMessageReceived);
-    connect(m_mqttBroker, &MQTTClientWrapper::publishConfirmed, this, &AstarteTransport::onPublishConfirmed);
-    connect(m_mqttBroker, &MQTTClientWrapper::connackTimeout, this, &AstarteTransport::handleConnackTimeout);
-    connect(m_mqttBroker, &MQTTClientWrapper::connectionFailed, this, &AstarteTransport::handleConnectionFailed);
+}
+
+void AstarteTransport::configureMqttClient(MQTTClientWrapper *client)
+{
+    client->setProtocolVersion(m_mqttProtocolVersion);
+    client->setTopicAliasMaximum(m_mqttTopicAliasMaximum);
+
+    connect(client, &MQTTClientWrapper::statusChanged, this, &AstarteTransport::onStatusChanged);
+    connect(client, &MQTTClientWrapper::messageReceived, this, &AstarteTransport::onMQTTMessageReceived);
+    connect(client, &MQTTClientWrapper::publishConfirmed, this, &AstarteTransport::onPublishConfirmed);
+    connect(client, &MQTTClientWrapper::connackTimeout, this, &AstarteTransport::handleConnackTimeout);
+    connect(client, &MQTTClientWrapper::connectionFailed, this, &AstarteTransport::handleConnectionFailed);
+}
+
+void AstarteTransport::checkCertificateExpiry()
+{
+    if (m_mqttBroker.isNull() || m_renewingCertificate || !m_mqttBroker->clientCertificateExpiry().isValid()) {
+        return;
+    }
+
+    if (QDateTime::currentDateTime().daysTo(m_mqttBroker->clientCertificateExpiry()) <= CERTIFICATE_RENEWAL_DAYS) {
+        renewCertificate();
+    }
+}
+
+void AstarteTransport::renewCertificate()
+{
+    if (m_mqttBroker.isNull()) {
+        // Nothing to keep up, the regular pairing takes care of it
+        m_renewingCertificate = false;
+        return;
+    }
+
+    // Make before break: the current session stays up while we pair again and open a new one
+    qCInfo(astarteTransportDC) << "Client certificate expires on" << m_mqttBroker->clientCertificateExpiry() << ", renewing it";
+    m_renewingCertificate = true;
+
+    connect(m_astarteEndpoint->pair(true), &Hemera::Operation::finished, this, [this] (Hemera::Operation *pOp) {
+        if (pOp->isError()) {
+            int retryInterval = Hyperdrive::Utils::randomizedInterval(PAIRING_RETRY_INTERVAL, 1.0);
+            qCWarning(astarteTransportDC) << "Certificate renewal failed!!" << pOp->errorMessage() << ", retrying in " << (retryInterval / 1000) << " seconds";
+            QTimer::singleShot(retryInterval, this, &AstarteTransport::renewCertificate);
+            return;
+        }
+
+        m_nextMqttBroker = m_astarteEndpoint->createMqttClientWrapper();
+        if (m_nextMqttBroker.isNull()) {
+            qCWarning(astarteTransportDC) << "Could not create the MQTT client for the renewed certificate!!";
+            m_renewingCertificate = false;
+            return;
+        }
+
+        connect(m_nextMqttBroker->init(), &Hemera::Operation::finished, this, [this] {
+            if (m_nextMqttBroker.isNull()) {
+                // A forced pairing got in the way
+                return;
+            }
+
+            m_nextMqttBroker->setKeepAlive(60);
+            m_nextMqttBroker->setLoopMode(m_mqttLoopMode);
+
+            // Same client id and a persistent session: the broker hands subscriptions and queued messages over to the
+            // new session. Hold new publishes and let the old session confirm what it has in flight first.
+            qCInfo(astarteTransportDC) << "Renewed certificate ready, switching session over";
+            m_switchingBroker = true;
+            m_switchOverTimer->start();
+            trySwitchOver();
+        });
+    });
+}
+
+void AstarteTransport::trySwitchOver()
+{
+    if (m_switchingBroker && m_publishScheduler->inFlightCount() == 0 && m_inFlightIntrospectionMessageId < 0) {
+        switchOver();
+    }
+}
+
+void AstarteTransport::switchOver()
+{
+    m_switchOverTimer->stop();
+    if (m_nextMqttBroker.isNull()) {
+        m_switchingBroker = false;
+        m_renewingCertificate = false;
+        return;
+    }
+
+    if (!m_mqttBroker.isNull()) {
+        // From now on the old session is none of our business. Until its client is gone, libmosquitto might still
+        // deliver what it has in flight, so the new session takes over only afterwards.
+        disconnect(m_mqttBroker, nullptr, this, nullptr);
+        connect(m_mqttBroker, &QObject::destroyed, this, &AstarteTransport::completeSwitchOver);
+        m_mqttBroker->disconnectFromBroker();
+        m_mqttBroker->deleteLater();
+        return;
+    }
+
+    completeSwitchOver();
+}
+
+void AstarteTransport::completeSwitchOver()
+{
+    if (!m_switchingBroker || m_nextMqttBroker.isNull()) {
+        // A forced pairing got in the way
+        m_switchingBroker = false;
+        m_renewingCertificate = false;
+        return;
+    }
+
+    if (m_publishScheduler->inFlightCount() > 0 || m_inFlightIntrospectionMessageId >= 0) {
+        // The old session didn't make it in time: whatever wasn't confirmed gets sent again by the new one
+        qCWarning(astarteTransportDC) << "Switching session with" << m_publishScheduler->inFlightCount() << "messages in flight";
+        AstarteTransportCache::instance()->resetInFlightEntries();
+        m_publishScheduler->resetInFlight();
+        m_inFlightIntrospectionMessageId = -1;
+    }
+
+    // Subscriptions belong to the session, so m_activeSubscriptions still holds
+    m_mqttBroker = m_nextMqttBroker;
+    m_nextMqttBroker.clear();
+    configureMqttClient(m_mqttBroker);
+
+    m_switchingBroker = false;
+    m_renewingCertificate = false;
+
+    m_mqttBroker->connectToBroker();
 }
 
 void AstarteTransport::onMQTTMessageReceived(const QByteArray& topic, const QByteArray& payload)
@@ -208,7 +533,15 @@ void AstarteTransport::onMQTTMessageReceived(const QByteArray& topic, const QByt
     w.setMethod(METHOD_WRITE);
     w.setTarget(relativeTopic);
     w.setPayload(payload);
-    m_waveStorage.insert(w.id(), w);
+
+    // Commands carry an id in their payload, and get acknowledged on /response once our consumer rebounds
+    QByteArray commandId;
+    Hyperspace::Util::BSONDocument doc(payload);
+    if (doc.isValid() && doc.contains("c")) {
+        commandId = doc.value("c").toByteArray();
+    }
+
+    m_pendingWaves->insert(w, commandId);
     qCDebug(astarteTransportDC) << "Sending wave" << w.method() << w.target();
     routeWave(w, -1);
 }
@@ -219,46 +552,112 @@ void AstarteTransport::setupClientSubscriptions()
         qCWarning(astarteTransportDC) << "Can't publish subscriptions, broker is null";
         return;
     }
+
+    QSet< QByteArray > subscriptions;
     // Setup subscriptions to control interface
-    m_mqttBroker->subscribe(m_mqttBroker->rootClientTopic() + "/control/#", MQTTClientWrapper::ExactlyOnceQoS);
+    subscriptions.insert(m_mqttBroker->rootClientTopic() + "/control/#");
     // Setup subscriptions to interfaces where we can receive data
     for (QHash< QByteArray, Hyperdrive::Interface >::const_iterator i = introspection().constBegin(); i != introspection().constEnd(); ++i) {
         if (i.value().interfaceQuality() == Interface::Quality::Consumer) {
             // Subscribe to the interface itself
-            m_mqttBroker->subscribe(m_mqttBroker->rootClientTopic() + "/" + i.value().interface(), MQTTClientWrapper::ExactlyOnceQoS);
+            subscriptions.insert(m_mqttBroker->rootClientTopic() + "/" + i.value().interface());
             // Subscribe to the interface properties
-            m_mqttBroker->subscribe(m_mqttBroker->rootClientTopic() + "/" + i.value().interface() + "/#", MQTTClientWrapper::ExactlyOnceQoS);
+            subscriptions.insert(m_mqttBroker->rootClientTopic() + "/" + i.value().interface() + "/#");
+        }
+    }
+
+    // Only send what actually changed
+    QList< QByteArray > added = (subscriptions - m_activeSubscriptions).toList();
+    QList< QByteArray > removed = (m_activeSubscriptions - subscriptions).toList();
+
+    if (!removed.isEmpty()) {
+        qCDebug(astarteTransportDC) << "Unsubscribing from" << removed;
+        if (m_mqttBroker->unsubscribe(removed)) {
+            for (const QByteArray &topic : removed) {
+                m_activeSubscriptions.remove(topic);
+            }
+        }
+    }
+
+    if (!added.isEmpty()) {
+        qCDebug(astarteTransportDC) << "Subscribing to" << added;
+        if (m_mqttBroker->subscribe(added, MQTTClientWrapper::ExactlyOnceQoS)) {
+            m_activeSubscriptions.unite(QSet< QByteArray >::fromList(added));
         }
     }
 }
 
-void AstarteTransport::sendProperties()
+void AstarteTransport::sendProperties(bool onlyUnsynced)
 {
-    for (QHash< QByteArray, QByteArray >::const_iterator i = AstarteTransportCache::instance()->allPersistentEntries().constBegin();
-         i != AstarteTransportCache::instance()->allPersistentEntries().constEnd();
-         ++i) {
+    QList< QByteArray > targets;
+    int skipped = 0;
+    for (const QByteArray &target : AstarteTransportCache::instance()->persistentTargets()) {
+        if (onlyUnsynced && AstarteTransportCache::instance()->isEntrySynced(target)) {
+            ++skipped;
+            continue;
+        }
+        targets.append(target);
+    }
+
+    if (skipped > 0) {
+        qCInfo(astarteTransportDC) << "Skipped" << skipped << "properties already confirmed in this session";
+    }
 
-        // Recreate the cacheMessage
-        CacheMessage c;
-        c.setTarget(i.key());
-        c.setPayload(i.value());
-        c.setInterfaceType(Hyperdrive::Interface::Type::Properties);
+    if (targets.isEmpty()) {
+        return;
+    }
 
-        if (m_mqttBroker.isNull()) {
-            handleFailedPublish(c);
-            continue;
+    // The resync is over once all of them have been confirmed
+    m_resyncPendingTargets = QSet< QByteArray >::fromList(targets);
+
+    // We only keep hashes around, the payloads come from Hyperdrive's cache
+    RemoteByteArrayListOperation *op = producerProperties(targets);
+    connect(op, &Hemera::Operation::finished, this, [this, op, targets] {
+        if (op->isError()) {
+            // The resync stays incomplete, and is resumed on the next connection
+            qCWarning(astarteTransportDC) << "Could not fetch the cached properties!" << op->errorMessage();
+            return;
         }
 
-        int rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + i.key(), i.value(), MQTTClientWrapper::ExactlyOnceQoS);
-        if (rc < 0) {
-            // If it's < 0, it's an error
-            handleFailedPublish(c);
-        } else {
-            // Otherwise, it's the messageId
-            qCInfo(astarteTransportDC) << "Inserting in-flight message id " << rc;
-            AstarteTransportCache::instance()->addInFlightEntry(rc, c);
+        QList< QByteArray > payloads = op->result();
+        for (int i = 0; i < targets.size() && i < payloads.size(); ++i) {
+            if (payloads.at(i).isEmpty()) {
+                // It got unset in the meanwhile, the corresponding cache message is on its way
+                qCDebug(astarteTransportDC) << targets.at(i) << "is not in Hyperdrive's cache anymore";
+                m_resyncPendingTargets.remove(targets.at(i));
+                continue;
+            }
+
+            // Recreate the cacheMessage
+            CacheMessage c;
+            c.setTarget(targets.at(i));
+            c.setPayload(payloads.at(i));
+            c.setInterfaceType(Hyperdrive::Interface::Type::Properties);
+
+            if (m_mqttBroker.isNull()) {
+                handleFailedPublish(c);
+                continue;
+            }
+
+            // Bypass the unchanged check, we're republishing on purpose. The scheduler paces them within the in-flight window.
+            m_publishScheduler->enqueue(c);
         }
+
+        drainPublishQueue();
+        checkResyncCompleted();
+    });
+}
+
+void AstarteTransport::checkResyncCompleted()
+{
+    if (m_synced || m_inFlightProducerPropertiesMessageId >= 0 || !m_resyncPendingTargets.isEmpty()) {
+        return;
     }
+
+    qCInfo(astarteTransportDC) << "Resync completed";
+    m_synced = true;
+    QSettings syncSettings(QStringLiteral("%1/transportStatus.conf").arg(QDir::homePath()), QSettings::IniFormat);
+    syncSettings.setValue(QStringLiteral("isSynced"), true);
 }
 
 void AstarteTransport::resendFailedMessages()
@@ -266,40 +665,68 @@ void AstarteTransport::resendFailedMessages()
     QList<int> ids = AstarteTransportCache::instance()->allRetryIds();
     for (int id: ids) {
         CacheMessage failedMessage = AstarteTransportCache::instance()->takeRetryEntry(id);
-        // Call cache message function with the failed message
-        cacheMessage(failedMessage);
+        // Publish the failed message directly, it already went through aggregation
+        publishCacheMessage(failedMessage);
     }
 }
 
 void AstarteTransport::rebound(const Hyperspace::Rebound& r, int fd)
 {
-    Hyperspace::Rebound rebound = r;
+    Q_UNUSED(fd)
 
-    // FIXME: We should just trigger errors here.
-    return;
-
-    if (!m_waveStorage.contains(r.id())) {
-        qCWarning(astarteTransportDC) << "Got a rebound with id" << r.id() << "which does not match any routing rules!";
+    Hyperspace::Wave w;
+    QByteArray commandId;
+    if (!m_pendingWaves->take(r.id(), &w, &commandId)) {
+        qCWarning(astarteTransportDC) << "Got a rebound with id" << r.id() << "which does not match any pending wave, it might have expired.";
         return;
     }
 
-    Hyperspace::Wave w = m_waveStorage.take(r.id());
-    QByteArray waveTarget = w.target();
+    if (r.response() != Hyperspace::ResponseCode::OK) {
+        qCWarning(astarteTransportDC) << "Wave" << w.target() << "failed!" << static_cast<quint16>(r.response());
+    }
+
+    // Plain writes don't expect anything back. Their payload is not republished either, as we'd receive it again
+    // through our own subscription.
+    if (!commandId.isEmpty()) {
+        queueCommandResponse(w.target(), commandId, r.response());
+    }
+}
+
+void AstarteTransport::queueCommandResponse(const QByteArray &target, const QByteArray &commandId, Hyperspace::ResponseCode response)
+{
+    m_pendingResponses.enqueue(qMakePair(target, commandId + "," + QByteArray::number(static_cast<quint16>(response))));
 
-    if (m_commandTree.contains(r.id())) {
-        QByteArray commandId = m_commandTree.take(r.id());
-        m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + "/response" + waveTarget,
-                              commandId + "," + QByteArray::number(static_cast<quint16>(r.response())));
+    // While the timer runs we are pacing a burst, the response goes with the next round
+    if (!m_responseTimer->isActive()) {
+        flushCommandResponses();
     }
+}
 
-    if (r.response() != Hyperspace::ResponseCode::OK) {
-        // TODO: How do we handle failed requests?
-        qCWarning(astarteTransportDC) << "Wave failed!" << static_cast<quint16>(r.response());
+void AstarteTransport::flushCommandResponses()
+{
+    m_responseTimer->stop();
+
+    if (m_mqttBroker.isNull() || m_mqttBroker->status() != MQTTClientWrapper::ConnectedStatus) {
+        // They'll go once we're connected again
         return;
     }
 
-    if (!r.payload().isEmpty()) {
-        m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + waveTarget, r.payload());
+    // The server expects a single commandId,responseCode per message
+    int sent = 0;
+    for (; sent < m_responseBatchSize && !m_pendingResponses.isEmpty(); ++sent) {
+        const QPair< QByteArray, QByteArray > &response = m_pendingResponses.head();
+        int rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + "/response" + response.first, response.second);
+        if (rc < 0) {
+            // Keep it, and try again in a while
+            qCWarning(astarteTransportDC) << "Can't publish command response for" << response.first << ", error" << rc;
+            break;
+        }
+        m_pendingResponses.dequeue();
+    }
+
+    // Whatever comes before the interval is over waits for the next round
+    if (sent > 0 || !m_pendingResponses.isEmpty()) {
+        m_responseTimer->start();
     }
 }
 
@@ -311,58 +738,89 @@ void AstarteTransport::fluctuation(const Hyperspace::Fluctuation &fluctuation)
 void AstarteTransport::cacheMessage(const CacheMessage &cacheMessage)
 {
     qCDebug(astarteTransportDC) << "Received cacheMessage from: " << cacheMessage.target() << cacheMessage.payload();
+    if (m_datastreamAggregator->process(cacheMessage)) {
+        // It will be published when its window is over
+        return;
+    }
+
+    publishCacheMessage(cacheMessage);
+}
+
+void AstarteTransport::publishCacheMessage(const CacheMessage &cacheMessage)
+{
     if (m_mqttBroker.isNull()) {
         handleFailedPublish(cacheMessage);
         return;
     }
 
-    int rc;
+    if (cacheMessage.interfaceType() == Hyperdrive::Interface::Type::Properties
+            && AstarteTransportCache::instance()->isEntryUnchanged(cacheMessage.target(), cacheMessage.payload())) {
+
+        qCDebug(astarteTransportDC) << cacheMessage.target() << "is not changed, not publishing it again";
+        // We consider it delivered, so remove it from the DB
+        AstarteTransportCache::instance()->removeFromDatabase(cacheMessage);
+        return;
+    }
 
-    switch (cacheMessage.interfaceType()) {
-        case Hyperdrive::Interface::Type::Properties: {
-            if (AstarteTransportCache::instance()->isCached(cacheMessage.target())
-                    && AstarteTransportCache::instance()->persistentEntry(cacheMessage.target()) == cacheMessage.payload()) {
+    m_publishScheduler->enqueue(cacheMessage);
+    drainPublishQueue();
+}
 
-                qCDebug(astarteTransportDC) << cacheMessage.target() << "is not changed, not publishing it again";
-                // We consider it delivered, so remove it from the DB
-                AstarteTransportCache::instance()->removeFromDatabase(cacheMessage);
-                return;
-            }
+void AstarteTransport::drainPublishQueue()
+{
+    if (m_switchingBroker) {
+        // Messages wait in the queue for the new session
+        return;
+    }
 
-            rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::ExactlyOnceQoS);
-            break;
+    CacheMessage cacheMessage;
+    while (m_publishScheduler->takeNext(&cacheMessage)) {
+        if (m_mqttBroker.isNull()) {
+            handleFailedPublish(cacheMessage);
+            continue;
         }
 
-        case Hyperdrive::Interface::Type::DataStream: {
-            Hyperspace::Reliability reliability = static_cast<Hyperspace::Reliability>(cacheMessage.attributes().value("reliability").toInt());
-            switch (reliability) {
-                case (Hyperspace::Reliability::Guaranteed):
-                    rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::AtLeastOnceQoS);
-                    break;
-                case (Hyperspace::Reliability::Unique):
-                    rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::ExactlyOnceQoS);
-                    break;
-                default:
-                    // Default Unreliable
-                    rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::AtMostOnceQoS);
-                    break;
+        QByteArray topic = m_mqttBroker->rootClientTopic() + cacheMessage.target();
+        int rc;
+
+        switch (cacheMessage.interfaceType()) {
+            case Hyperdrive::Interface::Type::Properties: {
+                rc = m_mqttBroker->publish(topic, cacheMessage.payload(), MQTTClientWrapper::ExactlyOnceQoS);
+                break;
             }
-            break;
-        }
 
-        default: {
-            qCDebug(astarteTransportDC) << "Unsupported interfaceType";
-            break;
+            case Hyperdrive::Interface::Type::DataStream: {
+                Hyperspace::Reliability reliability = static_cast<Hyperspace::Reliability>(cacheMessage.attributes().value("reliability").toInt());
+                switch (reliability) {
+                    case (Hyperspace::Reliability::Guaranteed):
+                        rc = m_mqttBroker->publish(topic, cacheMessage.payload(), MQTTClientWrapper::AtLeastOnceQoS);
+                        break;
+                    case (Hyperspace::Reliability::Unique):
+                        rc = m_mqttBroker->publish(topic, cacheMessage.payload(), MQTTClientWrapper::ExactlyOnceQoS);
+                        break;
+                    default:
+                        // Default Unreliable
+                        rc = m_mqttBroker->publish(topic, cacheMessage.payload(), MQTTClientWrapper::AtMostOnceQoS);
+                        break;
+                }
+                break;
+            }
+
+            default: {
+                qCDebug(astarteTransportDC) << "Unsupported interfaceType";
+                continue;
+            }
         }
-    }
 
-    if (rc < 0) {
-        // If it's < 0, it's an error
-        handleFailedPublish(cacheMessage);
-    } else {
-        // Otherwise, it's the messageId
-        qCInfo(astarteTransportDC) << "Inserting in-flight message id " << rc;
-        AstarteTransportCache::instance()->addInFlightEntry(rc, cacheMessage);
+        if (rc < 0) {
+            // If it's < 0, it's an error
+            handleFailedPublish(cacheMessage);
+        } else {
+            // Otherwise, it's the messageId
+            qCInfo(astarteTransportDC) << "Inserting in-flight message id " << rc;
+            m_publishScheduler->trackInFlight(rc, cacheMessage, topic.size() + cacheMessage.payload().size());
+            AstarteTransportCache::instance()->addInFlightEntry(rc, cacheMessage);
+        }
     }
 }
 
@@ -375,6 +833,12 @@ void AstarteTransport::forceNewPairing()
         m_mqttBroker->disconnectFromBroker();
         m_mqttBroker->deleteLater();
     }
+    if (!m_nextMqttBroker.isNull()) {
+        m_nextMqttBroker->deleteLater();
+    }
+    m_switchOverTimer->stop();
+    m_switchingBroker = false;
+    m_renewingCertificate = false;
     // Reset the cache
     AstarteTransportCache::instance()->resetInFlightEntries();
 
@@ -387,9 +851,19 @@ void AstarteTransport::onStatusChanged(MQTTClientWrapper::Status status)
         // We're connected, stop the reboot timer
         qCDebug(astarteTransportDC) << "Connected, stopping the reboot timer";
         m_rebootTimer->stop();
-        if (!m_mqttBroker->sessionPresent() || !m_synced) {
+        // Confirmations for what was in flight might never come, don't let them stall the queue
+        m_publishScheduler->resetInFlight();
+        m_publishScheduler->setPeerReceiveMaximum(m_mqttBroker->receiveMaximum());
+        // Renew the certificate in the background if it's about to expire
+        checkCertificateExpiry();
+        if (!m_mqttBroker->sessionPresent()) {
+            // The broker forgot about our subscriptions
+            m_activeSubscriptions.clear();
             // We're desynced
             bigBang();
+        } else if (!m_synced) {
+            // The previous resync didn't complete, but the session survived: only what wasn't confirmed needs to go
+            resync(AstarteTransportCache::instance()->hasSyncedEntries());
         } else if (m_lastSentIntrospection != introspectionString()) {
             qCDebug(astarteTransportDC) << "Introspection changed while offline, was:" << m_lastSentIntrospection;
             publishIntrospection();
@@ -398,6 +872,7 @@ void AstarteTransport::onStatusChanged(MQTTClientWrapper::Status status)
 
         // Resend the messages that failed to be published
         resendFailedMessages();
+        flushCommandResponses();
     } else {
         // If we are in every other state, we start the reboot timer (if needed)
         if (m_rebootWhenConnectionFails && !m_rebootTimer->isActive()) {
@@ -459,11 +934,19 @@ void AstarteTransport::bigBang()
 {
     qCWarning(astarteTransportDC) << "Received bigBang";
 
+    resync(false);
+}
+
+void AstarteTransport::resync(bool incremental)
+{
     QSettings syncSettings(QStringLiteral("%1/transportStatus.conf").arg(QDir::homePath()), QSettings::IniFormat);
     if (m_synced) {
         m_synced = false;
         syncSettings.setValue(QStringLiteral("isSynced"), false);
     }
+    // Whatever a previous resync was waiting for is superseded
+    m_resyncPendingTargets.clear();
+    m_inFlightProducerPropertiesMessageId = -1;
 
     if (m_mqttBroker.isNull()) {
         qCDebug(astarteTransportDC) << "Can't send emptyCache request, broker is null";
@@ -475,15 +958,24 @@ void AstarteTransport::bigBang()
     // And publish the introspection.
     publishIntrospection();
 
-    int rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + "/control/emptyCache", "1", MQTTClientWrapper::ExactlyOnceQoS);
-    if (rc < 0) {
-        // We leave m_synced to false and we retry when we're back online
-        qCWarning(astarteTransportDC) << "Can't send emptyCache request, error " << rc;
-        return;
+    int rc;
+    if (!incremental) {
+        rc = m_mqttBroker->publish(m_mqttBroker->rootClientTopic() + "/control/emptyCache", "1", MQTTClientWrapper::ExactlyOnceQoS);
+        if (rc < 0) {
+            // We leave m_synced to false and we retry when we're back online
+            qCWarning(astarteTransportDC) << "Can't send emptyCache request, error " << rc;
+            return;
+        }
+
+        // Whatever was confirmed before has been wiped on the other end
+        AstarteTransportCache::instance()->resetSyncedEntries();
+    } else {
+        qCInfo(astarteTransportDC) << "Session is present, resuming the previous resync";
     }
 
+    // Send the producer property paths. The broker takes each message as the complete list, so it goes in one piece.
     QByteArray payload;
-    for (const QByteArray &path : AstarteTransportCache::instance()->allPersistentEntries().keys()) {
+    for (const QByteArray &path : AstarteTransportCache::instance()->persistentTargets()) {
         // Remove leading slash
         payload.append(path.mid(1));
         payload.append(';');
@@ -499,26 +991,22 @@ void AstarteTransport::bigBang()
         qCWarning(astarteTransportDC) << "Can't send producer properties list, error " << rc;
         return;
     }
+    m_inFlightProducerPropertiesMessageId = rc;
 
-    // Send the cached properties
-    sendProperties();
-
-    // If we are here, the messages are in the hands of mosquitto
-    m_synced = true;
-    syncSettings.setValue(QStringLiteral("isSynced"), true);
+    // Send the cached properties. m_synced is set once they, and the list, have been confirmed.
+    sendProperties(incremental);
 }
 
 void AstarteTransport::onPublishConfirmed(int messageId)
 {
     qCInfo(astarteTransportDC) << "Message with id" << messageId << ": publish confirmed";
+    m_publishScheduler->confirm(messageId);
     CacheMessage cacheMessage = AstarteTransportCache::instance()->takeInFlightEntry(messageId);
 
-    if (cacheMessage.interfaceType() == Hyperdrive::Interface::Type::Properties) {
-        if (cacheMessage.payload().isEmpty()) {
-            AstarteTransportCache::instance()->removePersistentEntry(cacheMessage.target());
-        } else {
-            AstarteTransportCache::instance()->insertOrUpdatePersistentEntry(cacheMessage.target(), cacheMessage.payload());
-        }
+    // Control messages are not tracked by the cache, check them first
+    if (messageId == m_inFlightProducerPropertiesMessageId) {
+        m_inFlightProducerPropertiesMessageId = -1;
+        checkResyncCompleted();
     } else if (messageId == m_inFlightIntrospectionMessageId) {
         m_inFlightIntrospectionMessageId = -1;
         m_lastSentIntrospection = m_inFlightIntrospection;
@@ -526,7 +1014,25 @@ void AstarteTransport::onPublishConfirmed(int messageId)
 
         QSettings syncSettings(QStringLiteral("%1/transportStatus.conf").arg(QDir::homePath()), QSettings::IniFormat);
         syncSettings.setValue(QStringLiteral("lastSentIntrospection"), m_lastSentIntrospection);
+    } else if (cacheMessage.interfaceType() == Hyperdrive::Interface::Type::Properties) {
+        if (cacheMessage.payload().isEmpty()) {
+            AstarteTransportCache::instance()->removePersistentEntry(cacheMessage.target());
+        } else {
+            AstarteTransportCache::instance()->insertOrUpdatePersistentEntry(cacheMessage.target(), cacheMessage.payload());
+        }
+        AstarteTransportCache::instance()->markEntrySynced(cacheMessage.target(), cacheMessage.payload());
+        if (m_resyncPendingTargets.remove(cacheMessage.target())) {
+            checkResyncCompleted();
+        }
     }
+
+    if (m_switchingBroker) {
+        trySwitchOver();
+        return;
+    }
+
+    // A slot in the in-flight window is now free
+    drainPublishQueue();
 }
 
 QByteArray AstarteTransport::introspectionString() const
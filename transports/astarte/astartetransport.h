@@ -8,11 +8,18 @@
 #include <hyperdrivemqttclientwrapper.h>
 #include <hyperdriveremotetransport.h>
 
+#include <QtCore/QPair>
 #include <QtCore/QPointer>
+#include <QtCore/QQueue>
 #include <QtCore/QSet>
+#include <QtCore/QVariantMap>
 
 class QTimer;
 
+class AstarteDatastreamAggregator;
+class AstartePendingWaves;
+class AstartePublishScheduler;
+
 namespace Astarte {
 class Endpoint;
 }
@@ -33,6 +40,8 @@ public:
     virtual void cacheMessage(const CacheMessage& cacheMessage) override final;
     virtual void bigBang() override final;
 
+    virtual bool reloadConfiguration() override final;
+
 protected:
     virtual void initImpl() override final;
 
@@ -40,8 +49,11 @@ private Q_SLOTS:
     void startPairing(bool forcedPairing);
     void setupMqtt();
     void setupClientSubscriptions();
-    void sendProperties();
+    void sendProperties(bool onlyUnsynced = false);
+    void checkResyncCompleted();
     void resendFailedMessages();
+    void publishCacheMessage(const CacheMessage &cacheMessage);
+    void drainPublishQueue();
     void publishIntrospection();
     void onStatusChanged(MQTTClientWrapper::Status status);
     void onMQTTMessageReceived(const QByteArray &topic, const QByteArray &payload);
@@ -51,21 +63,54 @@ private Q_SLOTS:
     void handleConnackTimeout();
     void handleRebootTimerTimeout();
     void forceNewPairing();
+    void checkCertificateExpiry();
+    void renewCertificate();
+    void trySwitchOver();
+    void switchOver();
+    void completeSwitchOver();
+    void flushCommandResponses();
 
 private:
     QByteArray introspectionString() const;
+    void configureMqttClient(MQTTClientWrapper *client);
+    void resync(bool incremental);
+    void applyTunables(const QString &configurationPath);
+    static QVariantMap restartOnlyConfiguration(const QString &configurationPath);
+    void queueCommandResponse(const QByteArray &target, const QByteArray &commandId, Hyperspace::ResponseCode response);
 
     Astarte::Endpoint *m_astarteEndpoint;
+    AstarteDatastreamAggregator *m_datastreamAggregator;
+    AstartePublishScheduler *m_publishScheduler;
+    AstartePendingWaves *m_pendingWaves;
     QPointer<MQTTClientWrapper> m_mqttBroker;
-    QHash< quint64, Hyperspace::Wave > m_waveStorage;
-    QHash< quint64, QByteArray > m_commandTree;
+    // Session with the renewed certificate, waiting to take over m_mqttBroker
+    QPointer<MQTTClientWrapper> m_nextMqttBroker;
+    // Command responses waiting to be published, as response topic and commandId,responseCode payload
+    QQueue< QPair< QByteArray, QByteArray > > m_pendingResponses;
+    QSet< QByteArray > m_activeSubscriptions;
     QTimer *m_rebootTimer;
+    QTimer *m_certificateCheckTimer;
+    QTimer *m_switchOverTimer;
+    QTimer *m_responseTimer;
     QByteArray m_lastSentIntrospection;
     QByteArray m_inFlightIntrospection;
+    QString m_configurationPath;
+    // Settings which can't be changed without restarting, as they were at startup
+    QVariantMap m_restartOnlyConfiguration;
+    QSet< QByteArray > m_budgetedInterfaces;
+    // What the current resync still waits to be confirmed
+    QSet< QByteArray > m_resyncPendingTargets;
     bool m_synced;
     bool m_rebootWhenConnectionFails;
+    bool m_renewingCertificate;
+    bool m_switchingBroker;
+    MQTTClientWrapper::LoopMode m_mqttLoopMode;
+    MQTTClientWrapper::ProtocolVersion m_mqttProtocolVersion;
+    int m_mqttTopicAliasMaximum;
     int m_rebootDelayMinutes;
+    int m_responseBatchSize;
     int m_inFlightIntrospectionMessageId;
+    int m_inFlightProducerPropertiesMessageId;
 };
 }
 
@@ -1,6 +1,7 @@
 
 #include "astartetransportcache.h"
 
+#include <QtCore/QCryptographicHash>
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QTimerEvent>
@@ -17,7 +18,10 @@
 class AstarteTransportCache::Private
 {
 public:
+    // Content hashes of the persistent entries
     QHash< QByteArray, QByteArray > persistentEntries;
+    // Content hashes of the entries confirmed by the broker since the last emptyCache, mirrored in the database
+    QHash< QByteArray, QByteArray > syncedHashes;
     QHash< int, Hyperdrive::CacheMessage> inFlightEntries;
     QHash< int, Hyperdrive::CacheMessage > retryEntries;
     QHash< int, int > retryTimerToId;
@@ -57,6 +61,14 @@ void AstarteTransportCache::initImpl()
     if (ensureDatabase()) {
 
         d->persistentEntries = Hyperdrive::TransportDatabaseManager::Transactions::allPersistentEntries();
+        d->syncedHashes = Hyperdrive::TransportDatabaseManager::Transactions::allSyncedHashes();
+
+        // Databases from before entries were hashed
+        QHash< QByteArray, QByteArray > legacyEntries = Hyperdrive::TransportDatabaseManager::Transactions::takeLegacyPersistentEntries();
+        for (QHash< QByteArray, QByteArray >::const_iterator i = legacyEntries.constBegin(); i != legacyEntries.constEnd(); ++i) {
+            insertOrUpdatePersistentEntry(i.key(), i.value());
+        }
+
         QList<Hyperdrive::CacheMessage> dbMessages = Hyperdrive::TransportDatabaseManager::Transactions::allCacheMessages();
         for (const Hyperdrive::CacheMessage &message : dbMessages) {
            d->retryEntries.insert(d->retryIdCounter++, message);
@@ -79,12 +91,15 @@ bool AstarteTransportCache::ensureDatabase()
 void AstarteTransportCache::insertOrUpdatePersistentEntry(const QByteArray &target, const QByteArray &payload)
 {
     ensureDatabase();
-    if (d->persistentEntries.contains(target)) {
-        Hyperdrive::TransportDatabaseManager::Transactions::updatePersistentEntry(target, payload);
-    } else {
-        Hyperdrive::TransportDatabaseManager::Transactions::insertPersistentEntry(target, payload);
+    QByteArray hash = contentHash(payload);
+    QHash< QByteArray, QByteArray >::iterator i = d->persistentEntries.find(target);
+    if (i == d->persistentEntries.end()) {
+        Hyperdrive::TransportDatabaseManager::Transactions::insertPersistentEntry(target, hash);
+        d->persistentEntries.insert(target, hash);
+    } else if (i.value() != hash) {
+        Hyperdrive::TransportDatabaseManager::Transactions::updatePersistentEntry(target, hash);
+        i.value() = hash;
     }
-    d->persistentEntries.insert(target, payload);
 }
 
 void AstarteTransportCache::removePersistentEntry(const QByteArray &target)
@@ -99,14 +114,58 @@ bool AstarteTransportCache::isCached(const QByteArray &target) const
     return d->persistentEntries.contains(target);
 }
 
-QByteArray AstarteTransportCache::persistentEntry(const QByteArray &target) const
+bool AstarteTransportCache::isEntryUnchanged(const QByteArray &target, const QByteArray &payload) const
+{
+    QHash< QByteArray, QByteArray >::const_iterator i = d->persistentEntries.constFind(target);
+    return i != d->persistentEntries.constEnd() && i.value() == contentHash(payload);
+}
+
+QByteArray AstarteTransportCache::contentHash(const QByteArray &payload)
+{
+    // Used for change detection only, speed matters more than strength
+    return QCryptographicHash::hash(payload, QCryptographicHash::Md5);
+}
+
+void AstarteTransportCache::markEntrySynced(const QByteArray &target, const QByteArray &payload)
+{
+    if (payload.isEmpty()) {
+        // Its row is gone together with the persistent entry
+        d->syncedHashes.remove(target);
+        return;
+    }
+
+    QByteArray hash = contentHash(payload);
+    QHash< QByteArray, QByteArray >::iterator i = d->syncedHashes.find(target);
+    if (i == d->syncedHashes.end() || i.value() != hash) {
+        ensureDatabase();
+        Hyperdrive::TransportDatabaseManager::Transactions::updateSyncedHash(target, hash);
+        d->syncedHashes.insert(target, hash);
+    }
+}
+
+bool AstarteTransportCache::isEntrySynced(const QByteArray &target) const
 {
-    return d->persistentEntries.value(target);
+    QHash< QByteArray, QByteArray >::const_iterator i = d->syncedHashes.constFind(target);
+    return i != d->syncedHashes.constEnd() && i.value() == d->persistentEntries.value(target);
+}
+
+bool AstarteTransportCache::hasSyncedEntries() const
+{
+    return !d->syncedHashes.isEmpty();
+}
+
+void AstarteTransportCache::resetSyncedEntries()
+{
+    if (!d->syncedHashes.isEmpty()) {
+        ensureDatabase();
+        Hyperdrive::TransportDatabaseManager::Transactions::resetSyncedHashes();
+    }
+    d->syncedHashes.clear();
 }
 
-QHash< QByteArray, QByteArray > AstarteTransportCache::allPersistentEntries() const
+QList< QByteArray > AstarteTransportCache::persistentTargets() const
 {
-    return d->persistentEntries;
+    return d->persistentEntries.keys();
 }
 
 void AstarteTransportCache::addInFlightEntry(int messageId, Hyperdrive::CacheMessage message)
@@ -16,16 +16,24 @@ class AstarteTransportCache : public Hemera::AsyncInitObject
 public:
     static AstarteTransportCache *instance();
 
+    static QByteArray contentHash(const QByteArray &payload);
+
     virtual ~AstarteTransportCache();
 
 public Q_SLOTS:
+    // Only the content hash of persistent entries is kept: payloads can be fetched from Hyperdrive's cache
     void insertOrUpdatePersistentEntry(const QByteArray &target, const QByteArray &payload);
     void removePersistentEntry(const QByteArray &target);
 
-    QByteArray persistentEntry(const QByteArray &target) const;
-    QHash< QByteArray, QByteArray > allPersistentEntries() const;
+    QList< QByteArray > persistentTargets() const;
 
     bool isCached(const QByteArray &target) const;
+    bool isEntryUnchanged(const QByteArray &target, const QByteArray &payload) const;
+
+    void markEntrySynced(const QByteArray &target, const QByteArray &payload);
+    bool isEntrySynced(const QByteArray &target) const;
+    bool hasSyncedEntries() const;
+    void resetSyncedEntries();
 
     void addInFlightEntry(int messageId, Hyperdrive::CacheMessage message);
     Hyperdrive::CacheMessage takeInFlightEntry(int messageId);
@@ -0,0 +1 @@
+ALTER TABLE persistent_entries RENAME TO legacy_persistent_entries
@@ -0,0 +1,4 @@
+CREATE TABLE persistent_entries (
+    target varchar primary key not null,
+    hash blob
+)
@@ -0,0 +1 @@
+ALTER TABLE persistent_entries ADD COLUMN synced_hash blob
@@ -95,6 +95,19 @@ void AstarteGatewayPairingHelper::writeConfigFile()
 
     // Replace client id
     result.replace("@GATEWAY_CLIENT_ID@", m_hardwareId);
+#ifdef HAVE_MOSQUITTO_UNIX_SOCKETS
+    // Local devices connect through the unix socket listener, if the template has one
+    result.replace("@GATEWAY_SOCKET_PATH@", Hyperdrive::StaticConfig::astarteGatewaySocketPath());
+#else
+    // GatewayEndpoint can't use the socket on this mosquitto, and older brokers refuse the listener: drop it
+    int socketListener = result.indexOf("@GATEWAY_SOCKET_PATH@");
+    while (socketListener >= 0) {
+        int lineStart = result.lastIndexOf('\n', socketListener) + 1;
+        int lineEnd = result.indexOf('\n', socketListener);
+        result.remove(lineStart, lineEnd < 0 ? result.size() - lineStart : lineEnd - lineStart + 1);
+        socketListener = result.indexOf("@GATEWAY_SOCKET_PATH@", lineStart);
+    }
+#endif
 
     // Write it down to our actual config file
     QFile destination(QStringLiteral("/var/lib/astarte/gateway/mosquitto.conf"));
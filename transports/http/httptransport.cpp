@@ -5,8 +5,10 @@
 #include "httptransport.h"
 #include "http_parser.h"
 #include "transporttcpserver.h"
+#include "httptransportbsontranscoder.h"
 #include "httptransportcache.h"
 #include "httptransportcallbackmanager.h"
+#include "httptransportwebsocket.h"
 
 #include <HemeraCore/CommonOperations>
 #include <HemeraCore/Fingerprints>
@@ -25,6 +27,7 @@
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonObject>
 #include <QtCore/QUrl>
+#include <QtCore/QUrlQuery>
 
 #include <QtNetwork/QNetworkReply>
 #include <QtNetwork/QNetworkRequest>
@@ -44,16 +47,27 @@
 #include <hyperdriveconfig.h>
 
 #include <HyperspaceCore/BSONDocument>
-#include <HyperspaceCore/BSONSerializer>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 
 #define CONNECTION_TIMEOUT 15000
-#define NEXT_HEADER "HYPERDRIVE_NEXT_HEADER"
+#define MAXIMUM_REQUESTS_PER_CONNECTION 100
+#define STREAM_BUFFER_SIZE (256 * 1024)
+#define MAXIMUM_WEBSOCKET_MESSAGE_SIZE (1024 * 1024)
+#define STREAMED_BODY_THRESHOLD (64 * 1024)
+#define MAXIMUM_BODY_SIZE (64 * 1024 * 1024)
+#define STREAM_HEARTBEAT_INTERVAL 15000
+#define WEBSOCKET_PING_INTERVAL 30000
 
 #define METHOD_DELETE "DELETE"
 #define METHOD_GET "GET"
@@ -61,56 +75,208 @@
 #define METHOD_PUT "PUT"
 #define METHOD_OPTIONS "OPTIONS"
 
+#define STATUS_NOT_MODIFIED 304
+#define STATUS_PAYLOAD_TOO_LARGE 413
+
 Q_LOGGING_CATEGORY(httpTransportDC, "hyperdrive.transport.http", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
 namespace Hyperdrive
 {
 
+// An anonymous file to hold a request body. memfd when available, an unlinked temporary file otherwise.
+static int createBodyFd()
+{
+    int fd = -1;
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "hyperdrive-http-body", 1 /* MFD_CLOEXEC */);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+    char path[] = "/tmp/hyperdrive-http-body-XXXXXX";
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+static bool writeToBodyFd(int fd, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+static void closeBodyFd(HTTPConnection *connection)
+{
+    if (connection->bodyFd >= 0) {
+        ::close(connection->bodyFd);
+        connection->bodyFd = -1;
+    }
+}
+
+// Moves the body of the connection's wave to a file, from now on every chunk is written there
+static bool startStreamingBody(HTTPConnection *connection)
+{
+    connection->bodyFd = createBodyFd();
+    if (connection->bodyFd < 0) {
+        qCWarning(httpTransportDC) << "Could not create a file for the request body" << strerror(errno);
+        return false;
+    }
+
+    QByteArray payload = connection->wave.payload();
+    connection->wave.setPayload(QByteArray());
+    if (!writeToBodyFd(connection->bodyFd, payload.constData(), payload.size())) {
+        qCWarning(httpTransportDC) << "Could not write the request body" << strerror(errno);
+        closeBodyFd(connection);
+        return false;
+    }
+
+    return true;
+}
+
+// The value under "v" of a BSON payload, as the transcoder renders it. Undefined if there is none.
+static QJsonValue bsonValueToJsonValue(const QByteArray &bson)
+{
+    QByteArray json = HTTPTransportBSONTranscoder::bsonValueToJSON(bson, "v");
+    if (json.isNull()) {
+        return QJsonValue(QJsonValue::Undefined);
+    }
+    // QJsonDocument only parses aggregates
+    return QJsonDocument::fromJson("[" + json + "]").array().at(0);
+}
+
+// Whether an If-None-Match header value matches an entity tag
+static bool matchesEntityTag(const QByteArray &ifNoneMatch, const QByteArray &tag)
+{
+    for (QByteArray candidate : ifNoneMatch.split(',')) {
+        candidate = candidate.trimmed();
+        // Weak comparison is what If-None-Match asks for
+        if (candidate.startsWith("W/")) {
+            candidate.remove(0, 2);
+        }
+        if (candidate == "*" || candidate == tag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void HTTPConnection::flushHeader()
+{
+    if (!headerField.isEmpty()) {
+        wave.addAttribute(headerField, headerValue);
+    }
+    headerField.clear();
+    headerValue.clear();
+}
+
 int HTTPTransport::onUrl (http_parser *parser, const char *url, size_t urlLen)
 {
-    (*HTTPTransport::instance()->m_waveStorage.find(HTTPTransport::instance()->m_parserToWave.value(parser))).setTarget(QByteArray(url, urlLen));
+    HTTPConnection *connection = static_cast<HTTPConnection*>(parser->data);
+    connection->wave.setTarget(connection->wave.target() + QByteArray(url, urlLen));
     return 0;
 }
 
 int HTTPTransport::onStatus (http_parser *parser, const char *status, size_t statusLen)
 {
+    Q_UNUSED(parser)
+    Q_UNUSED(status)
+    Q_UNUSED(statusLen)
     return 0;
 }
 
 int HTTPTransport::onHeaderField (http_parser *parser, const char *headerField, size_t headerLen)
 {
-    (*HTTPTransport::instance()->m_waveStorage.find(HTTPTransport::instance()->m_parserToWave.value(parser))).addAttribute(NEXT_HEADER, QByteArray(headerField, headerLen));
+    HTTPConnection *connection = static_cast<HTTPConnection*>(parser->data);
+    // A field after a value starts a new header
+    if (connection->inHeaderValue) {
+        connection->flushHeader();
+        connection->inHeaderValue = false;
+    }
+    connection->headerField.append(headerField, headerLen);
     return 0;
 }
 
 int HTTPTransport::onHeaderValue (http_parser *parser, const char *headerValue, size_t valueLen)
 {
-    QByteArray headerField = (*HTTPTransport::instance()->m_waveStorage.find(HTTPTransport::instance()->m_parserToWave.value(parser))).takeAttribute(NEXT_HEADER);
-    (*HTTPTransport::instance()->m_waveStorage.find(HTTPTransport::instance()->m_parserToWave.value(parser))).addAttribute(headerField, QByteArray(headerValue, valueLen));
+    HTTPConnection *connection = static_cast<HTTPConnection*>(parser->data);
+    connection->headerValue.append(headerValue, valueLen);
+    connection->inHeaderValue = true;
     return 0;
-
 }
 
 int HTTPTransport::onBody (http_parser *parser, const char *body, size_t bodyLen)
 {
-    (*HTTPTransport::instance()->m_waveStorage.find(HTTPTransport::instance()->m_parserToWave.value(parser))).setPayload(QByteArray(body, bodyLen));
+    HTTPConnection *connection = static_cast<HTTPConnection*>(parser->data);
+
+    // Chunked bodies are only known to be too large once they are
+    connection->bodySize += bodyLen;
+    if (connection->transport->m_maximumBodySize > 0 && connection->bodySize > connection->transport->m_maximumBodySize) {
+        connection->transport->rejectTooLargeRequest(connection);
+        return 0;
+    }
+
+    // Chunked bodies have no length in advance: switch to a file once they grow too much
+    if (connection->bodyFd < 0 &&
+        static_cast<quint64>(connection->wave.payload().size()) + bodyLen > connection->transport->m_streamedBodyThreshold) {
+        if (!startStreamingBody(connection)) {
+            return 1;
+        }
+    }
+
+    if (connection->bodyFd >= 0) {
+        if (!writeToBodyFd(connection->bodyFd, body, bodyLen)) {
+            qCWarning(httpTransportDC) << "Could not write the request body" << strerror(errno);
+            return 1;
+        }
+    } else {
+        connection->wave.setPayload(connection->wave.payload() + QByteArray(body, bodyLen));
+    }
     return 0;
 }
 
 int HTTPTransport::onMessageBegin (http_parser *parser)
 {
+    HTTPConnection *connection = static_cast<HTTPConnection*>(parser->data);
+    connection->wave = Hyperspace::Wave();
+    connection->headerField.clear();
+    connection->headerValue.clear();
+    connection->inHeaderValue = false;
+    connection->bodySize = 0;
+    closeBodyFd(connection);
+    connection->idleTimer->start();
     return 0;
 }
 
 int HTTPTransport::onHeadersComplete (http_parser *parser)
 {
-    Hyperspace::Wave wave = HTTPTransport::instance()->m_waveStorage.value(HTTPTransport::instance()->m_parserToWave.value(parser));
-    QTcpSocket *socket = HTTPTransport::instance()->m_waveToSocket.value(wave.id());
-
-    QByteArray connectionValue = wave.attributes().value("Connection");
+    HTTPConnection *connection = static_cast<HTTPConnection*>(parser->data);
+    connection->flushHeader();
+    connection->inHeaderValue = false;
+
+    if (!(parser->flags & F_CHUNKED) && parser->content_length != ULLONG_MAX &&
+        connection->transport->m_maximumBodySize > 0 && parser->content_length > connection->transport->m_maximumBodySize) {
+        connection->transport->rejectTooLargeRequest(connection);
+        return 0;
+    }
 
-    if (connectionValue == "keep-alive" && !HTTPTransport::instance()->m_keepAliveSockets.contains(socket))  {
-        HTTPTransport::instance()->m_keepAliveSockets.insert(socket);
+    // Announced large bodies never touch memory
+    if (!(parser->flags & F_CHUNKED) && parser->content_length != ULLONG_MAX &&
+        parser->content_length > connection->transport->m_streamedBodyThreshold) {
+        if (!startStreamingBody(connection)) {
+            return 1;
+        }
     }
 
     return 0;
@@ -118,9 +284,35 @@ int HTTPTransport::onHeadersComplete (http_parser *parser)
 
 int HTTPTransport::onMessageComplete (http_parser *parser)
 {
-    QTcpSocket *socket = HTTPTransport::instance()->m_waveToSocket.value(HTTPTransport::instance()->m_waveStorage.value(HTTPTransport::instance()->m_parserToWave.value(parser)).id());
-    (*HTTPTransport::instance()->m_waveStorage.find(HTTPTransport::instance()->m_parserToWave.value(parser))).setMethod(http_method_str(static_cast<http_method>(parser->method)));
-    HTTPTransport::instance()->triggerWave(HTTPTransport::instance()->m_waveStorage.value(HTTPTransport::instance()->m_parserToWave.value(parser)), socket);
+    HTTPConnection *connection = static_cast<HTTPConnection*>(parser->data);
+    connection->wave.setMethod(http_method_str(static_cast<http_method>(parser->method)));
+    connection->transport->m_waveToConnection.insert(connection->wave.id(), connection);
+
+    ++connection->servedRequests;
+    HTTPPendingResponse pending;
+    pending.waveId = connection->wave.id();
+    pending.ready = false;
+    pending.startsStream = false;
+    // Nothing but a WebSocket can come after an upgrade request, and that is handled separately
+    pending.keepAlive = !parser->upgrade && http_should_keep_alive(parser) &&
+                        connection->servedRequests < connection->transport->m_maximumRequestsPerConnection;
+    connection->pendingResponses.append(pending);
+
+    if (!pending.keepAlive) {
+        // Whatever is pipelined after this request won't be answered
+        connection->closing = true;
+        http_parser_pause(parser, 1);
+    }
+
+    int fd = connection->bodyFd;
+    connection->bodyFd = -1;
+    if (fd >= 0 && lseek(fd, 0, SEEK_SET) < 0) {
+        qCWarning(httpTransportDC) << "Could not rewind the request body" << strerror(errno);
+        ::close(fd);
+        return 1;
+    }
+
+    connection->transport->triggerWave(connection->wave, connection->socket, fd);
     return 0;
 }
 
@@ -132,6 +324,15 @@ static HTTPTransport *s_instance = 0;
 HTTPTransport::HTTPTransport(QObject* parent)
     : RemoteTransport(QStringLiteral("HTTP"), parent)
     , m_parserSettings(Q_NULLPTR)
+    , m_streamedBodyThreshold(STREAMED_BODY_THRESHOLD)
+    , m_maximumBodySize(MAXIMUM_BODY_SIZE)
+    , m_keepAliveTimeout(CONNECTION_TIMEOUT)
+    , m_maximumRequestsPerConnection(MAXIMUM_REQUESTS_PER_CONNECTION)
+    , m_streamBufferSize(STREAM_BUFFER_SIZE)
+    , m_maximumWebSocketMessageSize(MAXIMUM_WEBSOCKET_MESSAGE_SIZE)
+    , m_webSocketPingInterval(WEBSOCKET_PING_INTERVAL)
+    , m_streamHeartbeatTimer(Q_NULLPTR)
+    , m_lastStreamId(0)
 {
     if (s_instance) {
         Q_ASSERT("Trying to create an additional instance!");
@@ -205,6 +406,39 @@ void HTTPTransport::initImpl()
     int sockets = sd_listen_fds(0);
     QSettings settings(QStringLiteral("%1/transport-http.conf").arg(QLatin1String(Hyperdrive::StaticConfig::hyperspaceConfigurationDir())), QSettings::IniFormat);
 
+    // Request bodies bigger than this are handed to gates as a file descriptor
+    m_streamedBodyThreshold = settings.value(QStringLiteral("streamedBodyThreshold"), STREAMED_BODY_THRESHOLD).toULongLong();
+    // Requests with a bigger body are answered with 413, 0 accepts any size
+    m_maximumBodySize = settings.value(QStringLiteral("maximumBodySize"), MAXIMUM_BODY_SIZE).toULongLong();
+    // Persistent connections: idle time in milliseconds before closing, and requests served before closing
+    m_keepAliveTimeout = settings.value(QStringLiteral("keepAliveTimeout"), CONNECTION_TIMEOUT).toInt();
+    m_maximumRequestsPerConnection = qMax(1, settings.value(QStringLiteral("maximumRequestsPerConnection"), MAXIMUM_REQUESTS_PER_CONNECTION).toInt());
+    // Event stream clients with more than this many bytes not yet sent are too slow, and get disconnected
+    m_streamBufferSize = settings.value(QStringLiteral("streamBufferSize"), STREAM_BUFFER_SIZE).toLongLong();
+    // WebSocket messages bigger than this close the connection. There is always a limit.
+    m_maximumWebSocketMessageSize = settings.value(QStringLiteral("maximumWebSocketMessageSize"), MAXIMUM_WEBSOCKET_MESSAGE_SIZE).toInt();
+    if (m_maximumWebSocketMessageSize <= 0) {
+        qCWarning(httpTransportDC) << "maximumWebSocketMessageSize must be positive, falling back to" << MAXIMUM_WEBSOCKET_MESSAGE_SIZE;
+        m_maximumWebSocketMessageSize = MAXIMUM_WEBSOCKET_MESSAGE_SIZE;
+    }
+    // Idle WebSockets are pinged after this many milliseconds, and closed if they stay silent as long again. 0 disables it
+    m_webSocketPingInterval = settings.value(QStringLiteral("webSocketPingInterval"), WEBSOCKET_PING_INTERVAL).toInt();
+    // Event streams have no idle timeout: a comment every this many milliseconds keeps proxies from dropping them, 0 disables it
+    int streamHeartbeatInterval = settings.value(QStringLiteral("streamHeartbeatInterval"), STREAM_HEARTBEAT_INTERVAL).toInt();
+    if (streamHeartbeatInterval > 0) {
+        m_streamHeartbeatTimer = new QTimer(this);
+        m_streamHeartbeatTimer->setInterval(streamHeartbeatInterval);
+        connect(m_streamHeartbeatTimer, &QTimer::timeout, this, &HTTPTransport::sendStreamHeartbeats);
+        m_streamHeartbeatTimer->start();
+    }
+    // Callback deliveries are batched per host every flush interval (ms), with a limit of concurrent POSTs per host
+    if (settings.contains(QStringLiteral("callbackFlushInterval"))) {
+        m_callbackManager->setFlushInterval(settings.value(QStringLiteral("callbackFlushInterval")).toInt());
+    }
+    if (settings.contains(QStringLiteral("callbackMaximumInFlight"))) {
+        m_callbackManager->setMaximumInFlight(settings.value(QStringLiteral("callbackMaximumInFlight")).toInt());
+    }
+
     for (int i = 0; i != sockets; ++i) {
         TransportTCPServer *server = new TransportTCPServer(this);
 
@@ -275,33 +509,50 @@ void HTTPTransport::clientConnected()
     }
     QTcpSocket *socket = server->nextPendingConnection();
 
-    m_socketToState.insert(socket, HTTPInternalServerState::WaitingForRequest);
+    HTTPConnection *connection = new HTTPConnection;
+    connection->transport = this;
+    connection->socket = socket;
+    connection->inHeaderValue = false;
+    connection->bodyFd = -1;
+    connection->bodySize = 0;
+    connection->servedRequests = 0;
+    connection->closing = false;
+    connection->webSocket = Q_NULLPTR;
+    connection->webSocketPingSent = false;
+    connection->streamId = ++m_lastStreamId;
+    http_parser_init(&connection->parser, HTTP_BOTH);
+    connection->parser.data = connection;
 
     // Parenting to the socket. This way, when the socket dies, the timer does too.
-    QTimer *timeoutTimer = new QTimer(socket);
-    timeoutTimer->setSingleShot(true);
-    timeoutTimer->setInterval(CONNECTION_TIMEOUT);
-    timeoutTimer->start();
-
-    http_parser *parser = new http_parser();
-    http_parser_init(parser, HTTP_BOTH);
-
-    auto onReadyRead = [this, socket, timeoutTimer, parser] {
-        if (m_socketToState.value(socket) == HTTPInternalServerState::WaitingForRequest) {
-            Hyperspace::Wave wave;
-            m_waveToSocket.insert(wave.id(), socket);
-            m_waveStorage.insert(wave.id(), wave);
-
-            m_parserToWave.insert(parser, wave.id());
-            m_socketToState.insert(socket, HTTPInternalServerState::ParsingRequest);
+    // It is restarted by every request and every response.
+    connection->idleTimer = new QTimer(socket);
+    connection->idleTimer->setSingleShot(true);
+    connection->idleTimer->setInterval(m_keepAliveTimeout);
+    connection->idleTimer->start();
+
+    auto onReadyRead = [this, connection] {
+        QByteArray data = connection->socket->readAll();
+        if (connection->webSocket) {
+            handleWebSocketData(connection, data);
+            return;
+        }
+        if (connection->closing) {
+            return;
         }
-        QByteArray data = socket->readAll();
         int read = data.count();
         qCDebug(httpTransportDC) << "Read data" << read;
-        int parsed = http_parser_execute(parser, m_parserSettings, data.constData(), read);
-        if (read != parsed) {
+        int parsed = http_parser_execute(&connection->parser, m_parserSettings, data.constData(), read);
+        if (read != parsed && !connection->closing) {
             qCWarning(httpTransportDC) << "data lost" << read << parsed;
         }
+        if (HTTP_PARSER_ERRNO(&connection->parser) != HPE_OK && HTTP_PARSER_ERRNO(&connection->parser) != HPE_PAUSED) {
+            qCWarning(httpTransportDC) << "Could not parse the request:" << http_errno_name(HTTP_PARSER_ERRNO(&connection->parser));
+            connection->socket->close();
+        }
+        // Whatever follows the upgrade request belongs to the WebSocket
+        if (connection->webSocket && parsed < read) {
+            handleWebSocketData(connection, data.mid(parsed));
+        }
     };
 
     // Socket read
@@ -311,32 +562,138 @@ void HTTPTransport::clientConnected()
     }
 
     // Socket disconnect
-    connect(socket, &QTcpSocket::disconnected, this,
-            [this, socket, parser] {
-                m_socketToState.remove(socket);
-                quint64 id = m_waveToSocket.key(socket);
-                m_waveToSocket.remove(m_waveToSocket.key(socket));
-                m_waveStorage.remove(id);
-                m_keepAliveSockets.remove(socket);
-                m_parserToWave.remove(parser);
-                socket->deleteLater();
-                delete parser;
-            });
+    connect(socket, &QTcpSocket::disconnected, this, [this, connection] {
+        closeConnection(connection);
+    });
+
+    // Timeout. An idle WebSocket gets a ping first, half-open peers won't answer it.
+    connect(connection->idleTimer, &QTimer::timeout, socket, [connection] {
+        if (connection->webSocket && !connection->webSocketPingSent) {
+            connection->webSocketPingSent = true;
+            connection->socket->write(HTTPTransportWebSocket::frame(HTTPTransportWebSocket::Opcode::Ping, QByteArray()));
+            connection->idleTimer->start();
+            return;
+        }
+        connection->socket->close();
+    });
+}
+
+void HTTPTransport::writeResponses(HTTPConnection *connection)
+{
+    while (!connection->pendingResponses.isEmpty() && connection->pendingResponses.first().ready) {
+        HTTPPendingResponse response = connection->pendingResponses.takeFirst();
+
+        qint64 written = connection->socket->write(response.data);
+        qCDebug(httpTransportDC) << "Writing data to socket" << written;
+
+        if (response.startsStream) {
+            // From now on the connection lives as long as the client does. WebSockets are pinged to find out.
+            if (connection->webSocket && m_webSocketPingInterval > 0) {
+                connection->idleTimer->setInterval(m_webSocketPingInterval);
+                connection->idleTimer->start();
+            } else {
+                connection->idleTimer->stop();
+            }
+            m_streams.insert(connection->streamId, connection);
+            for (const QByteArray &prefix : connection->streamPrefixes) {
+                m_streamSubscriptions.insert(prefix, connection->streamId, Q_NULLPTR);
+            }
+            return;
+        }
+
+        connection->idleTimer->start();
+
+        if (!response.keepAlive) {
+            // Requests after this one will never be answered
+            for (const HTTPPendingResponse &pending : connection->pendingResponses) {
+                m_waveToConnection.remove(pending.waveId);
+            }
+            connection->pendingResponses.clear();
+            connection->closing = true;
+            // Closes once everything has been written, encryption included if the socket is SSL.
+            connection->socket->disconnectFromHost();
+            return;
+        }
+    }
+}
+
+void HTTPTransport::rejectTooLargeRequest(HTTPConnection *connection)
+{
+    qCWarning(httpTransportDC) << "Request body from" << connection->socket->peerAddress() << "is too large, rejecting it";
+
+    closeBodyFd(connection);
+    connection->wave.setPayload(QByteArray());
+
+    // Answered in turn with the pipelined requests before it, then the connection closes without reading the rest
+    HTTPPendingResponse pending;
+    pending.waveId = connection->wave.id();
+    pending.data = statusString(STATUS_PAYLOAD_TOO_LARGE);
+    pending.data.append("Connection: close\r\nContent-Length: 0\r\n\r\n");
+    pending.ready = true;
+    pending.keepAlive = false;
+    pending.startsStream = false;
+    connection->pendingResponses.append(pending);
 
-    // Timeout
-    connect(timeoutTimer, &QTimer::timeout, socket, &QTcpSocket::close);
+    connection->closing = true;
+    http_parser_pause(&connection->parser, 1);
+
+    writeResponses(connection);
+}
+
+void HTTPTransport::closeConnection(HTTPConnection *connection)
+{
+    // Rebounds might still be on their way, they will find nobody
+    for (const HTTPPendingResponse &pending : connection->pendingResponses) {
+        m_waveToConnection.remove(pending.waveId);
+    }
+    connection->pendingResponses.clear();
+    for (const QByteArray &prefix : connection->streamPrefixes) {
+        m_streamSubscriptions.remove(prefix, connection->streamId);
+    }
+    m_streams.remove(connection->streamId);
+    for (QHash< quint64, QJsonValue >::const_iterator it = connection->webSocketRequests.constBegin();
+         it != connection->webSocketRequests.constEnd(); ++it) {
+        m_waveToConnection.remove(it.key());
+    }
+    closeBodyFd(connection);
+    // We might be inside a parser callback of this very connection: free it with the socket
+    connect(connection->socket, &QObject::destroyed, this, [connection] {
+        delete connection->webSocket;
+        delete connection;
+    });
+    connection->socket->deleteLater();
 }
 
-void HTTPTransport::triggerWave(Hyperspace::Wave wave, QTcpSocket* socket)
+void HTTPTransport::triggerWave(Hyperspace::Wave wave, QTcpSocket* socket, int fd)
 {
     qCDebug(httpTransportDC) << "Trigger wave!";
 
+    // Streamed bodies are meant for gates only
+    if (fd >= 0 && (wave.target().startsWith("/control/") || (wave.method() != METHOD_POST && wave.method() != METHOD_PUT))) {
+        ::close(fd);
+        rebound(Hyperspace::Rebound(wave, Hyperspace::ResponseCode::BadRequest));
+        return;
+    }
+
     auto sendPayloadRebound = [this, wave] (const QByteArray &payload) {
         Hyperspace::Rebound r(wave, Hyperspace::ResponseCode::OK);
         r.setPayload(payload);
         rebound(r);
     };
 
+    auto sendTaggedRebound = [this, wave] (const QByteArray &payload, const QByteArray &tag) {
+        Hyperspace::Rebound r(wave, Hyperspace::ResponseCode::OK);
+        r.addAttribute("ETag", tag);
+        r.setPayload(payload);
+        rebound(r);
+    };
+
+    auto sendNotModifiedRebound = [this, wave] (const QByteArray &tag) {
+        Hyperspace::Rebound r(wave, static_cast<Hyperspace::ResponseCode>(STATUS_NOT_MODIFIED));
+        r.addAttribute("ETag", tag);
+        rebound(r);
+    };
+
     // Wait! Are we on a special case?
     if (wave.target().startsWith("/control/")) {
         handleControlWave(wave, socket);
@@ -395,26 +752,48 @@ void HTTPTransport::triggerWave(Hyperspace::Wave wave, QTcpSocket* socket)
 
         } else if (HTTPTransportCache::instance()->isCached(wave.target())) {
             qCDebug(httpTransportDC) << "GETting cached target " << wave.target();
-            QByteArray ret = HTTPTransportCache::instance()->persistentEntry(wave.target());
-            sendPayloadRebound(ret);
+            QByteArray tag = HTTPTransportCache::instance()->entryTag(wave.target());
+            if (matchesEntityTag(wave.attributes().value("If-None-Match"), tag)) {
+                sendNotModifiedRebound(tag);
+            } else {
+                sendTaggedRebound(HTTPTransportCache::instance()->persistentEntry(wave.target()), tag);
+            }
         } else if (HTTPTransportCache::instance()->hasTree(wave.target())) {
             qCDebug(httpTransportDC) << "GETting " << wave.target() << "as a tree";
-            QByteArray ret = HTTPTransportCache::instance()->tree(wave.target()).toJson(QJsonDocument::Compact);
-            sendPayloadRebound(ret);
+            QByteArray tag = HTTPTransportCache::instance()->treeTag(wave.target());
+            if (matchesEntityTag(wave.attributes().value("If-None-Match"), tag)) {
+                sendNotModifiedRebound(tag);
+            } else {
+                sendTaggedRebound(HTTPTransportCache::instance()->renderedTree(wave.target()), tag);
+            }
         } else {
             qCDebug(httpTransportDC) << "Target " << wave.target() << "was not cached";
             rebound(Hyperspace::Rebound(wave, Hyperspace::ResponseCode::NotFound));
         }
         return;
-    } else if (wave.method() == METHOD_POST || wave.method() == METHOD_PUT) {
-        // Convert the payload to BSON
+    } else if ((wave.method() == METHOD_POST || wave.method() == METHOD_PUT) && fd < 0) {
+        // Convert the payload to BSON. Streamed bodies reach the gate raw, through the fd.
         QByteArray bsonPayload = waveToBSONPayload(wave);
+        if (Q_UNLIKELY(bsonPayload.isEmpty() && !wave.payload().isEmpty())) {
+            qCWarning(httpTransportDC) << "Can't convert wave payload to BSON";
+            rebound(Hyperspace::Rebound(wave, Hyperspace::ResponseCode::BadRequest));
+            return;
+        }
         wave.setPayload(bsonPayload);
     }
 
     wave.addAttribute("X-Hyperspace-ClientAddress", socket->peerAddress().toString().toLatin1());
+    // An empty payload means nothing by itself: gates look for this to read the body from the fd
+    if (fd >= 0) {
+        wave.addAttribute("X-Hyperspace-StreamedBody", "1");
+    }
 
-    routeWave(wave, -1);
+    routeWave(wave, fd);
+
+    // The fd has been passed over, our copy is no longer needed
+    if (fd >= 0) {
+        ::close(fd);
+    }
 }
 
 QByteArray HTTPTransport::waveToBSONPayload(const Hyperspace::Wave &wave)
@@ -424,137 +803,19 @@ QByteArray HTTPTransport::waveToBSONPayload(const Hyperspace::Wave &wave)
         return QByteArray();
     }
 
-    Hyperspace::Util::BSONSerializer serializer;
     QByteArray mimeType = wave.attributes().value("Content-Type");
 
     if (mimeType.startsWith("application/octet-stream")) {
         // Raw binary
-        serializer.appendBinaryValue("v", wave.payload());
         qCDebug(httpTransportDC) << "Converting wave payload to BSON Binary";
-
+        return HTTPTransportBSONTranscoder::binaryToBSON(wave.payload());
     } else if (mimeType.startsWith("application/json")) {
-        QJsonDocument doc = QJsonDocument::fromJson(wave.payload());
-        QJsonObject obj = doc.object();
-        QJsonValue value;
-        if (obj.contains(QStringLiteral("v"))) {
-            value = obj.value(QStringLiteral("v"));
-        } else if (obj.contains(QStringLiteral("value"))) {
-            value = obj.value(QStringLiteral("value"));
-        }
-        switch (value.type()) {
-            case QJsonValue::Bool: {
-                serializer.appendBooleanValue("v", value.toBool());
-                qCDebug(httpTransportDC) << "Converting wave JSON payload to BSON Bool";
-                break;
-            }
-
-            case QJsonValue::Double: {
-                // Check if it's an int or a double, thanks Javascript for not having ints
-                int intValue = value.toInt();
-                double doubleValue = value.toDouble();
-                qint64 longLongValue = (qint64) doubleValue;
-
-                if ((double) intValue == doubleValue) {
-                    serializer.appendInt32Value("v", intValue);
-                    qCDebug(httpTransportDC) << "Converting wave JSON payload to BSON Int32";
-                } else if ((double) longLongValue == doubleValue) {
-                    serializer.appendInt64Value("v", longLongValue);
-                    qCDebug(httpTransportDC) << "Converting wave JSON payload to BSON Int64";
-                } else {
-                    serializer.appendDoubleValue("v", doubleValue);
-                    qCDebug(httpTransportDC) << "Converting wave JSON payload to BSON Double";
-                }
-
-                break;
-            }
-
-            case QJsonValue::String: {
-                QString stringValue = value.toString();
-                // Try to see if it's a datetime, using ISO 8601
-                QDateTime dateValue = QDateTime::fromString(stringValue, Qt::ISODate);
-                if (dateValue.isValid()) {
-                    serializer.appendDateTime("v", dateValue);
-                    qCDebug(httpTransportDC) << "Converting wave JSON payload to BSON DateTime";
-                } else {
-                    serializer.appendString("v", stringValue);
-                    qCDebug(httpTransportDC) << "Converting wave JSON payload to BSON String";
-                }
-                break;
-            }
-
-            default:
-                qCWarning(httpTransportDC) << "Can't convert wave JSON payload to BSON";
-        }
-
+        qCDebug(httpTransportDC) << "Converting wave JSON payload to BSON";
+        return HTTPTransportBSONTranscoder::jsonToBSON(wave.payload());
     } else {
         // Raw value and no mimetype, heuristic conversion
-        QVariant value = byteArrayToVariantHeuristic(wave.payload());
-
-        switch (value.type()) {
-            case QVariant::Int:
-                serializer.appendInt32Value("v", value.toInt());
-                qCDebug(httpTransportDC) << "Converting wave payload to BSON Int32";
-                break;
-            case QVariant::LongLong:
-                serializer.appendInt64Value("v", value.toLongLong());
-                qCDebug(httpTransportDC) << "Converting wave payload to BSON Int64";
-                break;
-            case QVariant::Double:
-                serializer.appendDoubleValue("v", value.toDouble());
-                qCDebug(httpTransportDC) << "Converting wave payload to BSON Double";
-                break;
-            case QVariant::Bool:
-                serializer.appendBooleanValue("v", value.toBool());
-                qCDebug(httpTransportDC) << "Converting wave payload to BSON Bool";
-                break;
-            case QVariant::DateTime:
-                serializer.appendDateTime("v", value.toDateTime());
-                qCDebug(httpTransportDC) << "Converting wave payload to BSON DateTime";
-                break;
-            case QVariant::String:
-                serializer.appendString("v", value.toString());
-                qCDebug(httpTransportDC) << "Converting wave payload to BSON String";
-                break;
-
-            default:
-                qCWarning(httpTransportDC) << "Can't convert wave payload to BSON";
-        }
-    }
-
-    serializer.appendEndOfDocument();
-
-    return serializer.document();
-}
-
-QVariant HTTPTransport::byteArrayToVariantHeuristic(const QByteArray &value) {
-    bool ok;
-
-    int intValue = value.toInt(&ok, 10);
-    if (ok) {
-        return QVariant(intValue);
-    }
-
-    qint64 longLongValue = value.toLongLong(&ok, 10);
-    if (ok) {
-        return QVariant(longLongValue);
-    }
-
-    double doubleValue = value.toDouble(&ok);
-    if (ok) {
-        return QVariant(doubleValue);
-    }
-
-    if (value == "true" || value == "false") {
-        bool boolValue = value == "true";
-        return QVariant(boolValue);
-    }
-
-    QString stringValue = QString::fromLatin1(value);
-    QDateTime dateValue = QDateTime::fromString(stringValue, Qt::ISODate);
-    if (dateValue.isValid()) {
-        return QVariant(dateValue);
-    } else {
-        return QVariant(stringValue);
+        qCDebug(httpTransportDC) << "Converting wave payload to BSON";
+        return HTTPTransportBSONTranscoder::textToBSON(wave.payload());
     }
 }
 
@@ -658,6 +919,30 @@ void HTTPTransport::handleControlWave(const Hyperspace::Wave &wave, QTcpSocket *
             rebound(r);
             return;
         }
+    } else if (wave.method() == METHOD_GET) {
+        if (controlTarget == "/stream" || controlTarget.startsWith("/stream?")) {
+            QUrlQuery query(QString::fromLatin1(controlTarget.mid(controlTarget.indexOf('?') + 1)));
+            QByteArray prefix = controlTarget.contains('?') ?
+                                    query.queryItemValue(QStringLiteral("prefix"), QUrl::FullyDecoded).toLatin1() : QByteArray();
+
+            qCInfo(httpTransportDC) << "Event stream request for prefix" << prefix;
+            startEventStream(wave, prefix);
+            return;
+        } else if (controlTarget == "/websocket") {
+            startWebSocket(wave);
+            return;
+        } else if (controlTarget == "/callbacks") {
+            qint64 matches = m_callbackManager->matchCount();
+            QJsonObject statistics{{QStringLiteral("subscriptions"), m_callbackManager->subscriptionCount()},
+                                   {QStringLiteral("hosts"), m_callbackManager->hostCount()},
+                                   {QStringLiteral("matches"), static_cast<double>(matches)},
+                                   {QStringLiteral("average_match_ns"), matches > 0 ? static_cast<double>(m_callbackManager->matchNanoseconds() / matches) : 0.0}};
+
+            Hyperspace::Rebound r(wave, Hyperspace::ResponseCode::OK);
+            r.setPayload(QJsonDocument(statistics).toJson(QJsonDocument::Compact));
+            rebound(r);
+            return;
+        }
     } else if (wave.method() == METHOD_DELETE) {
         if (controlTarget.startsWith("/callbacks")) {
             QByteArray idPath = controlTarget;
@@ -689,6 +974,9 @@ QByteArray HTTPTransport::statusString(int statusCode)
     ret.replace("%i", QByteArray::number(statusCode));
 
     switch (statusCode) {
+        case 101:
+            ret.replace("%s", "Switching Protocols");
+            break;
         case 200:
             ret.replace("%s", "OK");
             break;
@@ -722,6 +1010,10 @@ QByteArray HTTPTransport::statusString(int statusCode)
             ret.replace("%s", "Method Not Allowed");
             break;
 
+        case 413:
+            ret.replace("%s", "Payload Too Large");
+            break;
+
         case 422:
             ret.replace("%s", "Unprocessable Entity");
             break;
@@ -736,14 +1028,53 @@ QByteArray HTTPTransport::statusString(int statusCode)
 
 void HTTPTransport::rebound(const Hyperspace::Rebound& r, int fd)
 {
+    Q_UNUSED(fd)
+
     Hyperspace::Rebound rebound = r;
-    QTcpSocket *socket = m_waveToSocket.value(rebound.id(), Q_NULLPTR);
+    HTTPConnection *connection = m_waveToConnection.take(rebound.id());
+
+    if (Q_UNLIKELY(connection == Q_NULLPTR)) {
+        qCWarning(httpTransportDC) << "wave id " << rebound.id() << " not found!!";
+        return;
+    }
 
-    if (Q_UNLIKELY(socket == Q_NULLPTR)) {
-        qCWarning(httpTransportDC) << "wave id " << rebound.id() << " not found!!" << m_waveToSocket;
+    if (connection->webSocket) {
+        QJsonObject response{{QStringLiteral("id"), connection->webSocketRequests.take(rebound.id())},
+                             {QStringLiteral("response"), static_cast<int>(rebound.response())}};
+        if (!rebound.payload().isEmpty()) {
+            // Gates answer with BSON documents, control waves with JSON trees, anything else goes as a string
+            QJsonValue value = bsonValueToJsonValue(rebound.payload());
+            if (value.isUndefined()) {
+                QJsonParseError error;
+                QJsonDocument doc = QJsonDocument::fromJson(rebound.payload(), &error);
+                if (error.error == QJsonParseError::NoError) {
+                    value = doc.isArray() ? QJsonValue(doc.array()) : QJsonValue(doc.object());
+                } else {
+                    value = QString::fromUtf8(rebound.payload());
+                }
+            }
+            response.insert(QStringLiteral("value"), value);
+        }
+        sendWebSocketMessage(connection, response);
+        return;
+    }
+
+    HTTPPendingResponse *pending = Q_NULLPTR;
+    for (HTTPPendingResponse &response : connection->pendingResponses) {
+        if (response.waveId == rebound.id()) {
+            pending = &response;
+            break;
+        }
+    }
+    if (Q_UNLIKELY(pending == Q_NULLPTR)) {
+        qCWarning(httpTransportDC) << "wave id " << rebound.id() << " is not waiting for a response!!";
         return;
     }
 
+    if (rebound.response() == Hyperspace::ResponseCode::BadRequest || rebound.response() == Hyperspace::ResponseCode::InternalError) {
+        pending->keepAlive = false;
+    }
+
     QByteArray data;
 
     data.append(HTTPTransport::statusString(static_cast<quint16>(rebound.response())));
@@ -758,29 +1089,22 @@ void HTTPTransport::rebound(const Hyperspace::Rebound& r, int fd)
     // Handle the payload!
     QByteArray actualPayload = rebound.payload();
 
-    QByteArray target = m_waveStorage.value(rebound.id()).target();
-    target.remove(0, 1);
-
-    data.append(QByteArray("Content-Length: %1\r\n\r\n").replace("%1", QByteArray::number(actualPayload.size())));
+    data.append(pending->keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    // A 304 has no body, and its Content-Length would describe the one the client has
+    if (static_cast<int>(rebound.response()) == STATUS_NOT_MODIFIED) {
+        data.append("\r\n");
+    } else {
+        data.append(QByteArray("Content-Length: %1\r\n\r\n").replace("%1", QByteArray::number(actualPayload.size())));
+    }
 
     if (!actualPayload.isEmpty()) {
         data.append(actualPayload);
     }
 
-    qint64 written = socket->write(data);
-    qCDebug(httpTransportDC) << "Writing data to socket" << written;
-
-    // Remove the wave from the storage
-    m_waveToSocket.remove(rebound.id());
-    m_waveStorage.remove(rebound.id());
-    m_socketToState.insert(socket, HTTPInternalServerState::WaitingForRequest);
+    pending->data = data;
+    pending->ready = true;
 
-    if (!m_keepAliveSockets.contains(socket) || rebound.response() == Hyperspace::ResponseCode::BadRequest ||
-        rebound.response() == Hyperspace::ResponseCode::InternalError) {
-        // Allow some time for encryption, in case the socket is SSL.
-        socket->waitForBytesWritten(5000);
-        socket->close();
-    }
+    writeResponses(connection);
 }
 
 void HTTPTransport::fluctuation(const Hyperspace::Fluctuation &fluctuation)
@@ -825,6 +1149,250 @@ void HTTPTransport::cacheMessage(const CacheMessage &cacheMessage)
 
     // Check if we have callbacks
     m_callbackManager->checkCallbacks(cacheMessage);
+    streamCacheMessage(cacheMessage);
+}
+
+void HTTPTransport::startEventStream(const Hyperspace::Wave &wave, const QByteArray &prefix)
+{
+    HTTPConnection *connection = m_waveToConnection.take(wave.id());
+    if (Q_UNLIKELY(connection == Q_NULLPTR)) {
+        qCWarning(httpTransportDC) << "wave id " << wave.id() << " not found!!";
+        return;
+    }
+
+    // Nothing pipelined after the stream request can be answered
+    connection->closing = true;
+    http_parser_pause(&connection->parser, 1);
+    for (int i = connection->pendingResponses.size() - 1; i >= 0 && connection->pendingResponses.at(i).waveId != wave.id(); --i) {
+        m_waveToConnection.remove(connection->pendingResponses.takeLast().waveId);
+    }
+
+    HTTPPendingResponse &pending = connection->pendingResponses.last();
+    pending.data = statusString(200);
+    pending.data.append("Content-Type: text/event-stream\r\n"
+                        "Cache-Control: no-cache\r\n"
+                        "Connection: keep-alive\r\n\r\n");
+    pending.ready = true;
+    pending.startsStream = true;
+    connection->streamPrefixes.append(prefix);
+
+    writeResponses(connection);
+}
+
+void HTTPTransport::streamCacheMessage(const CacheMessage &cacheMessage)
+{
+    if (m_streamSubscriptions.count() == 0) {
+        return;
+    }
+
+    QList< HTTPTransportCallbackTrie::Subscription > subscriptions;
+    m_streamSubscriptions.match(cacheMessage.target(), &subscriptions);
+
+    QList< HTTPConnection* > streams;
+    for (const HTTPTransportCallbackTrie::Subscription &subscription : subscriptions) {
+        // A WebSocket might be subscribed to nested prefixes, it gets the message once
+        HTTPConnection *connection = m_streams.value(subscription.id);
+        if (connection && !streams.contains(connection)) {
+            streams.append(connection);
+        }
+    }
+
+    if (streams.isEmpty()) {
+        return;
+    }
+
+    QLatin1String eventType("property");
+    if (cacheMessage.interfaceType() == Hyperdrive::Interface::Type::DataStream) {
+        eventType = QLatin1String("datastream");
+    } else if (cacheMessage.payload().isEmpty()) {
+        eventType = QLatin1String("unset");
+    }
+    // Unset properties have no value
+    QJsonValue value = bsonValueToJsonValue(cacheMessage.payload());
+    QJsonObject data{{QStringLiteral("target"), QLatin1String(cacheMessage.target())},
+                     {QStringLiteral("value"), value.isUndefined() ? QJsonValue() : value}};
+
+    QByteArray event = "event: " + QByteArray(eventType.data()) + '\n';
+    event.append("data: ");
+    event.append(QJsonDocument(data).toJson(QJsonDocument::Compact));
+    event.append("\n\n");
+
+    data.insert(QStringLiteral("event"), eventType);
+    QByteArray webSocketFrame = HTTPTransportWebSocket::frame(HTTPTransportWebSocket::Opcode::Text,
+                                                              QJsonDocument(data).toJson(QJsonDocument::Compact));
+
+    for (HTTPConnection *connection : streams) {
+        const QByteArray &message = connection->webSocket ? webSocketFrame : event;
+        if (connection->socket->bytesToWrite() + message.size() > m_streamBufferSize) {
+            qCWarning(httpTransportDC) << "Streaming client" << connection->socket->peerAddress() << "is too slow, disconnecting it";
+            connection->socket->abort();
+            continue;
+        }
+        connection->socket->write(message);
+    }
+}
+
+void HTTPTransport::sendStreamHeartbeats()
+{
+    QList< HTTPConnection* > streams;
+    for (HTTPConnection *connection : m_streams) {
+        // WebSockets are pinged by their idle timer
+        if (!connection->webSocket) {
+            streams.append(connection);
+        }
+    }
+
+    for (HTTPConnection *connection : streams) {
+        // A stream backed up this much is left to streamCacheMessage
+        if (connection->socket->bytesToWrite() < m_streamBufferSize) {
+            connection->socket->write(":\n\n");
+        }
+    }
+}
+
+void HTTPTransport::startWebSocket(const Hyperspace::Wave &wave)
+{
+    HTTPConnection *connection = m_waveToConnection.value(wave.id());
+    if (Q_UNLIKELY(connection == Q_NULLPTR)) {
+        qCWarning(httpTransportDC) << "wave id " << wave.id() << " not found!!";
+        return;
+    }
+
+    QByteArray key = wave.attributes().value("Sec-WebSocket-Key");
+    // Pipelined requests before the upgrade would have their responses mixed up with frames
+    if (!connection->parser.upgrade || wave.attributes().value("Upgrade").toLower() != "websocket" || key.isEmpty() ||
+        wave.attributes().value("Sec-WebSocket-Version") != "13" || connection->pendingResponses.size() > 1) {
+        qCWarning(httpTransportDC) << "Invalid WebSocket upgrade request from" << connection->socket->peerAddress();
+        rebound(Hyperspace::Rebound(wave, Hyperspace::ResponseCode::BadRequest));
+        return;
+    }
+
+    qCInfo(httpTransportDC) << "WebSocket connection from" << connection->socket->peerAddress();
+
+    m_waveToConnection.remove(wave.id());
+    connection->webSocket = new HTTPTransportWebSocket(m_maximumWebSocketMessageSize);
+
+    HTTPPendingResponse &pending = connection->pendingResponses.last();
+    pending.data = statusString(101);
+    pending.data.append("Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: " + HTTPTransportWebSocket::acceptKey(key) + "\r\n\r\n");
+    pending.ready = true;
+    pending.startsStream = true;
+
+    writeResponses(connection);
+}
+
+void HTTPTransport::handleWebSocketData(HTTPConnection *connection, const QByteArray &data)
+{
+    // We are closing it already
+    if (connection->socket->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+
+    // Anything from the peer, a pong or else, shows it is still there
+    if (connection->idleTimer->isActive()) {
+        connection->webSocketPingSent = false;
+        connection->idleTimer->start();
+    }
+
+    QList< HTTPTransportWebSocket::Message > messages;
+    bool valid = connection->webSocket->feed(data, &messages);
+
+    for (const HTTPTransportWebSocket::Message &message : messages) {
+        switch (message.opcode) {
+            case HTTPTransportWebSocket::Opcode::Text:
+                handleWebSocketMessage(connection, message.payload);
+                break;
+
+            case HTTPTransportWebSocket::Opcode::Ping:
+                connection->socket->write(HTTPTransportWebSocket::frame(HTTPTransportWebSocket::Opcode::Pong, message.payload));
+                break;
+
+            case HTTPTransportWebSocket::Opcode::Close:
+                connection->socket->write(HTTPTransportWebSocket::closeFrame(HTTPTransportWebSocket::CloseCode::Normal));
+                connection->socket->disconnectFromHost();
+                return;
+
+            case HTTPTransportWebSocket::Opcode::Binary:
+                qCWarning(httpTransportDC) << "WebSocket client" << connection->socket->peerAddress() << "sent binary data, closing";
+                connection->socket->write(HTTPTransportWebSocket::closeFrame(HTTPTransportWebSocket::CloseCode::UnsupportedData));
+                connection->socket->disconnectFromHost();
+                return;
+
+            default:
+                break;
+        }
+    }
+
+    if (!valid) {
+        qCWarning(httpTransportDC) << "WebSocket client" << connection->socket->peerAddress() << "violated the protocol, closing";
+        connection->socket->write(HTTPTransportWebSocket::closeFrame(connection->webSocket->closeCode()));
+        connection->socket->disconnectFromHost();
+    }
+}
+
+void HTTPTransport::handleWebSocketMessage(HTTPConnection *connection, const QByteArray &message)
+{
+    QJsonDocument doc = QJsonDocument::fromJson(message);
+    if (Q_UNLIKELY(!doc.isObject())) {
+        qCWarning(httpTransportDC) << "WebSocket message doesn't contain a valid JSON object";
+        sendWebSocketMessage(connection, QJsonObject{{QStringLiteral("response"), static_cast<int>(Hyperspace::ResponseCode::BadRequest)}});
+        return;
+    }
+
+    QJsonObject request = doc.object();
+    QJsonValue id = request.value(QStringLiteral("id"));
+
+    if (request.contains(QStringLiteral("subscribe"))) {
+        QByteArray prefix = request.value(QStringLiteral("subscribe")).toString().toLatin1();
+        if (!connection->streamPrefixes.contains(prefix)) {
+            connection->streamPrefixes.append(prefix);
+            m_streams.insert(connection->streamId, connection);
+            m_streamSubscriptions.insert(prefix, connection->streamId, Q_NULLPTR);
+        }
+        sendWebSocketMessage(connection, QJsonObject{{QStringLiteral("id"), id},
+                                                     {QStringLiteral("response"), static_cast<int>(Hyperspace::ResponseCode::OK)}});
+        return;
+    } else if (request.contains(QStringLiteral("unsubscribe"))) {
+        QByteArray prefix = request.value(QStringLiteral("unsubscribe")).toString().toLatin1();
+        Hyperspace::ResponseCode response = Hyperspace::ResponseCode::NotFound;
+        if (connection->streamPrefixes.removeAll(prefix) > 0) {
+            m_streamSubscriptions.remove(prefix, connection->streamId);
+            response = Hyperspace::ResponseCode::OK;
+        }
+        sendWebSocketMessage(connection, QJsonObject{{QStringLiteral("id"), id},
+                                                     {QStringLiteral("response"), static_cast<int>(response)}});
+        return;
+    }
+
+    // Anything else is a request, just like it would come over HTTP
+    QByteArray method = request.value(QStringLiteral("method")).toString().toLatin1().toUpper();
+    QByteArray target = request.value(QStringLiteral("target")).toString().toLatin1();
+    if (method.isEmpty() || !target.startsWith('/') || target.startsWith("/control/")) {
+        qCWarning(httpTransportDC) << "Invalid WebSocket request" << method << target;
+        sendWebSocketMessage(connection, QJsonObject{{QStringLiteral("id"), id},
+                                                     {QStringLiteral("response"), static_cast<int>(Hyperspace::ResponseCode::BadRequest)}});
+        return;
+    }
+
+    Hyperspace::Wave wave;
+    wave.setMethod(method);
+    wave.setTarget(target);
+    if (request.contains(QStringLiteral("value"))) {
+        wave.addAttribute("Content-Type", "application/json");
+        wave.setPayload(QJsonDocument(QJsonObject{{QStringLiteral("v"), request.value(QStringLiteral("value"))}}).toJson(QJsonDocument::Compact));
+    }
+
+    m_waveToConnection.insert(wave.id(), connection);
+    connection->webSocketRequests.insert(wave.id(), id);
+    triggerWave(wave, connection->socket);
+}
+
+void HTTPTransport::sendWebSocketMessage(HTTPConnection *connection, const QJsonObject &message)
+{
+    connection->socket->write(HTTPTransportWebSocket::frame(HTTPTransportWebSocket::Opcode::Text,
+                                                            QJsonDocument(message).toJson(QJsonDocument::Compact)));
 }
 
 void HTTPTransport::bigBang()
@@ -6,9 +6,12 @@
 #define HYPERDRIVE_HTTPTRANSPORT_H
 
 #include "http_parser.h"
+#include "httptransportcallbacktrie.h"
 
 #include <hyperdriveremotetransport.h>
 
+#include <QtCore/QJsonObject>
+#include <QtCore/QJsonValue>
 #include <QtCore/QSet>
 
 #include <QtNetwork/QNetworkAccessManager>
@@ -17,17 +20,60 @@
 #include <HyperspaceCore/Wave>
 
 class QSslConfiguration;
+class QTimer;
 class TransportTCPServer;
 
 class HTTPTransportCallbackManager;
+class HTTPTransportWebSocket;
 class QTcpSocket;
 class QTcpServer;
 namespace Hyperdrive {
 
-enum class HTTPInternalServerState
+class HTTPTransport;
+
+// A request waiting for its response. Pipelined requests are answered in order.
+struct HTTPPendingResponse
+{
+    quint64 waveId;
+    QByteArray data;
+    bool ready;
+    bool keepAlive;
+    // Once written, the connection turns into an event stream
+    bool startsStream;
+};
+
+// Everything about a client connection. The parser callbacks reach it through parser.data.
+struct HTTPConnection
 {
-    WaitingForRequest,
-    ParsingRequest
+    HTTPTransport *transport;
+    QTcpSocket *socket;
+    http_parser parser;
+    QTimer *idleTimer;
+    // The request being parsed
+    Hyperspace::Wave wave;
+    // Header fields and values might come in several pieces
+    QByteArray headerField;
+    QByteArray headerValue;
+    // Whether the last header callback was a value: a field after it starts a new header, even if the value was empty
+    bool inHeaderValue;
+    // Bodies above the streaming threshold go here instead of the wave's payload
+    int bodyFd;
+    quint64 bodySize;
+    QList< HTTPPendingResponse > pendingResponses;
+    int servedRequests;
+    // No more requests are accepted, the connection closes once the pending ones are answered
+    bool closing;
+    // Cache messages under these prefixes are pushed to the client, as events or WebSocket messages
+    QList< QByteArray > streamPrefixes;
+    // Identifies the connection among the stream subscriptions
+    int streamId;
+    // Set once the connection has been upgraded. Requests it carries map to the ids the client gave them.
+    HTTPTransportWebSocket *webSocket;
+    QHash< quint64, QJsonValue > webSocketRequests;
+    // The idle timer sent a ping, the WebSocket closes if the peer stays silent for another interval
+    bool webSocketPingSent;
+
+    void flushHeader();
 };
 
 class HTTPTransport : public Hyperdrive::RemoteTransport
@@ -58,6 +104,7 @@ public:
 
 private Q_SLOTS:
     void clientConnected();
+    void sendStreamHeartbeats();
 
 protected:
     virtual void initImpl();
@@ -65,20 +112,37 @@ protected:
 private:
     HTTPTransportCallbackManager *m_callbackManager;
     QSslConfiguration sslConfiguration();
-    void triggerWave(Hyperspace::Wave wave, QTcpSocket *socket);
+    void triggerWave(Hyperspace::Wave wave, QTcpSocket *socket, int fd = -1);
+    void writeResponses(HTTPConnection *connection);
+    void startEventStream(const Hyperspace::Wave &wave, const QByteArray &prefix);
+    void startWebSocket(const Hyperspace::Wave &wave);
+    void handleWebSocketData(HTTPConnection *connection, const QByteArray &data);
+    void handleWebSocketMessage(HTTPConnection *connection, const QByteArray &message);
+    void sendWebSocketMessage(HTTPConnection *connection, const QJsonObject &message);
+    void streamCacheMessage(const CacheMessage &cacheMessage);
+    void rejectTooLargeRequest(HTTPConnection *connection);
+    void closeConnection(HTTPConnection *connection);
     void handleControlWave(const Hyperspace::Wave &wave, QTcpSocket *socket);
     QByteArray statusString(int statusCode);
     QByteArray waveToBSONPayload(const Hyperspace::Wave &wave);
-    QVariant byteArrayToVariantHeuristic(const QByteArray &value);
 
-    QHash< quint64, QTcpSocket* > m_waveToSocket;
-    QHash< http_parser*, quint64 > m_parserToWave;
-    QHash< QTcpSocket*, HTTPInternalServerState > m_socketToState;
-    QHash< quint64, Hyperspace::Wave > m_waveStorage;
-    QSet< QTcpSocket* > m_keepAliveSockets;
+    // Connections waiting for a rebound
+    QHash< quint64, HTTPConnection* > m_waveToConnection;
+    // Stream prefixes are matched like callback prefixes, subscription ids are connection stream ids
+    HTTPTransportCallbackTrie m_streamSubscriptions;
+    QHash< int, HTTPConnection* > m_streams;
+    int m_lastStreamId;
     QSslConfiguration m_sslConfiguration;
 
     http_parser_settings *m_parserSettings;
+    quint64 m_streamedBodyThreshold;
+    quint64 m_maximumBodySize;
+    int m_keepAliveTimeout;
+    int m_maximumRequestsPerConnection;
+    qint64 m_streamBufferSize;
+    int m_maximumWebSocketMessageSize;
+    int m_webSocketPingInterval;
+    QTimer *m_streamHeartbeatTimer;
 };
 }
 
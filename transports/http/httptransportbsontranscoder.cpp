@@ -0,0 +1,705 @@
+#include "httptransportbsontranscoder.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/qnumeric.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+#define MAXIMUM_DEPTH 64
+
+#define BSON_DOUBLE 0x01
+#define BSON_STRING 0x02
+#define BSON_DOCUMENT 0x03
+#define BSON_ARRAY 0x04
+#define BSON_BINARY 0x05
+#define BSON_BOOLEAN 0x08
+#define BSON_DATETIME 0x09
+#define BSON_NULL 0x0A
+#define BSON_INT32 0x10
+#define BSON_INT64 0x12
+
+// BSON is little endian
+static void appendInt32(QByteArray *bson, qint32 value)
+{
+    quint32 bits = static_cast<quint32>(value);
+    for (int i = 0; i < 4; ++i) {
+        bson->append(static_cast<char>(bits >> (8 * i)));
+    }
+}
+
+static void appendInt64(QByteArray *bson, qint64 value)
+{
+    quint64 bits = static_cast<quint64>(value);
+    for (int i = 0; i < 8; ++i) {
+        bson->append(static_cast<char>(bits >> (8 * i)));
+    }
+}
+
+static void patchInt32(QByteArray *bson, int position, qint32 value)
+{
+    quint32 bits = static_cast<quint32>(value);
+    for (int i = 0; i < 4; ++i) {
+        (*bson)[position + i] = static_cast<char>(bits >> (8 * i));
+    }
+}
+
+static qint32 readInt32(const char *data)
+{
+    const uchar *bytes = reinterpret_cast<const uchar*>(data);
+    return static_cast<qint32>(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<quint32>(bytes[3]) << 24));
+}
+
+static qint64 readInt64(const char *data)
+{
+    quint64 bits = 0;
+    for (int i = 7; i >= 0; --i) {
+        bits = (bits << 8) | reinterpret_cast<const uchar*>(data)[i];
+    }
+    return static_cast<qint64>(bits);
+}
+
+static void appendElementHeader(QByteArray *bson, char type, const QByteArray &name)
+{
+    bson->append(type);
+    bson->append(name);
+    bson->append('\0');
+}
+
+static void appendStringElement(QByteArray *bson, const QByteArray &name, const QByteArray &value)
+{
+    appendElementHeader(bson, BSON_STRING, name);
+    appendInt32(bson, value.size() + 1);
+    bson->append(value);
+    bson->append('\0');
+}
+
+// Cheap check on the shape, so that only strings starting like YYYY-MM-DD go through QDateTime
+static bool looksLikeDateTime(const QByteArray &value)
+{
+    static const char shape[] = "dddd-dd-dd";
+    if (value.size() < 10 || (value.size() > 10 && value.at(10) != 'T')) {
+        return false;
+    }
+    for (int i = 0; i < 10; ++i) {
+        if (shape[i] == 'd' ? (value.at(i) < '0' || value.at(i) > '9') : value.at(i) != shape[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void appendStringOrDateTime(QByteArray *bson, const QByteArray &name, const QByteArray &value)
+{
+    if (looksLikeDateTime(value)) {
+        QDateTime dateTime = QDateTime::fromString(QString::fromUtf8(value), Qt::ISODate);
+        if (dateTime.isValid()) {
+            appendElementHeader(bson, BSON_DATETIME, name);
+            appendInt64(bson, dateTime.toMSecsSinceEpoch());
+            return;
+        }
+    }
+    appendStringElement(bson, name, value);
+}
+
+// Integers which fit go as Int32, then Int64, anything else as Double. JSON bodies narrow integral
+// values written with a fraction or exponent (2.0, 1e3) to Int32 as well, as QJsonDocument did
+static bool appendNumber(QByteArray *bson, const QByteArray &name, const QByteArray &token, bool narrowIntegral)
+{
+    bool ok = false;
+    if (token.indexOf('.') < 0 && token.indexOf('e') < 0 && token.indexOf('E') < 0) {
+        qint64 integer = token.toLongLong(&ok, 10);
+        if (ok) {
+            if (static_cast<qint32>(integer) == integer) {
+                appendElementHeader(bson, BSON_INT32, name);
+                appendInt32(bson, static_cast<qint32>(integer));
+            } else {
+                appendElementHeader(bson, BSON_INT64, name);
+                appendInt64(bson, integer);
+            }
+            return true;
+        }
+    }
+
+    double value = token.toDouble(&ok);
+    if (!ok) {
+        return false;
+    }
+
+    if (narrowIntegral && value >= INT_MIN && value <= INT_MAX && static_cast<qint32>(value) == value) {
+        appendElementHeader(bson, BSON_INT32, name);
+        appendInt32(bson, static_cast<qint32>(value));
+        return true;
+    }
+
+    quint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    appendElementHeader(bson, BSON_DOUBLE, name);
+    appendInt64(bson, static_cast<qint64>(bits));
+    return true;
+}
+
+static QByteArray finishDocument(const QByteArray &elements)
+{
+    QByteArray bson;
+    appendInt32(&bson, elements.size() + 5);
+    bson.append(elements);
+    bson.append('\0');
+    return bson;
+}
+
+// Recursive descent over the JSON text, emitting BSON elements as values complete
+class JSONToBSONParser
+{
+public:
+    explicit JSONToBSONParser(const QByteArray &json)
+        : m_position(json.constData())
+        , m_end(json.constData() + json.size())
+        , m_depth(0)
+    {
+    }
+
+    bool parseValue(QByteArray *bson, const QByteArray &name);
+    bool parseDocument(QByteArray *bson, bool isArray);
+    bool parseKey(QByteArray *name);
+
+    bool consume(char c)
+    {
+        skipWhitespace();
+        if (m_position < m_end && *m_position == c) {
+            ++m_position;
+            return true;
+        }
+        return false;
+    }
+
+    bool atEnd()
+    {
+        skipWhitespace();
+        return m_position == m_end;
+    }
+
+private:
+    void skipWhitespace()
+    {
+        while (m_position < m_end && (*m_position == ' ' || *m_position == '\t' || *m_position == '\n' || *m_position == '\r')) {
+            ++m_position;
+        }
+    }
+
+    bool consumeLiteral(const char *literal)
+    {
+        int length = static_cast<int>(strlen(literal));
+        if (m_end - m_position < length || strncmp(m_position, literal, length) != 0) {
+            return false;
+        }
+        m_position += length;
+        return true;
+    }
+
+    bool parseString(QByteArray *value);
+
+    const char *m_position;
+    const char *m_end;
+    int m_depth;
+};
+
+bool JSONToBSONParser::parseValue(QByteArray *bson, const QByteArray &name)
+{
+    skipWhitespace();
+    if (m_position == m_end) {
+        return false;
+    }
+
+    switch (*m_position) {
+        case '{':
+            ++m_position;
+            appendElementHeader(bson, BSON_DOCUMENT, name);
+            return parseDocument(bson, false);
+
+        case '[':
+            ++m_position;
+            appendElementHeader(bson, BSON_ARRAY, name);
+            return parseDocument(bson, true);
+
+        case '"': {
+            QByteArray value;
+            ++m_position;
+            if (!parseString(&value)) {
+                return false;
+            }
+            appendStringOrDateTime(bson, name, value);
+            return true;
+        }
+
+        case 't':
+        case 'f': {
+            bool value = *m_position == 't';
+            if (!consumeLiteral(value ? "true" : "false")) {
+                return false;
+            }
+            appendElementHeader(bson, BSON_BOOLEAN, name);
+            bson->append(value ? '\1' : '\0');
+            return true;
+        }
+
+        case 'n':
+            if (!consumeLiteral("null")) {
+                return false;
+            }
+            appendElementHeader(bson, BSON_NULL, name);
+            return true;
+
+        default: {
+            const char *start = m_position;
+            while (m_position < m_end && *m_position != '\0' && strchr("+-0123456789.eE", *m_position) != Q_NULLPTR) {
+                ++m_position;
+            }
+            return m_position > start && appendNumber(bson, name, QByteArray::fromRawData(start, m_position - start), true);
+        }
+    }
+}
+
+bool JSONToBSONParser::parseDocument(QByteArray *bson, bool isArray)
+{
+    if (++m_depth > MAXIMUM_DEPTH) {
+        return false;
+    }
+
+    // The length is known once the document is closed
+    int start = bson->size();
+    appendInt32(bson, 0);
+
+    const char close = isArray ? ']' : '}';
+    if (!consume(close)) {
+        int index = 0;
+        do {
+            QByteArray name;
+            if (isArray) {
+                name = QByteArray::number(index++);
+            } else if (!parseKey(&name)) {
+                return false;
+            }
+
+            if (!parseValue(bson, name)) {
+                return false;
+            }
+        } while (consume(','));
+
+        if (!consume(close)) {
+            return false;
+        }
+    }
+
+    bson->append('\0');
+    patchInt32(bson, start, bson->size() - start);
+    --m_depth;
+    return true;
+}
+
+static void appendUtf8(QByteArray *value, uint codePoint)
+{
+    if (codePoint < 0x80) {
+        value->append(static_cast<char>(codePoint));
+    } else if (codePoint < 0x800) {
+        value->append(static_cast<char>(0xC0 | (codePoint >> 6)));
+        value->append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    } else if (codePoint < 0x10000) {
+        value->append(static_cast<char>(0xE0 | (codePoint >> 12)));
+        value->append(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        value->append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    } else {
+        value->append(static_cast<char>(0xF0 | (codePoint >> 18)));
+        value->append(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+        value->append(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        value->append(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    }
+}
+
+bool JSONToBSONParser::parseKey(QByteArray *name)
+{
+    // BSON names are C strings
+    return consume('"') && parseString(name) && !name->contains('\0') && consume(':');
+}
+
+// Decodes the escapes of a string whose opening quote has been consumed
+bool JSONToBSONParser::parseString(QByteArray *value)
+{
+    auto readHex = [this] (uint *codeUnit) -> bool {
+        if (m_end - m_position < 4) {
+            return false;
+        }
+        // toUInt() would let signs and spaces through
+        for (int i = 0; i < 4; ++i) {
+            if (!isxdigit(static_cast<uchar>(m_position[i]))) {
+                return false;
+            }
+        }
+        *codeUnit = QByteArray::fromRawData(m_position, 4).toUInt(Q_NULLPTR, 16);
+        m_position += 4;
+        return true;
+    };
+
+    while (m_position < m_end) {
+        char c = *m_position++;
+        if (c == '"') {
+            return true;
+        } else if (static_cast<uchar>(c) < 0x20) {
+            return false;
+        } else if (c != '\\') {
+            value->append(c);
+            continue;
+        }
+
+        if (m_position == m_end) {
+            return false;
+        }
+        switch (*m_position++) {
+            case '"': value->append('"'); break;
+            case '\\': value->append('\\'); break;
+            case '/': value->append('/'); break;
+            case 'b': value->append('\b'); break;
+            case 'f': value->append('\f'); break;
+            case 'n': value->append('\n'); break;
+            case 'r': value->append('\r'); break;
+            case 't': value->append('\t'); break;
+            case 'u': {
+                uint codePoint;
+                if (!readHex(&codePoint)) {
+                    return false;
+                }
+                // Characters outside the BMP come as surrogate pairs
+                if (codePoint >= 0xD800 && codePoint < 0xDC00) {
+                    uint low;
+                    if (!consumeLiteral("\\u") || !readHex(&low) || low < 0xDC00 || low > 0xDFFF) {
+                        return false;
+                    }
+                    codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                } else if (codePoint >= 0xDC00 && codePoint <= 0xDFFF) {
+                    // A low surrogate on its own is not a character
+                    return false;
+                }
+                appendUtf8(value, codePoint);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    return false;
+}
+
+QByteArray HTTPTransportBSONTranscoder::jsonToBSON(const QByteArray &json)
+{
+    JSONToBSONParser parser(json);
+    QByteArray element;
+
+    if (parser.consume('{')) {
+        // Only the value is kept, "v" winning over "value". Other members are parsed and dropped.
+        QByteArray valueElement;
+        QByteArray ignored;
+        if (!parser.consume('}')) {
+            do {
+                QByteArray name;
+                if (!parser.parseKey(&name)) {
+                    return QByteArray();
+                }
+
+                QByteArray *destination = &ignored;
+                if (name == "v") {
+                    element.clear();
+                    destination = &element;
+                } else if (name == "value") {
+                    valueElement.clear();
+                    destination = &valueElement;
+                }
+                if (!parser.parseValue(destination, "v")) {
+                    return QByteArray();
+                }
+                ignored.clear();
+            } while (parser.consume(','));
+
+            if (!parser.consume('}')) {
+                return QByteArray();
+            }
+        }
+
+        if (element.isEmpty()) {
+            element = valueElement;
+        }
+    } else if (!parser.parseValue(&element, "v")) {
+        return QByteArray();
+    }
+
+    if (element.isEmpty() || !parser.atEnd()) {
+        return QByteArray();
+    }
+
+    return finishDocument(element);
+}
+
+QByteArray HTTPTransportBSONTranscoder::textToBSON(const QByteArray &text)
+{
+    QByteArray element;
+
+    if (text == "true" || text == "false") {
+        appendElementHeader(&element, BSON_BOOLEAN, "v");
+        element.append(text == "true" ? '\1' : '\0');
+        return finishDocument(element);
+    }
+
+    // Numbers are told apart by their characters, before trying to convert them
+    bool numeric = !text.isEmpty();
+    for (char c : text) {
+        if (c == '\0' || strchr("+-0123456789.eE", c) == Q_NULLPTR) {
+            numeric = false;
+            break;
+        }
+    }
+    if (numeric && appendNumber(&element, "v", text, false)) {
+        return finishDocument(element);
+    }
+
+    // Plain text bodies are Latin-1
+    element.clear();
+    appendStringOrDateTime(&element, "v", QString::fromLatin1(text).toUtf8());
+    return finishDocument(element);
+}
+
+QByteArray HTTPTransportBSONTranscoder::binaryToBSON(const QByteArray &data)
+{
+    QByteArray element;
+    appendElementHeader(&element, BSON_BINARY, "v");
+    appendInt32(&element, data.size());
+    // Generic subtype
+    element.append('\0');
+    element.append(data);
+    return finishDocument(element);
+}
+
+void HTTPTransportBSONTranscoder::appendJSONString(QByteArray *json, const char *data, int size)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    json->append('"');
+    for (int i = 0; i < size; ++i) {
+        uchar c = static_cast<uchar>(data[i]);
+        switch (c) {
+            case '"': json->append("\\\""); break;
+            case '\\': json->append("\\\\"); break;
+            case '\b': json->append("\\b"); break;
+            case '\f': json->append("\\f"); break;
+            case '\n': json->append("\\n"); break;
+            case '\r': json->append("\\r"); break;
+            case '\t': json->append("\\t"); break;
+            default:
+                if (c < 0x20) {
+                    json->append("\\u00");
+                    json->append(hex[c >> 4]);
+                    json->append(hex[c & 0xF]);
+                } else {
+                    // UTF-8 goes through untouched
+                    json->append(static_cast<char>(c));
+                }
+        }
+    }
+    json->append('"');
+}
+
+static bool readDocument(const char *&position, const char *end, bool isArray, QByteArray *json, int depth);
+
+static bool readValue(const char *&position, const char *end, char type, QByteArray *json, int depth)
+{
+    switch (type) {
+        case BSON_DOUBLE: {
+            if (end - position < 8) {
+                return false;
+            }
+            quint64 bits = static_cast<quint64>(readInt64(position));
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            position += 8;
+            // JSON has no infinities nor NaNs
+            json->append(qIsFinite(value) ? QByteArray::number(value, 'g', 17) : QByteArray("null"));
+            return true;
+        }
+
+        case BSON_STRING: {
+            if (end - position < 4) {
+                return false;
+            }
+            qint32 size = readInt32(position);
+            position += 4;
+            if (size < 1 || end - position < size || position[size - 1] != '\0') {
+                return false;
+            }
+            HTTPTransportBSONTranscoder::appendJSONString(json, position, size - 1);
+            position += size;
+            return true;
+        }
+
+        case BSON_DOCUMENT:
+        case BSON_ARRAY:
+            return readDocument(position, end, type == BSON_ARRAY, json, depth + 1);
+
+        case BSON_BINARY: {
+            if (end - position < 5) {
+                return false;
+            }
+            qint32 size = readInt32(position);
+            position += 5;
+            if (size < 0 || end - position < size) {
+                return false;
+            }
+            QByteArray base64 = QByteArray::fromRawData(position, size).toBase64();
+            HTTPTransportBSONTranscoder::appendJSONString(json, base64.constData(), base64.size());
+            position += size;
+            return true;
+        }
+
+        case BSON_BOOLEAN:
+            if (end - position < 1) {
+                return false;
+            }
+            json->append(*position++ ? "true" : "false");
+            return true;
+
+        case BSON_DATETIME: {
+            if (end - position < 8) {
+                return false;
+            }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 8, 0)
+            QByteArray dateTime = QDateTime::fromMSecsSinceEpoch(readInt64(position), Qt::UTC).toString(Qt::ISODateWithMs).toLatin1();
+#else
+            QByteArray dateTime = QDateTime::fromMSecsSinceEpoch(readInt64(position), Qt::UTC).toString(Qt::ISODate).toLatin1();
+#endif
+            HTTPTransportBSONTranscoder::appendJSONString(json, dateTime.constData(), dateTime.size());
+            position += 8;
+            return true;
+        }
+
+        case BSON_NULL:
+            json->append("null");
+            return true;
+
+        case BSON_INT32:
+            if (end - position < 4) {
+                return false;
+            }
+            json->append(QByteArray::number(readInt32(position)));
+            position += 4;
+            return true;
+
+        case BSON_INT64:
+            if (end - position < 8) {
+                return false;
+            }
+            json->append(QByteArray::number(readInt64(position)));
+            position += 8;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool readDocument(const char *&position, const char *end, bool isArray, QByteArray *json, int depth)
+{
+    if (depth > MAXIMUM_DEPTH || end - position < 5) {
+        return false;
+    }
+
+    qint32 size = readInt32(position);
+    if (size < 5 || end - position < size || position[size - 1] != '\0') {
+        return false;
+    }
+    const char *documentEnd = position + size - 1;
+    position += 4;
+
+    json->append(isArray ? '[' : '{');
+    bool first = true;
+    while (position < documentEnd) {
+        char type = *position++;
+        const char *name = position;
+        while (position < documentEnd && *position != '\0') {
+            ++position;
+        }
+        if (position == documentEnd) {
+            return false;
+        }
+        int nameSize = position - name;
+        ++position;
+
+        if (!first) {
+            json->append(',');
+        }
+        first = false;
+
+        // Array keys are just the indexes
+        if (!isArray) {
+            HTTPTransportBSONTranscoder::appendJSONString(json, name, nameSize);
+            json->append(':');
+        }
+        if (!readValue(position, documentEnd, type, json, depth)) {
+            return false;
+        }
+    }
+    json->append(isArray ? ']' : '}');
+
+    // Skip the terminator
+    ++position;
+    return true;
+}
+
+QByteArray HTTPTransportBSONTranscoder::bsonToJSON(const QByteArray &bson)
+{
+    const char *position = bson.constData();
+    QByteArray json;
+    if (!readDocument(position, bson.constData() + bson.size(), false, &json, 0)) {
+        return QByteArray();
+    }
+    return json;
+}
+
+QByteArray HTTPTransportBSONTranscoder::bsonValueToJSON(const QByteArray &bson, const QByteArray &key)
+{
+    const char *position = bson.constData();
+    const char *end = bson.constData() + bson.size();
+    if (end - position < 5) {
+        return QByteArray();
+    }
+
+    qint32 size = readInt32(position);
+    if (size < 5 || end - position < size || position[size - 1] != '\0') {
+        return QByteArray();
+    }
+    const char *documentEnd = position + size - 1;
+    position += 4;
+
+    // Values before the one we want are skipped by converting them, they are usually few and small
+    QByteArray json;
+    while (position < documentEnd) {
+        char type = *position++;
+        const char *name = position;
+        while (position < documentEnd && *position != '\0') {
+            ++position;
+        }
+        if (position == documentEnd) {
+            return QByteArray();
+        }
+        bool found = key == QByteArray::fromRawData(name, position - name);
+        ++position;
+
+        json.clear();
+        if (!readValue(position, documentEnd, type, &json, 0)) {
+            return QByteArray();
+        }
+        if (found) {
+            return json;
+        }
+    }
+
+    return QByteArray();
+}
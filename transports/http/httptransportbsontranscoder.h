@@ -0,0 +1,25 @@
+#ifndef HTTP_TRANSPORT_BSON_TRANSCODER
+#define HTTP_TRANSPORT_BSON_TRANSCODER
+
+#include <QtCore/QByteArray>
+
+// Converts between HTTP bodies and the BSON documents gates speak, writing the target format directly
+// while the source is read once. Values live under "v", aggregates and arrays included.
+class HTTPTransportBSONTranscoder
+{
+public:
+    // A JSON body holding the value under "v" or "value", or a bare JSON value. Null on malformed JSON.
+    static QByteArray jsonToBSON(const QByteArray &json);
+    // A plain text body: booleans, numbers and ISO 8601 dates are detected, anything else is a string
+    static QByteArray textToBSON(const QByteArray &text);
+    static QByteArray binaryToBSON(const QByteArray &data);
+
+    // The whole document, or the value of one of its top level keys, as JSON. Null on malformed BSON
+    // or a missing key.
+    static QByteArray bsonToJSON(const QByteArray &bson);
+    static QByteArray bsonValueToJSON(const QByteArray &bson, const QByteArray &key);
+
+    static void appendJSONString(QByteArray *json, const char *data, int size);
+};
+
+#endif
@@ -1,14 +1,58 @@
 
 #include "httptransportcache.h"
 
+#include <QtCore/QDateTime>
+#include <QtCore/QHash>
 #include <QtCore/QJsonObject>
 
 class HTTPTransportCache::Private
 {
 public:
+    Private() : lastVersion(0), epoch(QByteArray::number(QDateTime::currentMSecsSinceEpoch(), 36)) {}
+
+    static QByteArray treePrefix(const QByteArray &target);
+    void touch(const QByteArray &target);
+    QByteArray tag(quint64 version) const;
+
     QMap< QByteArray, QByteArray > persistentEntries;
+    // Rendered trees, by tree prefix
+    QHash< QByteArray, QByteArray > renderedTrees;
+
+    // Versions come from a single counter, the epoch tells tags from previous runs apart
+    quint64 lastVersion;
+    QByteArray epoch;
+    QHash< QByteArray, quint64 > entryVersions;
+    QHash< QByteArray, quint64 > treeVersions;
 };
 
+// Entries of a tree are the ones starting with this, so we match at path boundaries only
+QByteArray HTTPTransportCache::Private::treePrefix(const QByteArray &target)
+{
+    return target.endsWith('/') ? target : target + '/';
+}
+
+void HTTPTransportCache::Private::touch(const QByteArray &target)
+{
+    quint64 version = ++lastVersion;
+    if (persistentEntries.contains(target)) {
+        entryVersions.insert(target, version);
+    } else {
+        entryVersions.remove(target);
+    }
+
+    // Every tree containing target is rooted at one of its ancestors
+    for (int i = target.indexOf('/'); i >= 0; i = target.indexOf('/', i + 1)) {
+        QByteArray prefix = target.left(i + 1);
+        treeVersions.insert(prefix, version);
+        renderedTrees.remove(prefix);
+    }
+}
+
+QByteArray HTTPTransportCache::Private::tag(quint64 version) const
+{
+    return '"' + epoch + '-' + QByteArray::number(version) + '"';
+}
+
 static HTTPTransportCache* s_instance;
 
 HTTPTransportCache::HTTPTransportCache(QObject *parent)
@@ -38,12 +82,23 @@ void HTTPTransportCache::initImpl()
 
 void HTTPTransportCache::insertOrUpdatePersistentEntry(const QByteArray &target, const QByteArray &payload)
 {
-    d->persistentEntries.insert(target, payload);
+    QMap< QByteArray, QByteArray >::iterator it = d->persistentEntries.find(target);
+    if (it == d->persistentEntries.end()) {
+        d->persistentEntries.insert(target, payload);
+    } else if (it.value() != payload) {
+        it.value() = payload;
+    } else {
+        return;
+    }
+
+    d->touch(target);
 }
 
 void HTTPTransportCache::removePersistentEntry(const QByteArray &target)
 {
-    d->persistentEntries.remove(target);
+    if (d->persistentEntries.remove(target) > 0) {
+        d->touch(target);
+    }
 }
 
 bool HTTPTransportCache::isCached(const QByteArray &target) const
@@ -53,22 +108,9 @@ bool HTTPTransportCache::isCached(const QByteArray &target) const
 
 bool HTTPTransportCache::hasTree(const QByteArray &target) const
 {
-    for (const QByteArray &key : d->persistentEntries.keys()) {
-        if (key < target) {
-            continue;
-        }
-
-        if (key.startsWith(target)) {
-            // Make sure we match at path boundaries, not arbitrary prefixes
-            QByteArray relativePath = key;
-            relativePath.replace(target, "");
-            if (target.endsWith("/") || relativePath.startsWith("/")) {
-                return true;
-            }
-        }
-        return false;
-    }
-    return false;
+    QByteArray prefix = Private::treePrefix(target);
+    QMap< QByteArray, QByteArray >::const_iterator it = d->persistentEntries.lowerBound(prefix);
+    return it != d->persistentEntries.constEnd() && it.key().startsWith(prefix);
 }
 
 QByteArray HTTPTransportCache::persistentEntry(const QByteArray &target) const
@@ -87,23 +129,18 @@ QJsonDocument HTTPTransportCache::tree(const QByteArray &target) const
     QList<QJsonObject> objectStack;
     // Root object
     objectStack.push_back(QJsonObject());
-    for (const QByteArray &key : d->persistentEntries.keys()) {
-        // We have not reached keys starting with target yet
-        if (key < target) {
-            continue;
-        }
 
-        if (key.startsWith(target)) {
-
-            QByteArray relativePath = key;
-            // Remove the target
-            relativePath.replace(target, "");
-            if (!target.endsWith("/")) {
-                // Remove also the leading slash
-                relativePath.remove(0, 1);
-            }
+    // Keys below target are contiguous, starting from the lower bound of its prefix
+    QByteArray prefix = Private::treePrefix(target);
+    for (QMap< QByteArray, QByteArray >::const_iterator it = d->persistentEntries.lowerBound(prefix);
+         it != d->persistentEntries.constEnd(); ++it) {
+        if (it.key().startsWith(prefix)) {
+            QByteArray relativePath = it.key().mid(prefix.size());
             QList<QByteArray> subPaths = relativePath.split('/');
             subPaths.removeAll("");
+            if (subPaths.isEmpty()) {
+                continue;
+            }
 
             int toBePopped = pathStackPopSize(pathStack, subPaths);
 
@@ -121,7 +158,7 @@ QJsonDocument HTTPTransportCache::tree(const QByteArray &target) const
             }
 
             // The last subpath is the actual value
-            objectStack.last().insert(QLatin1String(subPaths.last()), QLatin1String(d->persistentEntries.value(key)));
+            objectStack.last().insert(QLatin1String(subPaths.last()), QLatin1String(it.value()));
 
         // We reached the end of the keys starting with target, we're done here
         } else {
@@ -141,6 +178,29 @@ QJsonDocument HTTPTransportCache::tree(const QByteArray &target) const
     return tree;
 }
 
+QByteArray HTTPTransportCache::renderedTree(const QByteArray &target) const
+{
+    QByteArray prefix = Private::treePrefix(target);
+    QHash< QByteArray, QByteArray >::const_iterator it = d->renderedTrees.constFind(prefix);
+    if (it != d->renderedTrees.constEnd()) {
+        return it.value();
+    }
+
+    QByteArray rendered = tree(target).toJson(QJsonDocument::Compact);
+    d->renderedTrees.insert(prefix, rendered);
+    return rendered;
+}
+
+QByteArray HTTPTransportCache::entryTag(const QByteArray &target) const
+{
+    return d->tag(d->entryVersions.value(target));
+}
+
+QByteArray HTTPTransportCache::treeTag(const QByteArray &target) const
+{
+    return d->tag(d->treeVersions.value(Private::treePrefix(target)));
+}
+
 int HTTPTransportCache::pathStackPopSize(const QList<QByteArray> currentStack, const QList<QByteArray> &newPath) const
 {
     if (currentStack.isEmpty()) {
@@ -31,6 +31,12 @@ public Q_SLOTS:
     bool hasTree(const QByteArray &target) const;
 
     QJsonDocument tree(const QByteArray &target) const;
+    // Compact JSON of tree(), cached until an entry below target changes
+    QByteArray renderedTree(const QByteArray &target) const;
+
+    // Entity tags, changing whenever the entry or anything in the tree changes
+    QByteArray entryTag(const QByteArray &target) const;
+    QByteArray treeTag(const QByteArray &target) const;
 
     void enqueueEntry(const QByteArray &target, const QByteArray &payload,
                       CacheReliability reliability = CacheReliability::Volatile, int cacheExpiry = -1);
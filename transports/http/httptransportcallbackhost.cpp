@@ -1,24 +1,39 @@
 #include "httptransportcallbackhost.h"
 
+#include "httptransportbsontranscoder.h"
 #include "httptransportcallbackmanager.h"
 
-#include <cachemessage.h>
-
-#include <HyperspaceCore/BSONDocument>
-
 #include <QtCore/QLoggingCategory>
 
 #include <QtNetwork/QNetworkReply>
 #include <QtNetwork/QNetworkRequest>
 
+#define FLUSH_INTERVAL 100
+#define MAXIMUM_IN_FLIGHT 4
+#define MINIMUM_RETRY_DELAY 1000
+#define MAXIMUM_RETRY_DELAY (60 * 1000)
+#define MAXIMUM_QUEUED_DELIVERIES 1000
+
 Q_LOGGING_CATEGORY(httpTransportCallbackHostDC, "hyperdrive.transport.http.callbackhost", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
 HTTPTransportCallbackHost::HTTPTransportCallbackHost(QString host, QNetworkAccessManager *networkAccessManager, HTTPTransportCallbackManager *parent)
     : QObject(parent)
     , m_callbackManager(parent)
     , m_host(host)
+    , m_flushTimer(new QTimer(this))
+    , m_retryTimer(new QTimer(this))
+    , m_retryDelay(0)
+    , m_inFlight(0)
+    , m_maximumInFlight(MAXIMUM_IN_FLIGHT)
     , m_networkAccessManager(networkAccessManager)
 {
+    m_flushTimer->setSingleShot(true);
+    m_flushTimer->setInterval(FLUSH_INTERVAL);
+    connect(m_flushTimer, &QTimer::timeout, this, &HTTPTransportCallbackHost::flush);
+
+    // While backing off, deliveries wait for this one instead of the flush timer
+    m_retryTimer->setSingleShot(true);
+    connect(m_retryTimer, &QTimer::timeout, this, &HTTPTransportCallbackHost::flush);
 }
 
 HTTPTransportCallbackHost::~HTTPTransportCallbackHost()
@@ -48,36 +63,148 @@ void HTTPTransportCallbackHost::addCallback(int id, QUrl url)
 void HTTPTransportCallbackHost::removeCallback(int id)
 {
     m_callbackIdToUrl.remove(id);
+    m_batches.remove(id);
+}
+
+void HTTPTransportCallbackHost::setFlushInterval(int flushInterval)
+{
+    m_flushTimer->setInterval(flushInterval);
+}
+
+void HTTPTransportCallbackHost::setMaximumInFlight(int maximumInFlight)
+{
+    m_maximumInFlight = qMax(1, maximumInFlight);
+}
+
+void HTTPTransportCallbackHost::triggerCallback(int id, const QByteArray &target, const QByteArray &value, bool coalesce)
+{
+    if (Q_UNLIKELY(!m_callbackIdToUrl.contains(id))) {
+        return;
+    }
+
+    enqueue(m_batches[id], Delivery{target, value, coalesce}, true);
+    scheduleFlush();
+}
+
+void HTTPTransportCallbackHost::enqueue(Batch &batch, const Delivery &delivery, bool replace)
+{
+    if (delivery.coalesce) {
+        QHash< QByteArray, int >::const_iterator it = batch.coalescedIndexes.constFind(delivery.target);
+        if (it != batch.coalescedIndexes.constEnd()) {
+            // Only the latest value of a property matters
+            if (replace) {
+                batch.deliveries[it.value()].value = delivery.value;
+            }
+            return;
+        }
+    } else if (batch.deliveries.size() >= MAXIMUM_QUEUED_DELIVERIES) {
+        qCWarning(httpTransportCallbackHostDC) << "Too many deliveries queued for" << m_host << ", dropping" << delivery.target;
+        return;
+    }
+
+    if (delivery.coalesce) {
+        batch.coalescedIndexes.insert(delivery.target, batch.deliveries.size());
+    }
+    batch.deliveries.append(delivery);
+}
+
+void HTTPTransportCallbackHost::scheduleFlush()
+{
+    if (!m_flushTimer->isActive() && !m_retryTimer->isActive()) {
+        m_flushTimer->start();
+    }
+}
+
+void HTTPTransportCallbackHost::flush()
+{
+    QHash< int, Batch >::iterator it = m_batches.begin();
+    while (it != m_batches.end() && m_inFlight < m_maximumInFlight) {
+        int id = it.key();
+        // One batch at a time per subscription, or they could arrive out of order. Its reply flushes again.
+        if (m_busyIds.contains(id)) {
+            ++it;
+            continue;
+        }
+        QList< Delivery > deliveries = it.value().deliveries;
+        it = m_batches.erase(it);
+
+        if (!deliveries.isEmpty()) {
+            send(id, deliveries);
+        }
+    }
 }
 
-void HTTPTransportCallbackHost::triggerCallback(int id, const Hyperdrive::CacheMessage &cacheMessage)
+void HTTPTransportCallbackHost::send(int id, const QList< Delivery > &deliveries)
 {
-    Hyperspace::Util::BSONDocument doc(cacheMessage.payload());
-    // TODO: handle aggregates
-    QByteArray deserializedPayload = doc.value("v").toByteArray();
-
-    QString baseUrlString = m_callbackIdToUrl.value(id).toString(QUrl::StripTrailingSlash);
-    // StripTrailingSlash sometimes leaves a trailing slash (see https://bugreports.qt.io/browse/QTBUG-35921), fix that
-    if (baseUrlString.endsWith(QStringLiteral("/"))) {
-        baseUrlString.remove(baseUrlString.length() - 1, 1);
+    QUrl url = m_callbackIdToUrl.value(id);
+
+    // Values are JSON already, the batch is written around them
+    QByteArray batch = "[";
+    for (const Delivery &delivery : deliveries) {
+        if (batch.size() > 1) {
+            batch.append(',');
+        }
+        batch.append("{\"target\":");
+        HTTPTransportBSONTranscoder::appendJSONString(&batch, delivery.target.constData(), delivery.target.size());
+        batch.append(",\"value\":");
+        batch.append(delivery.value);
+        batch.append('}');
     }
-    QUrl fullUrl;
-    fullUrl.setUrl(baseUrlString + QLatin1String(cacheMessage.target()));
+    batch.append(']');
 
-    qCDebug(httpTransportCallbackHostDC) << "Sending POST to" << fullUrl;
+    qCDebug(httpTransportCallbackHostDC) << "Sending POST to" << url << "with" << deliveries.size() << "deliveries";
 
-    QNetworkRequest req(fullUrl);
-    req.setHeader(QNetworkRequest::ContentTypeHeader, QStringLiteral("text/plain"));
+    QNetworkRequest req(url);
+    req.setHeader(QNetworkRequest::ContentTypeHeader, QStringLiteral("application/json"));
     req.setRawHeader("X-Hardware-Id", m_callbackManager->hardwareId());
     req.setRawHeader("X-Subscription-Id", QByteArray::number(id));
 
-    QNetworkReply *reply = m_networkAccessManager->post(req, deserializedPayload);
-    connect(reply, &QNetworkReply::finished, [this, reply, fullUrl] {
+    ++m_inFlight;
+    m_busyIds.insert(id);
+    QNetworkReply *reply = m_networkAccessManager->post(req, batch);
+    connect(reply, &QNetworkReply::finished, this, [this, reply, id, url, deliveries] {
+        --m_inFlight;
+        m_busyIds.remove(id);
+
+        // The subscriber rejected the batch itself: sending it again would get the same answer.
+        // Timeouts and rate limiting are worth another try.
+        int statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        bool rejected = statusCode >= 400 && statusCode < 500 && statusCode != 408 && statusCode != 429;
+
         if (reply->error() == QNetworkReply::NoError) {
-            qCDebug(httpTransportCallbackHostDC) << "POST to" << fullUrl << "delivered correctly";
+            qCDebug(httpTransportCallbackHostDC) << "POST to" << url << "delivered correctly";
+            m_retryDelay = 0;
+        } else if (rejected) {
+            qCWarning(httpTransportCallbackHostDC) << "POST to" << url << "rejected with" << statusCode << ", dropping"
+                                                   << deliveries.size() << "deliveries";
         } else {
-            qCWarning(httpTransportCallbackHostDC) << "POST to" << fullUrl << "error: " << reply->error();
+            m_retryDelay = m_retryDelay == 0 ? MINIMUM_RETRY_DELAY : qMin(m_retryDelay * 2, MAXIMUM_RETRY_DELAY);
+            qCWarning(httpTransportCallbackHostDC) << "POST to" << url << "error: " << reply->error() << ", retrying in" << m_retryDelay << "ms";
+
+            if (m_callbackIdToUrl.contains(id)) {
+                // Failed deliveries go before the ones queued meanwhile, unless a newer value replaced them
+                Batch &queued = m_batches[id];
+                Batch merged;
+                for (Delivery delivery : deliveries) {
+                    if (delivery.coalesce && queued.coalescedIndexes.contains(delivery.target)) {
+                        delivery.value = queued.deliveries.at(queued.coalescedIndexes.value(delivery.target)).value;
+                    }
+                    enqueue(merged, delivery, true);
+                }
+                for (const Delivery &delivery : queued.deliveries) {
+                    enqueue(merged, delivery, false);
+                }
+                queued = merged;
+            }
+
+            m_flushTimer->stop();
+            m_retryTimer->start(m_retryDelay);
+        }
+
+        reply->deleteLater();
+
+        if (!m_batches.isEmpty()) {
+            scheduleFlush();
         }
-            reply->deleteLater();
     });
 }
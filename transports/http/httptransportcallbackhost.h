@@ -1,18 +1,15 @@
 #ifndef HTTP_TRANSPORT_CALLBACK_HOST
 #define HTTP_TRANSPORT_CALLBACK_HOST
 
+#include <QtCore/QHash>
+#include <QtCore/QList>
 #include <QtCore/QObject>
-#include <QtCore/QQueue>
 #include <QtCore/QSet>
 #include <QtCore/QTimer>
 #include <QtCore/QUrl>
 
 #include <QtNetwork/QNetworkAccessManager>
 
-namespace Hyperdrive {
-class CacheMessage;
-}
-
 class HTTPTransportCallbackManager;
 
 class HTTPTransportCallbackHost : public QObject
@@ -32,17 +29,45 @@ public:
 
     void addCallback(int id, QUrl url);
     void removeCallback(int id);
-    void triggerCallback(int id, const Hyperdrive::CacheMessage &cacheMessage);
+    // Queues a delivery of a JSON value for the next flush. Queued values of the same property are replaced.
+    void triggerCallback(int id, const QByteArray &target, const QByteArray &value, bool coalesce);
+
+    void setFlushInterval(int flushInterval);
+    void setMaximumInFlight(int maximumInFlight);
+
+private Q_SLOTS:
+    void flush();
 
 private:
+    struct Delivery {
+        QByteArray target;
+        QByteArray value;
+        bool coalesce;
+    };
+
+    // Deliveries waiting for a callback, in order. Coalesced targets are indexed.
+    struct Batch {
+        QList< Delivery > deliveries;
+        QHash< QByteArray, int > coalescedIndexes;
+    };
+
+    void enqueue(Batch &batch, const Delivery &delivery, bool replace);
+    void send(int id, const QList< Delivery > &deliveries);
+    void scheduleFlush();
+
     HTTPTransportCallbackManager *m_callbackManager;
 
-    bool m_busy;
     QString m_host;
+    QTimer *m_flushTimer;
     QTimer *m_retryTimer;
+    int m_retryDelay;
+    int m_inFlight;
+    int m_maximumInFlight;
     QHash<int, QUrl> m_callbackIdToUrl;
+    QHash<int, Batch> m_batches;
+    // Subscriptions with a batch on its way
+    QSet<int> m_busyIds;
     QNetworkAccessManager *m_networkAccessManager;
-    QQueue<Hyperdrive::CacheMessage> m_messageQueue;
 };
 
 #endif
@@ -1,10 +1,12 @@
 #include "httptransportcallbackmanager.h"
 
+#include "httptransportbsontranscoder.h"
 #include "httptransportcallback.h"
 #include "httptransportcallbackhost.h"
 
 #include <cachemessage.h>
 
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QLoggingCategory>
 
 #include <QtNetwork/QNetworkAccessManager>
@@ -19,6 +21,10 @@ Q_LOGGING_CATEGORY(callbackManagerDC, "hyperdrive.transport.http.callbackmanager
 HTTPTransportCallbackManager::HTTPTransportCallbackManager(QObject *parent)
     : Hemera::AsyncInitObject(parent)
     , m_callbackIdCounter(0)
+    , m_flushInterval(-1)
+    , m_maximumInFlight(-1)
+    , m_matchCount(0)
+    , m_matchNanoseconds(0)
     , m_networkAccessManager(new QNetworkAccessManager())
 {
     // TODO: make this configurable
@@ -64,7 +70,6 @@ int HTTPTransportCallbackManager::subscribe(QByteArray prefix, QUrl url, QDateTi
 
     m_callbackIdCounter++;
 
-    m_prefixToIds.insert(prefix, id);
     HTTPTransportCallback *callback = new HTTPTransportCallback(id, prefix, url, host, expiry);
     m_idToCallback.insert(id, callback);
 
@@ -73,9 +78,17 @@ int HTTPTransportCallbackManager::subscribe(QByteArray prefix, QUrl url, QDateTi
     }
 
     if (!m_callbackHosts.contains(host)) {
-        m_callbackHosts.insert(host, new HTTPTransportCallbackHost(host, m_networkAccessManager, this));
+        HTTPTransportCallbackHost *callbackHost = new HTTPTransportCallbackHost(host, m_networkAccessManager, this);
+        if (m_flushInterval >= 0) {
+            callbackHost->setFlushInterval(m_flushInterval);
+        }
+        if (m_maximumInFlight > 0) {
+            callbackHost->setMaximumInFlight(m_maximumInFlight);
+        }
+        m_callbackHosts.insert(host, callbackHost);
     }
     m_callbackHosts.value(host)->addCallback(id, url);
+    m_subscriptions.insert(prefix, id, m_callbackHosts.value(host));
 
     return id;
 }
@@ -94,26 +107,76 @@ bool HTTPTransportCallbackManager::unsubscribe(int id)
     }
 
     QByteArray prefix = m_idToCallback.value(id)->prefix();
-    m_prefixToIds.remove(prefix, id);
+    m_subscriptions.remove(prefix, id);
 
     delete m_idToCallback.value(id);
     m_idToCallback.remove(id);
     return true;
 }
 
+void HTTPTransportCallbackManager::setFlushInterval(int flushInterval)
+{
+    m_flushInterval = flushInterval;
+    for (HTTPTransportCallbackHost *callbackHost : m_callbackHosts) {
+        callbackHost->setFlushInterval(flushInterval);
+    }
+}
+
+void HTTPTransportCallbackManager::setMaximumInFlight(int maximumInFlight)
+{
+    m_maximumInFlight = maximumInFlight;
+    for (HTTPTransportCallbackHost *callbackHost : m_callbackHosts) {
+        callbackHost->setMaximumInFlight(maximumInFlight);
+    }
+}
+
 void HTTPTransportCallbackManager::checkCallbacks(const Hyperdrive::CacheMessage &cacheMessage)
 {
-    for (const QByteArray &prefix : m_prefixToIds.uniqueKeys()) {
-        // We passed all the possible prefixes, it's an ordered map
-        if (prefix > cacheMessage.target()) {
-            break;
-        }
+    // Only the latest value of a property is worth delivering
+    bool coalesce = cacheMessage.interfaceType() == Hyperdrive::Interface::Type::Properties;
 
-        if (cacheMessage.target().startsWith(prefix)) {
-            for (int callbackId : m_prefixToIds.values(prefix)) {
-                QString host = m_idToCallback.value(callbackId)->url().host();
-                m_callbackHosts.value(host)->triggerCallback(callbackId, cacheMessage);
-            }
-        }
+    QElapsedTimer matchTimer;
+    matchTimer.start();
+
+    QList< HTTPTransportCallbackTrie::Subscription > subscriptions;
+    m_subscriptions.match(cacheMessage.target(), &subscriptions);
+
+    m_matchNanoseconds += matchTimer.nsecsElapsed();
+    ++m_matchCount;
+
+    if (subscriptions.isEmpty()) {
+        return;
     }
+
+    // Decoded once for every callback. An empty payload unsets a property.
+    QByteArray value = cacheMessage.payload().isEmpty() ? QByteArray("null") :
+                           HTTPTransportBSONTranscoder::bsonValueToJSON(cacheMessage.payload(), "v");
+    if (Q_UNLIKELY(value.isEmpty())) {
+        qCWarning(callbackManagerDC) << "Could not convert the payload of" << cacheMessage.target() << "to JSON";
+        return;
+    }
+
+    for (const HTTPTransportCallbackTrie::Subscription &subscription : subscriptions) {
+        subscription.host->triggerCallback(subscription.id, cacheMessage.target(), value, coalesce);
+    }
+}
+
+int HTTPTransportCallbackManager::subscriptionCount() const
+{
+    return m_subscriptions.count();
+}
+
+int HTTPTransportCallbackManager::hostCount() const
+{
+    return m_callbackHosts.count();
+}
+
+qint64 HTTPTransportCallbackManager::matchCount() const
+{
+    return m_matchCount;
+}
+
+qint64 HTTPTransportCallbackManager::matchNanoseconds() const
+{
+    return m_matchNanoseconds;
 }
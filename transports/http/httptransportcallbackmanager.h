@@ -1,10 +1,11 @@
 #ifndef HTTP_TRANSPORT_CALLBACK_MANAGER
 #define HTTP_TRANSPORT_CALLBACK_MANAGER
 
+#include "httptransportcallbacktrie.h"
+
 #include <HemeraCore/AsyncInitObject>
 
 #include <QtCore/QHash>
-#include <QtCore/QMultiMap>
 #include <QtCore/QTimer>
 
 namespace Hyperdrive {
@@ -29,16 +30,30 @@ public:
     bool unsubscribe(int id);
     void checkCallbacks(const Hyperdrive::CacheMessage &cacheMessage);
 
+    // Delivery tuning, applied to every callback host
+    void setFlushInterval(int flushInterval);
+    void setMaximumInFlight(int maximumInFlight);
+
     QByteArray hardwareId() const;
 
+    // Statistics
+    int subscriptionCount() const;
+    int hostCount() const;
+    qint64 matchCount() const;
+    qint64 matchNanoseconds() const;
+
 protected:
     virtual void initImpl() override final;
 
 private:
     int m_callbackIdCounter;
+    int m_flushInterval;
+    int m_maximumInFlight;
     QByteArray m_hardwareId;
 
-    QMultiMap< QByteArray, int > m_prefixToIds;
+    HTTPTransportCallbackTrie m_subscriptions;
+    qint64 m_matchCount;
+    qint64 m_matchNanoseconds;
     QHash< int, HTTPTransportCallback *> m_idToCallback;
 
     QHash< QString, HTTPTransportCallbackHost *> m_callbackHosts;
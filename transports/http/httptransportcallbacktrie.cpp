@@ -0,0 +1,88 @@
+#include "httptransportcallbacktrie.h"
+
+HTTPTransportCallbackTrie::HTTPTransportCallbackTrie()
+    : m_count(0)
+{
+    // The root, subscriptions here match everything
+    m_nodes.append(Node());
+}
+
+int HTTPTransportCallbackTrie::node(const QByteArray &prefix, bool create)
+{
+    int current = 0;
+    for (const QByteArray &segment : prefix.split('/')) {
+        // Leading, trailing and double slashes don't make a level
+        if (segment.isEmpty()) {
+            continue;
+        }
+
+        int next = m_nodes.at(current).children.value(segment, -1);
+        if (next < 0) {
+            if (!create) {
+                return -1;
+            }
+            next = m_nodes.size();
+            m_nodes.append(Node());
+            m_nodes[current].children.insert(segment, next);
+        }
+        current = next;
+    }
+
+    return current;
+}
+
+void HTTPTransportCallbackTrie::insert(const QByteArray &prefix, int id, HTTPTransportCallbackHost *host)
+{
+    m_nodes[node(prefix, true)].subscriptions.append(Subscription{id, host});
+    ++m_count;
+}
+
+bool HTTPTransportCallbackTrie::remove(const QByteArray &prefix, int id)
+{
+    int found = node(prefix, false);
+    if (found < 0) {
+        return false;
+    }
+
+    // Emptied nodes are kept: prefixes tend to be subscribed again
+    QList< Subscription > &subscriptions = m_nodes[found].subscriptions;
+    for (int i = 0; i < subscriptions.size(); ++i) {
+        if (subscriptions.at(i).id == id) {
+            subscriptions.removeAt(i);
+            --m_count;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void HTTPTransportCallbackTrie::match(const QByteArray &target, QList< Subscription > *subscriptions) const
+{
+    int current = 0;
+    subscriptions->append(m_nodes.at(current).subscriptions);
+
+    int start = 0;
+    while (start < target.size()) {
+        int end = target.indexOf('/', start);
+        if (end < 0) {
+            end = target.size();
+        }
+
+        if (end > start) {
+            // Look the segment up in place, no copies
+            current = m_nodes.at(current).children.value(QByteArray::fromRawData(target.constData() + start, end - start), -1);
+            if (current < 0) {
+                return;
+            }
+            subscriptions->append(m_nodes.at(current).subscriptions);
+        }
+
+        start = end + 1;
+    }
+}
+
+int HTTPTransportCallbackTrie::count() const
+{
+    return m_count;
+}
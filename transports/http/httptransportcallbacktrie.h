@@ -0,0 +1,42 @@
+#ifndef HTTP_TRANSPORT_CALLBACK_TRIE
+#define HTTP_TRANSPORT_CALLBACK_TRIE
+
+#include <QtCore/QByteArray>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QVector>
+
+class HTTPTransportCallbackHost;
+
+// Path segment trie of callback prefixes. Matching a target walks its segments once, and yields
+// the callbacks subscribed to any of its ancestors together with their hosts.
+class HTTPTransportCallbackTrie
+{
+public:
+    struct Subscription {
+        int id;
+        HTTPTransportCallbackHost *host;
+    };
+
+    HTTPTransportCallbackTrie();
+
+    void insert(const QByteArray &prefix, int id, HTTPTransportCallbackHost *host);
+    bool remove(const QByteArray &prefix, int id);
+
+    void match(const QByteArray &target, QList< Subscription > *subscriptions) const;
+
+    int count() const;
+
+private:
+    struct Node {
+        QHash< QByteArray, int > children;
+        QList< Subscription > subscriptions;
+    };
+
+    int node(const QByteArray &prefix, bool create);
+
+    QVector< Node > m_nodes;
+    int m_count;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include "httptransportwebsocket.h"
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QTextCodec>
+
+#include <limits.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+HTTPTransportWebSocket::HTTPTransportWebSocket(int maximumMessageSize)
+    : m_maximumMessageSize(qMax(0, maximumMessageSize))
+    , m_fragmentsOpcode(Opcode::Continuation)
+    , m_fragmented(false)
+    , m_closeCode(CloseCode::Normal)
+{
+}
+
+HTTPTransportWebSocket::~HTTPTransportWebSocket()
+{
+}
+
+QByteArray HTTPTransportWebSocket::acceptKey(const QByteArray &key)
+{
+    return QCryptographicHash::hash(key.trimmed() + WEBSOCKET_GUID, QCryptographicHash::Sha1).toBase64();
+}
+
+QByteArray HTTPTransportWebSocket::frame(Opcode opcode, const QByteArray &payload)
+{
+    QByteArray ret;
+    // Server frames are never fragmented nor masked
+    ret.append(static_cast<char>(0x80 | static_cast<quint8>(opcode)));
+
+    quint64 length = payload.size();
+    if (length < 126) {
+        ret.append(static_cast<char>(length));
+    } else if (length <= 0xFFFF) {
+        ret.append(static_cast<char>(126));
+        ret.append(static_cast<char>(length >> 8));
+        ret.append(static_cast<char>(length));
+    } else {
+        ret.append(static_cast<char>(127));
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            ret.append(static_cast<char>(length >> shift));
+        }
+    }
+
+    ret.append(payload);
+    return ret;
+}
+
+QByteArray HTTPTransportWebSocket::closeFrame(CloseCode code)
+{
+    QByteArray payload;
+    payload.append(static_cast<char>(static_cast<quint16>(code) >> 8));
+    payload.append(static_cast<char>(static_cast<quint16>(code)));
+    return frame(Opcode::Close, payload);
+}
+
+HTTPTransportWebSocket::CloseCode HTTPTransportWebSocket::closeCode() const
+{
+    return m_closeCode;
+}
+
+bool HTTPTransportWebSocket::isValidUtf8(const QByteArray &data)
+{
+    QTextCodec::ConverterState state;
+    QTextCodec::codecForMib(106)->toUnicode(data.constData(), data.size(), &state);
+    // A sequence cut at the end of the message is as wrong as a malformed one
+    return state.invalidChars == 0 && state.remainingChars == 0;
+}
+
+bool HTTPTransportWebSocket::feed(const QByteArray &data, QList< Message > *messages)
+{
+    m_buffer.append(data);
+
+    while (m_buffer.size() >= 2) {
+        const uchar *header = reinterpret_cast<const uchar*>(m_buffer.constData());
+        bool fin = header[0] & 0x80;
+        quint8 opcode = header[0] & 0x0F;
+        quint64 length = header[1] & 0x7F;
+        int headerSize = 2;
+
+        // No extensions are negotiated, and clients must mask
+        if ((header[0] & 0x70) || !(header[1] & 0x80)) {
+            m_closeCode = CloseCode::ProtocolError;
+            return false;
+        }
+
+        if (length == 126) {
+            if (m_buffer.size() < 4) {
+                break;
+            }
+            length = (static_cast<quint64>(header[2]) << 8) | header[3];
+            headerSize = 4;
+        } else if (length == 127) {
+            if (m_buffer.size() < 10) {
+                break;
+            }
+            // The most significant bit of a 64 bit length must be 0
+            if (header[2] & 0x80) {
+                m_closeCode = CloseCode::ProtocolError;
+                return false;
+            }
+            length = 0;
+            for (int i = 2; i < 10; ++i) {
+                length = (length << 8) | header[i];
+            }
+            headerSize = 10;
+        }
+
+        // Control frames are small, whatever the message size limit is
+        if ((opcode & 0x08) && length > 125) {
+            m_closeCode = CloseCode::ProtocolError;
+            return false;
+        }
+
+        // Lengths no QByteArray can hold are refused whatever the limit. The limit counts data frames only,
+        // so that a ping between fragments is never too big. From here on length fits an int.
+        if (length > INT_MAX - 14 ||
+            (!(opcode & 0x08) && length + m_fragments.size() > static_cast<quint64>(m_maximumMessageSize))) {
+            m_closeCode = CloseCode::MessageTooBig;
+            return false;
+        }
+
+        if (static_cast<quint64>(m_buffer.size()) < headerSize + 4 + length) {
+            break;
+        }
+
+        const uchar *mask = header + headerSize;
+        int frameSize = headerSize + 4 + static_cast<int>(length);
+        QByteArray payload = m_buffer.mid(headerSize + 4, static_cast<int>(length));
+        for (int i = 0; i < payload.size(); ++i) {
+            payload[i] = static_cast<char>(payload.at(i) ^ mask[i % 4]);
+        }
+        m_buffer.remove(0, frameSize);
+
+        switch (static_cast<Opcode>(opcode)) {
+            case Opcode::Close:
+            case Opcode::Ping:
+            case Opcode::Pong:
+                // Control frames can be interleaved with fragments, but can't be fragmented themselves
+                if (!fin) {
+                    m_closeCode = CloseCode::ProtocolError;
+                    return false;
+                }
+                messages->append(Message{static_cast<Opcode>(opcode), payload});
+                break;
+
+            case Opcode::Continuation:
+                if (!m_fragmented) {
+                    m_closeCode = CloseCode::ProtocolError;
+                    return false;
+                }
+                m_fragments.append(payload);
+                if (fin) {
+                    if (m_fragmentsOpcode == Opcode::Text && !isValidUtf8(m_fragments)) {
+                        m_closeCode = CloseCode::InvalidPayload;
+                        return false;
+                    }
+                    messages->append(Message{m_fragmentsOpcode, m_fragments});
+                    m_fragments.clear();
+                    m_fragmented = false;
+                }
+                break;
+
+            case Opcode::Text:
+            case Opcode::Binary:
+                if (m_fragmented) {
+                    m_closeCode = CloseCode::ProtocolError;
+                    return false;
+                }
+                if (fin) {
+                    if (static_cast<Opcode>(opcode) == Opcode::Text && !isValidUtf8(payload)) {
+                        m_closeCode = CloseCode::InvalidPayload;
+                        return false;
+                    }
+                    messages->append(Message{static_cast<Opcode>(opcode), payload});
+                } else {
+                    m_fragments = payload;
+                    m_fragmentsOpcode = static_cast<Opcode>(opcode);
+                    m_fragmented = true;
+                }
+                break;
+
+            default:
+                m_closeCode = CloseCode::ProtocolError;
+                return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef HTTP_TRANSPORT_WEBSOCKET
+#define HTTP_TRANSPORT_WEBSOCKET
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+
+// RFC 6455 framing for a connection upgraded by the HTTP transport
+class HTTPTransportWebSocket
+{
+public:
+    enum class Opcode : quint8 {
+        Continuation = 0x0,
+        Text = 0x1,
+        Binary = 0x2,
+        Close = 0x8,
+        Ping = 0x9,
+        Pong = 0xA
+    };
+
+    enum class CloseCode : quint16 {
+        Normal = 1000,
+        ProtocolError = 1002,
+        UnsupportedData = 1003,
+        InvalidPayload = 1007,
+        MessageTooBig = 1009
+    };
+
+    struct Message {
+        Opcode opcode;
+        QByteArray payload;
+    };
+
+    explicit HTTPTransportWebSocket(int maximumMessageSize);
+    ~HTTPTransportWebSocket();
+
+    static QByteArray acceptKey(const QByteArray &key);
+    static QByteArray frame(Opcode opcode, const QByteArray &payload);
+    static QByteArray closeFrame(CloseCode code);
+
+    // Appends incoming data and returns the complete messages. Control frames come as they arrive,
+    // fragmented messages once reassembled. Returns false, with closeCode set, if the peer misbehaves.
+    bool feed(const QByteArray &data, QList< Message > *messages);
+
+    CloseCode closeCode() const;
+
+private:
+    static bool isValidUtf8(const QByteArray &data);
+
+    int m_maximumMessageSize;
+    QByteArray m_buffer;
+    QByteArray m_fragments;
+    Opcode m_fragmentsOpcode;
+    bool m_fragmented;
+    CloseCode m_closeCode;
+};
+
+#endif
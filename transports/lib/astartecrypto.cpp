@@ -21,6 +21,7 @@
 
 // OpenSSL and its crap
 #include <openssl/bio.h>
+#include <openssl/ec.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
@@ -28,6 +29,11 @@
 #include <openssl/rsa.h>
 #include <openssl/ssl.h>
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
 Q_LOGGING_CATEGORY(astarteCryptoDC, "astarte.crypto", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
 namespace Astarte {
@@ -36,11 +42,47 @@ constexpr const char *pathToAstarteStoreDir() { return "/var/lib/astarte/crypto"
 constexpr const char *pathToAstartePrivateKey() { return "/var/lib/astarte/crypto/astartekey.pem"; }
 constexpr const char *pathToAstartePublicKey() { return "/var/lib/astarte/crypto/astartekey.pub"; }
 constexpr const char *pathToAstarteCSR() { return "/var/lib/astarte/crypto/astartekey.csr"; }
+// Keystore being paired, which replaces the current one only once it got a certificate
+constexpr const char *pathToAstartePendingPrivateKey() { return "/var/lib/astarte/crypto/astartekey.pem.new"; }
+constexpr const char *pathToAstartePendingPublicKey() { return "/var/lib/astarte/crypto/astartekey.pub.new"; }
+constexpr const char *pathToAstartePendingCSR() { return "/var/lib/astarte/crypto/astartekey.csr.new"; }
+// Keystore replaced by the last commit, kept until the pairing that replaced it is over
+constexpr const char *pathToAstartePreviousPrivateKey() { return "/var/lib/astarte/crypto/astartekey.pem.old"; }
+constexpr const char *pathToAstartePreviousPublicKey() { return "/var/lib/astarte/crypto/astartekey.pub.old"; }
+constexpr const char *pathToAstartePreviousCSR() { return "/var/lib/astarte/crypto/astartekey.csr.old"; }
+
+// Current, pending and previous path of each keystore file. The private key goes last, as it's what tells a keystore is there.
+struct KeyStoreFile {
+    const char *current;
+    const char *pending;
+    const char *previous;
+};
+static const KeyStoreFile s_keyStoreFiles[] = {
+    { pathToAstartePublicKey(), pathToAstartePendingPublicKey(), pathToAstartePreviousPublicKey() },
+    { pathToAstarteCSR(), pathToAstartePendingCSR(), pathToAstartePreviousCSR() },
+    { pathToAstartePrivateKey(), pathToAstartePendingPrivateKey(), pathToAstartePreviousPrivateKey() }
+};
+static const int s_keyStoreFilesCount = sizeof(s_keyStoreFiles) / sizeof(KeyStoreFile);
+
+// Puts back the files replaced so far, or removes them if there was none
+static void restoreKeyStoreFiles(int count)
+{
+    for (int i = count - 1; i >= 0; --i) {
+        if (::access(s_keyStoreFiles[i].previous, F_OK) == 0) {
+            if (::rename(s_keyStoreFiles[i].previous, s_keyStoreFiles[i].current) != 0) {
+                qCWarning(astarteCryptoDC) << "Could not restore" << s_keyStoreFiles[i].current << strerror(errno);
+            }
+        } else {
+            ::unlink(s_keyStoreFiles[i].current);
+        }
+    }
+}
 
 class CryptoPrivate : public Hemera::AsyncInitObjectPrivate
 {
 public:
-    CryptoPrivate(Crypto *q) : AsyncInitObjectPrivate(q), pkey(NULL), keystoreAvailable(false) { init_openssl(); }
+    CryptoPrivate(Crypto *q) : AsyncInitObjectPrivate(q), pkey(NULL), keystoreAvailable(false)
+                             , keyAlgorithm(Crypto::RSA2048KeyAlgorithm) { init_openssl(); }
     virtual ~CryptoPrivate() { cleanup_openssl(); }
 
     Q_DECLARE_PUBLIC(Crypto)
@@ -48,16 +90,18 @@ public:
     EVP_PKEY* pkey;
     QByteArray hardwareId;
     bool keystoreAvailable;
+    Crypto::KeyAlgorithm keyAlgorithm;
 
     // OpenSSL functions
     void init_openssl();
     void cleanup_openssl();
 
-    static EVP_PKEY* create_rsa_key(RSA *pRSA);
-    static int generateKeypair(const QString &privateKeyFile, const QString &publicKeyFile);
+    static EVP_PKEY* create_key(Crypto::KeyAlgorithm algorithm);
+    static int generateKeypair(Crypto::KeyAlgorithm algorithm, const QString &privateKeyFile, const QString &publicKeyFile);
     static bool generateCSR(const QString &cn, const QString &privateKeyFile, const QString &csrOutputFile);
-    static Hemera::Operation *generateKeypairThreaded(const QString &privateKeyFile, const QString &publicKeyFile);
-    Hemera::Operation *generateKeystoreThreaded();
+    static Hemera::Operation *generateKeypairThreaded(Crypto::KeyAlgorithm algorithm, const QString &privateKeyFile, const QString &publicKeyFile);
+    static Crypto::KeyAlgorithm algorithmOf(EVP_PKEY *key);
+    Hemera::Operation *generateKeystoreThreaded(bool pending = false);
 
     QByteArray signMessage(const QByteArray &message);
     int sign_it(const void* msg, size_t mlen, QByteArray *signature);
@@ -87,91 +131,63 @@ void CryptoPrivate::cleanup_openssl()
     EVP_cleanup();
 }
 
-Hemera::Operation* CryptoPrivate::generateKeypairThreaded(const QString& privateKeyFile, const QString& publicKeyFile)
+Hemera::Operation* CryptoPrivate::generateKeypairThreaded(Crypto::KeyAlgorithm algorithm, const QString& privateKeyFile, const QString& publicKeyFile)
 {
-    return new ThreadedKeyOperation(privateKeyFile, publicKeyFile);
+    return new ThreadedKeyOperation(algorithm, privateKeyFile, publicKeyFile);
 }
 
-Hemera::Operation* CryptoPrivate::generateKeystoreThreaded()
+Hemera::Operation* CryptoPrivate::generateKeystoreThreaded(bool pending)
 {
-    return new ThreadedKeyOperation(QLatin1String(hardwareId), QLatin1String(pathToAstartePrivateKey()),
+    if (pending) {
+        return new ThreadedKeyOperation(keyAlgorithm, QLatin1String(hardwareId), QLatin1String(pathToAstartePendingPrivateKey()),
+                                        QLatin1String(pathToAstartePendingPublicKey()), QLatin1String(pathToAstartePendingCSR()));
+    }
+
+    return new ThreadedKeyOperation(keyAlgorithm, QLatin1String(hardwareId), QLatin1String(pathToAstartePrivateKey()),
                                     QLatin1String(pathToAstartePublicKey()), QLatin1String(pathToAstarteCSR()));
 }
 
-int CryptoPrivate::generateKeypair(const QString &privateKeyFile, const QString &publicKeyFile)
+int CryptoPrivate::generateKeypair(Crypto::KeyAlgorithm algorithm, const QString &privateKeyFile, const QString &publicKeyFile)
 {
-    qCDebug(astarteCryptoDC) << "Generating RSA keypair!";
+    qCDebug(astarteCryptoDC) << "Generating keypair, algorithm" << algorithm;
 
     int iRet = EXIT_SUCCESS;
-    EVP_PKEY* pPrivKey = NULL;
-    EVP_PKEY* pPubKey  = NULL;
-    FILE*     pFile    = NULL;
-    RSA *pRSA          = RSA_new();
-
-    // Bignum for key generation
-    BIGNUM *e = NULL;
-    e = BN_new();
-    BN_set_word(e, 65537);
+    FILE *pFile = NULL;
 
     qCDebug(astarteCryptoDC) << "Starting generation";
-    if (RSA_generate_key_ex(pRSA, 2048, e, NULL) == 1) {
-        qCDebug(astarteCryptoDC) << "Done!";
-        pPrivKey = create_rsa_key(pRSA);
-        pPubKey  = create_rsa_key(pRSA);
-    } else {
+    EVP_PKEY *pKey = create_key(algorithm);
+    if (!pKey) {
         qCDebug(astarteCryptoDC) << "Key generation failed!";
+        return EXIT_FAILURE;
     }
+    qCDebug(astarteCryptoDC) << "Done!";
 
-    /* the big number is no longer used */
-    BN_free(e);
-    e = NULL;
-
-    if (pPrivKey && pPubKey) {
-        /* Save the keys */
-        if ((pFile = fopen(privateKeyFile.toStdString().c_str(),"wt"))) {
-            if(!PEM_write_PrivateKey(pFile,pPrivKey,NULL, NULL, 0, 0, NULL)) {
-                qCWarning(astarteCryptoDC) << "PEM_write_PrivateKey failed.";
+    /* Save the keys. The same EVP_PKEY holds both halves. */
+    if ((pFile = fopen(privateKeyFile.toStdString().c_str(),"wt"))) {
+        if(!PEM_write_PrivateKey(pFile,pKey,NULL, NULL, 0, 0, NULL)) {
+            qCWarning(astarteCryptoDC) << "PEM_write_PrivateKey failed.";
+            iRet = EXIT_FAILURE;
+        }
+        fclose(pFile);
+        pFile = NULL;
+        if(iRet == EXIT_SUCCESS) {
+            if((pFile = fopen(publicKeyFile.toStdString().c_str(),"wt")) && PEM_write_PUBKEY(pFile,pKey)) {
+                qCDebug(astarteCryptoDC) << "Both keys saved.";
+            } else {
                 iRet = EXIT_FAILURE;
             }
-            fclose(pFile);
-            pFile = NULL;
-            if(iRet == EXIT_SUCCESS) {
-                if((pFile = fopen(publicKeyFile.toStdString().c_str(),"wt")) && PEM_write_PUBKEY(pFile,pPubKey)) {
-                    qCDebug(astarteCryptoDC) << "Both keys saved.";
-                } else {
-                    iRet = EXIT_FAILURE;
-                }
-                if (pFile) {
-                    fclose(pFile);
-                    pFile = NULL;
-                }
-            }
-        } else {
-            qCWarning(astarteCryptoDC) << "Cannot create \"privkey.pem\".";
-            iRet = EXIT_FAILURE;
-            if(pFile)
-            {
+            if (pFile) {
                 fclose(pFile);
                 pFile = NULL;
             }
         }
+    } else {
+        qCWarning(astarteCryptoDC) << "Cannot create \"privkey.pem\".";
+        iRet = EXIT_FAILURE;
     }
 
-    qCDebug(astarteCryptoDC) << "Keys saved!";
-
-    qCDebug(astarteCryptoDC) << "Freeing private key";
-    if (pPrivKey) {
-        EVP_PKEY_free(pPrivKey);
-        pPrivKey = NULL;
-    }
-    qCDebug(astarteCryptoDC) << "Freeing public key";
-    if (pPubKey) {
-        // FIXME: This makes everything crash. It's likely freeing the private key causes the
-        //        public key to be freed as well, but it needs to be checked.
-        //EVP_PKEY_free(pPubKey);
-        pPubKey = NULL;
-    }
-    qCDebug(astarteCryptoDC) << "Freed!";
+    qCDebug(astarteCryptoDC) << "Freeing key";
+    EVP_PKEY_free(pKey);
 
     return iRet;
 }
@@ -247,8 +263,18 @@ bool CryptoPrivate::generateCSR(const QString &cn, const QString& privateKeyFile
         goto free_all;
     }
 
-    // 5. set sign key of x509 req
-    ret = X509_REQ_sign(x509_req, pKey, EVP_sha1());    // return x509_req->signature->length
+    // 5. set sign key of x509 req. Ed25519 signs the message as a whole and takes no digest.
+    switch (algorithmOf(pKey)) {
+        case Crypto::ECDSAP256KeyAlgorithm:
+            ret = X509_REQ_sign(x509_req, pKey, EVP_sha256());
+            break;
+        case Crypto::Ed25519KeyAlgorithm:
+            ret = X509_REQ_sign(x509_req, pKey, NULL);
+            break;
+        default:
+            ret = X509_REQ_sign(x509_req, pKey, EVP_sha1());    // return x509_req->signature->length
+            break;
+    }
     if (ret <= 0){
         qCWarning(astarteCryptoDC) << "Could not sign request!";
         goto free_all;
@@ -269,31 +295,96 @@ free_all:
 }
 
 
-EVP_PKEY* CryptoPrivate::create_rsa_key(RSA *pRSA)
+EVP_PKEY* CryptoPrivate::create_key(Crypto::KeyAlgorithm algorithm)
 {
-    EVP_PKEY* pKey = NULL;
-    pKey = EVP_PKEY_new();
-    if(pRSA && pKey && EVP_PKEY_assign_RSA(pKey,pRSA)) {
-        /* pKey owns pRSA from now */
-        if(RSA_check_key(pRSA) <= 0) {
-            qCWarning(astarteCryptoDC) << "RSA_check_key failed.";
-            EVP_PKEY_free(pKey);
-            pKey = NULL;
-        }
-    } else {
-        qCWarning(astarteCryptoDC) << "Something went wrong in RSA key creation.";
-        if(pRSA) {
-            RSA_free(pRSA);
-            pRSA = NULL;
-        }
-        if(pKey) {
-            EVP_PKEY_free(pKey);
-            pKey = NULL;
-        }
+    EVP_PKEY *pKey = NULL;
+    EVP_PKEY *params = NULL;
+    EVP_PKEY_CTX *paramsCtx = NULL;
+    EVP_PKEY_CTX *ctx = NULL;
+
+    switch (algorithm) {
+        case Crypto::RSA2048KeyAlgorithm:
+            ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+            if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0) {
+                goto err;
+            }
+            break;
+        case Crypto::ECDSAP256KeyAlgorithm:
+            // The curve can be set on a keygen context only since OpenSSL 1.1, generate the parameters first
+            paramsCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+            if (!paramsCtx || EVP_PKEY_paramgen_init(paramsCtx) <= 0 ||
+                EVP_PKEY_CTX_set_ec_paramgen_curve_nid(paramsCtx, NID_X9_62_prime256v1) <= 0 ||
+                EVP_PKEY_paramgen(paramsCtx, &params) <= 0) {
+                qCWarning(astarteCryptoDC) << "Could not generate the EC parameters.";
+                goto err;
+            }
+            ctx = EVP_PKEY_CTX_new(params, NULL);
+            if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0) {
+                goto err;
+            }
+            break;
+        case Crypto::Ed25519KeyAlgorithm:
+#ifdef EVP_PKEY_ED25519
+            ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL);
+            if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0) {
+                goto err;
+            }
+            break;
+#else
+            qCWarning(astarteCryptoDC) << "Ed25519 is not supported by this OpenSSL.";
+            goto err;
+#endif
+        default:
+            qCWarning(astarteCryptoDC) << "Unknown key algorithm" << algorithm;
+            goto err;
+    }
+
+    if (EVP_PKEY_keygen(ctx, &pKey) <= 0) {
+        qCWarning(astarteCryptoDC) << "EVP_PKEY_keygen failed.";
+        pKey = NULL;
+        goto err;
+    }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    // Older OpenSSL encodes the explicit curve parameters, which TLS peers won't accept
+    if (algorithm == Crypto::ECDSAP256KeyAlgorithm) {
+        EC_KEY_set_asn1_flag(pKey->pkey.ec, OPENSSL_EC_NAMED_CURVE);
+    }
+#endif
+
+err:
+    if (ctx) {
+        EVP_PKEY_CTX_free(ctx);
+    }
+    if (params) {
+        EVP_PKEY_free(params);
+    }
+    if (paramsCtx) {
+        EVP_PKEY_CTX_free(paramsCtx);
     }
     return pKey;
 }
 
+Crypto::KeyAlgorithm CryptoPrivate::algorithmOf(EVP_PKEY *key)
+{
+    if (!key) {
+        return Crypto::UnknownKeyAlgorithm;
+    }
+
+    switch (EVP_PKEY_base_id(key)) {
+        case EVP_PKEY_RSA:
+            return Crypto::RSA2048KeyAlgorithm;
+        case EVP_PKEY_EC:
+            return Crypto::ECDSAP256KeyAlgorithm;
+#ifdef EVP_PKEY_ED25519
+        case EVP_PKEY_ED25519:
+            return Crypto::Ed25519KeyAlgorithm;
+#endif
+        default:
+            return Crypto::UnknownKeyAlgorithm;
+    }
+}
+
 QByteArray CryptoPrivate::signMessage(const QByteArray& message)
 {
     QByteArray signature;
@@ -317,6 +408,20 @@ int CryptoPrivate::sign_it(const void* msg, size_t mlen, QByteArray *signature)
     /* Create the Message Digest Context */
     if(!(mdctx = EVP_MD_CTX_create())) goto err;
 
+#ifdef EVP_PKEY_ED25519
+    /* Ed25519 has no separate digest and can only sign in one shot */
+    if (EVP_PKEY_base_id(pkey) == EVP_PKEY_ED25519) {
+        if(1 != EVP_DigestSignInit(mdctx, NULL, NULL, NULL, pkey)) goto err;
+        if(1 != EVP_DigestSign(mdctx, NULL, &slen, reinterpret_cast<const uchar*>(msg), mlen)) goto err;
+        if (!(sig = (uchar*)OPENSSL_malloc(sizeof(unsigned char) * (slen)))) goto err;
+        if(1 != EVP_DigestSign(mdctx, sig, &slen, reinterpret_cast<const uchar*>(msg), mlen)) goto err;
+
+        *signature = QByteArray::fromRawData(reinterpret_cast<char*>(sig), slen).toBase64();
+        ret = 1;
+        goto err;
+    }
+#endif
+
     /* Initialise the DigestSign operation - SHA-256 has been selected as the message digest function in this example */
     if(1 != EVP_DigestSignInit(mdctx, NULL, EVP_sha256(), NULL, pkey)) goto err;
 
@@ -375,14 +480,15 @@ void CryptoPrivate::loadKeyStore()
     }
 }
 
-ThreadedKeyOperation::ThreadedKeyOperation(const QString &privateKeyFile, const QString &publicKeyFile, QObject* parent)
-    : ThreadedKeyOperation(QString(), privateKeyFile, publicKeyFile, QString(), parent)
+ThreadedKeyOperation::ThreadedKeyOperation(Crypto::KeyAlgorithm algorithm, const QString &privateKeyFile, const QString &publicKeyFile, QObject* parent)
+    : ThreadedKeyOperation(algorithm, QString(), privateKeyFile, publicKeyFile, QString(), parent)
 {
 }
 
-ThreadedKeyOperation::ThreadedKeyOperation(const QString &cn, const QString &privateKeyFile, const QString &publicKeyFile,
+ThreadedKeyOperation::ThreadedKeyOperation(Crypto::KeyAlgorithm algorithm, const QString &cn, const QString &privateKeyFile, const QString &publicKeyFile,
                                            const QString &csrFile, QObject* parent)
     : Hemera::Operation(parent)
+    , m_algorithm(algorithm)
     , m_cn(cn)
     , m_privateKeyFile(privateKeyFile)
     , m_publicKeyFile(publicKeyFile)
@@ -396,7 +502,7 @@ ThreadedKeyOperation::~ThreadedKeyOperation()
 
 void ThreadedKeyOperation::startImpl()
 {
-    QFuture<int> result = QtConcurrent::run(Astarte::CryptoPrivate::generateKeypair, m_privateKeyFile, m_publicKeyFile);
+    QFuture<int> result = QtConcurrent::run(Astarte::CryptoPrivate::generateKeypair, m_algorithm, m_privateKeyFile, m_publicKeyFile);
     QFutureWatcher<int> *watcher = new QFutureWatcher<int>(this);
     watcher->setFuture(result);
     connect(watcher, &QFutureWatcher<int>::finished, [this, watcher] {
@@ -526,7 +632,99 @@ Hemera::Operation* Crypto::generateAstarteKeyStore(bool forceGeneration)
         return new Hemera::FailureOperation(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()), tr("The keystore is already available!"));
     }
 
-    return d->generateKeystoreThreaded();
+    // Pick up the new key right away, so that signatures and keyStoreAlgorithm() reflect it
+    Hemera::Operation *op = d->generateKeystoreThreaded();
+    connect(op, &Hemera::Operation::finished, this, [d, op] {
+        if (!op->isError()) {
+            d->loadKeyStore();
+        }
+    });
+    return op;
+}
+
+Hemera::Operation* Crypto::generatePendingKeyStore()
+{
+    Q_D(Crypto);
+    return d->generateKeystoreThreaded(true);
+}
+
+bool Crypto::commitPendingKeyStore()
+{
+    Q_D(Crypto);
+
+    // The current files stay where they are, hard linked aside, until all of them have been replaced
+    for (int i = 0; i < s_keyStoreFilesCount; ++i) {
+        ::unlink(s_keyStoreFiles[i].previous);
+        if (::link(s_keyStoreFiles[i].current, s_keyStoreFiles[i].previous) != 0 && errno != ENOENT) {
+            qCWarning(astarteCryptoDC) << "Could not keep the current keystore aside!" << strerror(errno);
+            discardPreviousKeyStore();
+            return false;
+        }
+    }
+
+    // rename() replaces each file atomically, a failure puts back the ones replaced so far
+    for (int i = 0; i < s_keyStoreFilesCount; ++i) {
+        if (::rename(s_keyStoreFiles[i].pending, s_keyStoreFiles[i].current) != 0) {
+            qCWarning(astarteCryptoDC) << "Could not replace the keystore!" << strerror(errno);
+            restoreKeyStoreFiles(i);
+            discardPreviousKeyStore();
+            return false;
+        }
+    }
+
+    d->loadKeyStore();
+    return true;
+}
+
+void Crypto::restorePreviousKeyStore()
+{
+    Q_D(Crypto);
+
+    restoreKeyStoreFiles(s_keyStoreFilesCount);
+    d->loadKeyStore();
+}
+
+void Crypto::discardPreviousKeyStore()
+{
+    for (int i = 0; i < s_keyStoreFilesCount; ++i) {
+        ::unlink(s_keyStoreFiles[i].previous);
+    }
+}
+
+Crypto::KeyAlgorithm Crypto::keyAlgorithmFromString(const QString &algorithm)
+{
+    QString a = algorithm.trimmed().toLower();
+    if (a == QStringLiteral("rsa") || a == QStringLiteral("rsa2048")) {
+        return RSA2048KeyAlgorithm;
+    } else if (a == QStringLiteral("ecdsa") || a == QStringLiteral("ecdsa-p256") || a == QStringLiteral("p256")) {
+        return ECDSAP256KeyAlgorithm;
+    } else if (a == QStringLiteral("ed25519")) {
+        return Ed25519KeyAlgorithm;
+    }
+
+    return UnknownKeyAlgorithm;
+}
+
+void Crypto::setKeyAlgorithm(Crypto::KeyAlgorithm algorithm)
+{
+    Q_D(Crypto);
+    if (algorithm == UnknownKeyAlgorithm) {
+        qCWarning(astarteCryptoDC) << "Ignoring unknown key algorithm";
+        return;
+    }
+    d->keyAlgorithm = algorithm;
+}
+
+Crypto::KeyAlgorithm Crypto::keyAlgorithm() const
+{
+    Q_D(const Crypto);
+    return d->keyAlgorithm;
+}
+
+Crypto::KeyAlgorithm Crypto::keyStoreAlgorithm() const
+{
+    Q_D(const Crypto);
+    return d->keystoreAvailable ? CryptoPrivate::algorithmOf(d->pkey) : UnknownKeyAlgorithm;
 }
 
 QString Crypto::pathToCertificateRequest()
@@ -534,6 +732,11 @@ QString Crypto::pathToCertificateRequest()
     return QLatin1String(pathToAstarteCSR());
 }
 
+QString Crypto::pathToPendingCertificateRequest()
+{
+    return QLatin1String(pathToAstartePendingCSR());
+}
+
 QString Crypto::pathToPrivateKey()
 {
     return QLatin1String(pathToAstartePrivateKey());
@@ -25,16 +25,41 @@ public:
     Q_ENUMS(AuthenticationDomain)
     Q_DECLARE_FLAGS(AuthenticationDomains, AuthenticationDomain)
 
+    enum KeyAlgorithm {
+        UnknownKeyAlgorithm = 0,
+        RSA2048KeyAlgorithm = 1,
+        ECDSAP256KeyAlgorithm = 2,
+        /// Requires OpenSSL >= 1.1.1
+        Ed25519KeyAlgorithm = 3
+    };
+    Q_ENUMS(KeyAlgorithm)
+
+    static KeyAlgorithm keyAlgorithmFromString(const QString &algorithm);
+
     static Crypto * instance();
 
     virtual ~Crypto();
 
     bool isKeyStoreAvailable() const;
     Hemera::Operation *generateAstarteKeyStore(bool forceGeneration = false);
+    /// Generates a keystore aside, while the current one stays in use until commitPendingKeyStore().
+    Hemera::Operation *generatePendingKeyStore();
+    /// Replaces the current keystore with the pending one. The replaced files are kept until discardPreviousKeyStore()
+    /// or restorePreviousKeyStore(), nothing changes if it fails.
+    bool commitPendingKeyStore();
+    void restorePreviousKeyStore();
+    void discardPreviousKeyStore();
+
+    /// Algorithm used for keystores generated from now on. Defaults to RSA2048KeyAlgorithm.
+    void setKeyAlgorithm(KeyAlgorithm algorithm);
+    KeyAlgorithm keyAlgorithm() const;
+    /// Algorithm of the key currently in the keystore
+    KeyAlgorithm keyStoreAlgorithm() const;
 
     QByteArray sign(const QByteArray &payload, AuthenticationDomains = AnyAuthenticationDomain);
 
     static QString pathToCertificateRequest();
+    static QString pathToPendingCertificateRequest();
     static QString pathToPrivateKey();
     static QString pathToPublicKey();
 
@@ -14,14 +14,16 @@ class ThreadedKeyOperation : public Hemera::Operation
     Q_DISABLE_COPY(ThreadedKeyOperation)
 
 public:
-    explicit ThreadedKeyOperation(const QString &privateKeyFile, const QString &publicKeyFile, QObject* parent = nullptr);
-    explicit ThreadedKeyOperation(const QString &cn, const QString &privateKeyFile, const QString &publicKeyFile, const QString &csrFile, QObject* parent = nullptr);
+    explicit ThreadedKeyOperation(Crypto::KeyAlgorithm algorithm, const QString &privateKeyFile, const QString &publicKeyFile, QObject* parent = nullptr);
+    explicit ThreadedKeyOperation(Crypto::KeyAlgorithm algorithm, const QString &cn, const QString &privateKeyFile, const QString &publicKeyFile,
+                                  const QString &csrFile, QObject* parent = nullptr);
     virtual ~ThreadedKeyOperation();
 
 protected:
     virtual void startImpl() override final;
 
 private:
+    Crypto::KeyAlgorithm m_algorithm;
     QString m_cn;
     QString m_privateKeyFile;
     QString m_publicKeyFile;
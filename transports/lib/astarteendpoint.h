@@ -39,6 +39,10 @@ public:
     virtual QNetworkReply *sendRequest(const QString &relativeEndpoint, const QByteArray &payload,
                                        Crypto::AuthenticationDomain authenticationDomain = Crypto::DeviceAuthenticationDomain) = 0;
 
+Q_SIGNALS:
+    /// Emitted when the broker changes after the endpoint became ready, e.g. when cached information turned out stale.
+    void mqttBrokerUrlChanged(const QUrl &url);
+
 protected:
     explicit Endpoint(EndpointPrivate &dd, const QUrl &endpoint, QObject *parent = nullptr);
 };
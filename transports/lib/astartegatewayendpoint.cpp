@@ -8,12 +8,15 @@
 #include <QtCore/QDebug>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonDocument>
 #include <QtCore/QJsonObject>
 #include <QtCore/QSettings>
 #include <QtCore/QTimer>
 
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QHostInfo>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkReply>
 #include <QtNetwork/QNetworkRequest>
@@ -30,6 +33,8 @@ namespace Astarte {
  *
  * The local gateway implementation is currently extremely simple and does not involve a compatibility
  * endpoint. As such, we just return the MQTT broker without further ado, and that's about it.
+ * The connection is neither encrypted nor authenticated, so no keystore is involved, and the keyAlgorithm
+ * setting is ignored: it applies to the keystore HTTPEndpoint pairs with, the gateway's own included.
  */
 
 GatewayEndpoint::GatewayEndpoint(const QUrl& endpoint, QObject* parent)
@@ -37,22 +42,56 @@ GatewayEndpoint::GatewayEndpoint(const QUrl& endpoint, QObject* parent)
 {
     Q_D(GatewayEndpoint);
 
-    // Create the MQTT broker address out of the host. Port is always 1883 unless local (1885), no encryption.
+    // Create the MQTT broker address out of the host. Port is always 1885, no encryption.
+    // If the gateway runs on our board, initImpl might switch to its unix socket.
     d->mqttBroker.setScheme(QStringLiteral("tcp"));
     d->mqttBroker.setHost(endpoint.host().isEmpty() ? endpoint.toString() : endpoint.host());
-    // FIXME: We should determine whether our board is running the gateway and decide on the port there.
     d->mqttBroker.setPort(1885);
-
-    qCInfo(astarteGatewayEndpointDC) << "Setting up a gateway connection to" << d->mqttBroker;
 }
 
 GatewayEndpoint::~GatewayEndpoint()
 {
 }
 
+bool GatewayEndpointPrivate::isLocalHost(const QString &host) const
+{
+    if (host == QStringLiteral("localhost") || host == QHostInfo::localHostName()) {
+        return true;
+    }
+
+    return QHostAddress(host).isLoopback();
+}
+
+void GatewayEndpoint::setLocalSocketPath(const QString &path, bool alwaysUse)
+{
+    Q_D(GatewayEndpoint);
+    d->localSocketPath = path;
+    d->localSocketForced = alwaysUse;
+}
+
 void GatewayEndpoint::initImpl()
 {
-    // Nothing to do.
+    Q_D(GatewayEndpoint);
+
+#ifdef HAVE_MOSQUITTO_UNIX_SOCKETS
+    // Devices on the gateway board skip the loopback TCP stack entirely
+    if (!d->localSocketPath.isEmpty() && (d->localSocketForced || d->isLocalHost(d->mqttBroker.host()))) {
+        if (QFileInfo(d->localSocketPath).exists()) {
+            d->mqttBroker = QUrl();
+            d->mqttBroker.setScheme(QStringLiteral("unix"));
+            d->mqttBroker.setPath(d->localSocketPath);
+        } else if (d->localSocketForced) {
+            qCWarning(astarteGatewayEndpointDC) << "Gateway socket" << d->localSocketPath << "does not exist, falling back to TCP";
+        }
+    }
+#else
+    if (d->localSocketForced && !d->localSocketPath.isEmpty()) {
+        qCWarning(astarteGatewayEndpointDC) << "This libmosquitto cannot connect to unix sockets, falling back to TCP";
+    }
+#endif
+
+    qCInfo(astarteGatewayEndpointDC) << "Setting up a gateway connection to" << d->mqttBroker;
+
     setReady();
 }
 
@@ -30,6 +30,11 @@ public:
     virtual QString endpointVersion() const override final;
     virtual QUrl mqttBrokerUrl() const override final;
 
+    /// Unix socket of the local gateway broker, used instead of TCP. It is used if it exists and either the gateway host
+    /// is this board or alwaysUse is set. An empty path disables it. By default, the system gateway's socket is detected.
+    /// Note: this will only work if set before initializing the Endpoint, and needs libmosquitto >= 2.0.
+    void setLocalSocketPath(const QString &path, bool alwaysUse = true);
+
     virtual Hyperdrive::MQTTClientWrapper *createMqttClientWrapper() override final;
 
     virtual bool isPaired() const override final;
@@ -5,6 +5,8 @@
 
 #include <HemeraCore/Operation>
 
+#include <hyperdriveconfig.h>
+
 #include "astarteendpoint_p.h"
 
 class QNetworkAccessManager;
@@ -14,11 +16,17 @@ namespace Astarte {
 class GatewayEndpointPrivate : public EndpointPrivate {
 
 public:
-    GatewayEndpointPrivate(GatewayEndpoint *q) : EndpointPrivate(q) {}
+    GatewayEndpointPrivate(GatewayEndpoint *q) : EndpointPrivate(q)
+                                               , localSocketPath(QLatin1String(Hyperdrive::StaticConfig::astarteGatewaySocketPath()))
+                                               , localSocketForced(false) {}
 
     Q_DECLARE_PUBLIC(GatewayEndpoint)
 
     QUrl mqttBroker;
+    QString localSocketPath;
+    bool localSocketForced;
+
+    bool isLocalHost(const QString &host) const;
 };
 
 }
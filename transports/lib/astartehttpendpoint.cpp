@@ -5,10 +5,12 @@
 #include "astarteverifycertificateoperation.h"
 #include "hyperdrivemqttclientwrapper.h"
 
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
 #include <QtCore/QDebug>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QFile>
+#include <QtCore/QSaveFile>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonDocument>
 #include <QtCore/QJsonObject>
@@ -43,6 +45,7 @@ QString pathToAstarteEndpointConfiguration(const QString &endpointName)
 PairOperation::PairOperation(HTTPEndpoint *parent)
     : Hemera::Operation(parent)
     , m_endpoint(parent)
+    , m_pendingKeyStore(false)
 {
 }
 
@@ -52,10 +55,14 @@ PairOperation::~PairOperation()
 
 void PairOperation::startImpl()
 {
-    // Before anything else, we need to check if we have an available keystore.
-    if (!Crypto::instance()->isKeyStoreAvailable()) {
-        // Let's build one.
-        Hemera::Operation *op = Crypto::instance()->generateAstarteKeyStore();
+    // Before anything else, we need to check if we have an available keystore, of the configured kind:
+    // a new pairing is the right moment for switching algorithm.
+    bool keyStoreAvailable = Crypto::instance()->isKeyStoreAvailable();
+    if (!keyStoreAvailable || Crypto::instance()->keyStoreAlgorithm() != Crypto::instance()->keyAlgorithm()) {
+        // Let's build one. A keystore in use might back a live session: the new one takes its place only once paired.
+        m_pendingKeyStore = keyStoreAvailable;
+        Hemera::Operation *op = m_pendingKeyStore ? Crypto::instance()->generatePendingKeyStore()
+                                                  : Crypto::instance()->generateAstarteKeyStore();
         connect(op, &Hemera::Operation::finished, this, [this, op] {
             if (op->isError()) {
                 // That's ugly.
@@ -150,7 +157,7 @@ void PairOperation::performFakeAgentPairing()
 
 void PairOperation::performPairing()
 {
-    QFile csr(Crypto::instance()->pathToCertificateRequest());
+    QFile csr(m_pendingKeyStore ? Crypto::pathToPendingCertificateRequest() : Crypto::pathToCertificateRequest());
     if (!csr.open(QIODevice::ReadOnly)) {
         qCWarning(astarteHttpEndpointDC) << "Could not open CSR for reading! Aborting.";
         setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::notFound()), QStringLiteral("Could not open CSR for reading! Aborting."));
@@ -187,17 +194,33 @@ void PairOperation::performPairing()
             return;
         }
 
-        // Ok, we need to write the files now.
+        // Ok, we need to write the files now. A session might be using them: they get replaced in one go, and only when complete.
         {
-            QFile generatedCertificate(QStringLiteral("%1/mqtt_broker.crt").arg(pathToAstarteEndpointConfiguration(m_endpoint->d_func()->endpointName)));
-            if (!generatedCertificate.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            QSaveFile generatedCertificate(QStringLiteral("%1/mqtt_broker.crt").arg(pathToAstarteEndpointConfiguration(m_endpoint->d_func()->endpointName)));
+            if (!generatedCertificate.open(QIODevice::WriteOnly)) {
                 qCWarning(astarteHttpEndpointDC) << "Could not write certificate!";
                 setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()), generatedCertificate.errorString());
                 return;
             }
             generatedCertificate.write(pairData.value(QStringLiteral("clientCrt")).toVariant().toByteArray());
-            generatedCertificate.flush();
-            generatedCertificate.close();
+
+            // Key and certificate must match: the old keystore comes back if the certificate can't be written
+            if (m_pendingKeyStore && !Crypto::instance()->commitPendingKeyStore()) {
+                generatedCertificate.cancelWriting();
+                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), QStringLiteral("Could not replace the keystore!"));
+                return;
+            }
+            if (!generatedCertificate.commit()) {
+                qCWarning(astarteHttpEndpointDC) << "Could not write certificate!";
+                if (m_pendingKeyStore) {
+                    Crypto::instance()->restorePreviousKeyStore();
+                }
+                setFinishedWithError(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()), generatedCertificate.errorString());
+                return;
+            }
+            if (m_pendingKeyStore) {
+                Crypto::instance()->discardPreviousKeyStore();
+            }
         }
         {
             QSettings settings(QStringLiteral("%1/mqtt_broker.conf").arg(pathToAstarteEndpointConfiguration(m_endpoint->d_func()->endpointName)),
@@ -246,41 +269,91 @@ void HTTPEndpointPrivate::connectToEndpoint()
         qCDebug(astarteHttpEndpointDC) << "Connected! " << doc.toJson(QJsonDocument::Indented);
 
         QJsonObject rootReplyObj = doc.object();
+        QUrl previousBroker = mqttBroker;
         endpointVersion = rootReplyObj.value(QStringLiteral("version")).toString();
-
-        // Get configuration
-        QSettings settings(QStringLiteral("%1/mqtt_broker.conf").arg(pathToAstarteEndpointConfiguration(endpointName)),
-                           QSettings::IniFormat);
         mqttBroker = QUrl::fromUserInput(rootReplyObj.value(QStringLiteral("url")).toString());
 
-        // Initialize cryptography
-        auto processCryptoStatus = [this, q] (bool ready) {
-            if (!ready) {
-                qCWarning(astarteHttpEndpointDC) << "Could not initialize signature system!!";
-                if (!q->isReady()) {
-                    q->setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                                    HTTPEndpoint::tr("Could not initialize signature system!"));
-                }
-                return;
+        storeCachedInfo();
+
+        if (q->isReady()) {
+            // We started from the cache: only bother our users if it was outdated
+            if (mqttBroker != previousBroker) {
+                qCInfo(astarteHttpEndpointDC) << "Broker changed from" << previousBroker << "to" << mqttBroker;
+                Q_EMIT q->mqttBrokerUrlChanged(mqttBroker);
             }
+            return;
+        }
+
+        initializeCrypto();
+    });
+}
+
+bool HTTPEndpointPrivate::loadCachedInfo()
+{
+    QSettings settings(QStringLiteral("%1/mqtt_broker.conf").arg(pathToAstarteEndpointConfiguration(endpointName)),
+                       QSettings::IniFormat);
+    settings.beginGroup(QStringLiteral("EndpointInfo"));
 
-            qCInfo(astarteHttpEndpointDC) << "Signature system initialized correctly!";
+    QDateTime fetchedAt = settings.value(QStringLiteral("fetchedAt")).toDateTime();
+    QUrl cachedBroker = settings.value(QStringLiteral("url")).toUrl();
+    qint64 age = fetchedAt.secsTo(QDateTime::currentDateTimeUtc());
 
+    // Don't trust info about another endpoint, from the future (clock jumps) or too old
+    if (settings.value(QStringLiteral("endpoint")).toUrl() != endpoint || !fetchedAt.isValid() || age < 0 || age > infoTtl) {
+        return false;
+    }
+    if (!cachedBroker.isValid() || cachedBroker.host().isEmpty()) {
+        return false;
+    }
+
+    mqttBroker = cachedBroker;
+    endpointVersion = settings.value(QStringLiteral("version")).toString();
+    qCInfo(astarteHttpEndpointDC) << "Using cached endpoint info," << age << "seconds old. Broker:" << mqttBroker;
+    return true;
+}
+
+void HTTPEndpointPrivate::storeCachedInfo()
+{
+    QSettings settings(QStringLiteral("%1/mqtt_broker.conf").arg(pathToAstarteEndpointConfiguration(endpointName)),
+                       QSettings::IniFormat);
+    settings.beginGroup(QStringLiteral("EndpointInfo"));
+    settings.setValue(QStringLiteral("endpoint"), endpoint);
+    settings.setValue(QStringLiteral("url"), mqttBroker);
+    settings.setValue(QStringLiteral("version"), endpointVersion);
+    settings.setValue(QStringLiteral("fetchedAt"), QDateTime::currentDateTimeUtc());
+}
+
+void HTTPEndpointPrivate::initializeCrypto()
+{
+    Q_Q(HTTPEndpoint);
+
+    // Initialize cryptography
+    auto processCryptoStatus = [this, q] (bool ready) {
+        if (!ready) {
+            qCWarning(astarteHttpEndpointDC) << "Could not initialize signature system!!";
             if (!q->isReady()) {
-                q->setReady();
+                q->setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                                HTTPEndpoint::tr("Could not initialize signature system!"));
             }
-        };
+            return;
+        }
 
-        if (Crypto::instance()->isReady()) {
-            processCryptoStatus(true);
-        } else if (Crypto::instance()->hasInitError()) {
-            processCryptoStatus(false);
-        } else {
-            QObject::connect(Crypto::instance()->init(), &Hemera::Operation::finished, q, [this, q, processCryptoStatus] (Hemera::Operation *op) {
-                processCryptoStatus(!op->isError());
-            });
+        qCInfo(astarteHttpEndpointDC) << "Signature system initialized correctly!";
+
+        if (!q->isReady()) {
+            q->setReady();
         }
-    });
+    };
+
+    if (Crypto::instance()->isReady()) {
+        processCryptoStatus(true);
+    } else if (Crypto::instance()->hasInitError()) {
+        processCryptoStatus(false);
+    } else {
+        QObject::connect(Crypto::instance()->init(), &Hemera::Operation::finished, q, [this, q, processCryptoStatus] (Hemera::Operation *op) {
+            processCryptoStatus(!op->isError());
+        });
+    }
 }
 
 
@@ -316,6 +389,10 @@ void HTTPEndpoint::initImpl()
             d->agentKey = settings.value(QStringLiteral("agentKey")).toString().toLatin1();
             d->brokerCa = settings.value(QStringLiteral("brokerCa"), QStringLiteral("/etc/ssl/certs/ca-bundle.trust.crt")).toString();
             d->ignoreSslErrors = settings.value(QStringLiteral("ignoreSslErrors"), false).toBool();
+            d->infoTtl = settings.value(QStringLiteral("endpointInfoTtl"), DEFAULT_ENDPOINT_INFO_TTL).toLongLong();
+            if (settings.contains(QStringLiteral("keyAlgorithm"))) {
+                Crypto::instance()->setKeyAlgorithm(Crypto::keyAlgorithmFromString(settings.value(QStringLiteral("keyAlgorithm")).toString()));
+            }
             if (settings.contains(QStringLiteral("pairingCa"))) {
                d->sslConfiguration.setCaCertificates(QSslCertificate::fromPath(settings.value(QStringLiteral("pairingCa")).toString()));
             }
@@ -341,6 +418,11 @@ void HTTPEndpoint::initImpl()
                 }
             }
 
+            // Start right away from the cached info if we can, and refresh it in the background
+            if (d->loadCachedInfo()) {
+                d->initializeCrypto();
+            }
+
             // Let's connect to our endpoint, shall we?
             d->connectToEndpoint();
         }
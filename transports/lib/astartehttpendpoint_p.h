@@ -9,12 +9,14 @@
 
 class QNetworkAccessManager;
 
+#define DEFAULT_ENDPOINT_INFO_TTL (7 * 24 * 60 * 60)
+
 namespace Astarte {
 
 class HTTPEndpointPrivate : public EndpointPrivate {
 
 public:
-    HTTPEndpointPrivate(HTTPEndpoint *q) : EndpointPrivate(q) {}
+    HTTPEndpointPrivate(HTTPEndpoint *q) : EndpointPrivate(q), infoTtl(DEFAULT_ENDPOINT_INFO_TTL) {}
 
     Q_DECLARE_PUBLIC(HTTPEndpoint)
 
@@ -30,7 +32,13 @@ public:
 
     QSslConfiguration sslConfiguration;
 
+    // Seconds the endpoint info stays usable without talking to the endpoint
+    qint64 infoTtl;
+
     void connectToEndpoint();
+    void initializeCrypto();
+    bool loadCachedInfo();
+    void storeCachedInfo();
 };
 
 class PairOperation : public Hemera::Operation
@@ -52,6 +60,8 @@ private Q_SLOTS:
 
 private:
     HTTPEndpoint *m_endpoint;
+    // A new keystore is waiting aside for its certificate, the current one stays in use meanwhile
+    bool m_pendingKeyStore;
 };
 
 }
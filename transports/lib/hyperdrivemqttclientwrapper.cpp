@@ -5,9 +5,11 @@
 
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
+#include <QtCore/QFile>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QTimer>
 #include <QtCore/QMetaMethod>
+#include <QtCore/QVector>
 
 #include <QtNetwork/QSslCertificate>
 
@@ -15,15 +17,24 @@
 #include <HemeraCore/Fingerprints>
 #include <HemeraCore/Literals>
 
-// We use the as variant
-#include <mosquittopp.h>
+#include <mosquitto.h>
 
 #define CONNACK_TIMEOUT (2 * 60 * 1000)
+// Keep SUBSCRIBE/UNSUBSCRIBE packets reasonably sized
+#define MAX_TOPICS_PER_PACKET 64
+// Event loop mode: how often keepalives are checked, and how long to wait before reconnecting
+#define MISC_INTERVAL 1000
+#define RECONNECT_INTERVAL (5 * 1000)
+// MQTT 5 sessions are dropped on disconnection unless they ask otherwise. This one never expires, as in 3.1.1.
+#define PERSISTENT_SESSION_EXPIRY_INTERVAL 0xFFFFFFFF
 
 Q_LOGGING_CATEGORY(mqttWrapperDC, "hyperdrive.mqttclientwrapper", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
 namespace Hyperdrive {
 
+// libmosquitto's init and cleanup are process wide, while several clients can be alive at once
+static QAtomicInt s_mosquittoLibReferences;
+
 void MQTTClientWrapperPrivate::setStatus(MQTTClientWrapper::Status s)
 {
     if (status != s) {
@@ -33,7 +44,73 @@ void MQTTClientWrapperPrivate::setStatus(MQTTClientWrapper::Status s)
     }
 }
 
-void MQTTClientWrapperPrivate::on_connect(int rc)
+void TopicAliasTable::reset(int maximum)
+{
+    QMutexLocker locker(&m_mutex);
+    m_entries.clear();
+    m_freeAliases.clear();
+    m_maximum = maximum;
+    m_nextAlias = 1;
+    m_clock = 0;
+}
+
+int TopicAliasTable::maximum() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_maximum;
+}
+
+quint16 TopicAliasTable::alias(const QByteArray &topic, bool *known)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_maximum <= 0) {
+        *known = false;
+        return 0;
+    }
+
+    QHash< QByteArray, Entry >::iterator it = m_entries.find(topic);
+    if (it != m_entries.end()) {
+        it.value().lastUse = ++m_clock;
+        *known = true;
+        return it.value().alias;
+    }
+
+    *known = false;
+    Entry entry;
+    entry.lastUse = ++m_clock;
+
+    if (!m_freeAliases.isEmpty()) {
+        entry.alias = m_freeAliases.takeLast();
+    } else if (m_nextAlias <= m_maximum) {
+        entry.alias = m_nextAlias++;
+    } else {
+        // Rebind the least recently used alias. The table is small, a linear scan is cheaper than keeping a list.
+        QHash< QByteArray, Entry >::iterator lru = m_entries.begin();
+        for (QHash< QByteArray, Entry >::iterator i = m_entries.begin(); i != m_entries.end(); ++i) {
+            if (i.value().lastUse < lru.value().lastUse) {
+                lru = i;
+            }
+        }
+        entry.alias = lru.value().alias;
+        m_entries.erase(lru);
+    }
+
+    m_entries.insert(topic, entry);
+    return entry.alias;
+}
+
+void TopicAliasTable::forget(const QByteArray &topic)
+{
+    QMutexLocker locker(&m_mutex);
+    QHash< QByteArray, Entry >::iterator it = m_entries.find(topic);
+    if (it != m_entries.end()) {
+        m_freeAliases.append(it.value().alias);
+        m_entries.erase(it);
+    }
+}
+
+void MQTTClientWrapperPrivate::on_connect(int rc, int flags, const mosquitto_property *properties)
 {
     qCInfo(mqttWrapperDC) << "Connected to broker returned!";
 
@@ -43,28 +120,165 @@ void MQTTClientWrapperPrivate::on_connect(int rc)
     Q_EMIT q->connackReceived();
 
     if (rc == MOSQ_ERR_SUCCESS) {
-        sessionPresent = mosquitto->is_session_present_on_connect();
+        // Bit 0 of the CONNACK flags is "session present"
+        sessionPresent = flags & 0x01;
+
+        if (protocolVersion == MQTTClientWrapper::MQTT5ProtocolVersion) {
+            // An absent topic alias maximum means no aliases, an absent receive maximum means 65535
+            uint16_t brokerAliasMaximum = 0;
+            uint16_t brokerReceiveMaximum = 65535;
+            mosquitto_property_read_int16(properties, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &brokerAliasMaximum, false);
+            mosquitto_property_read_int16(properties, MQTT_PROP_RECEIVE_MAXIMUM, &brokerReceiveMaximum, false);
+
+            topicAliases.reset(qMin(static_cast<int>(brokerAliasMaximum), topicAliasMaximum));
+            receiveMaximum.store(brokerReceiveMaximum);
+            qCInfo(mqttWrapperDC) << "MQTT 5 session, topic aliases:" << topicAliases.maximum() << "receive maximum:" << brokerReceiveMaximum;
+        }
+
         qCInfo(mqttWrapperDC) << "Connected to broker, session present: " << sessionPresent;
         setStatus(MQTTClientWrapper::ConnectedStatus);
+    } else if (protocolVersion == MQTTClientWrapper::MQTT5ProtocolVersion &&
+               (rc == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION || rc == CONNACK_REFUSED_PROTOCOL_VERSION)) {
+        qCInfo(mqttWrapperDC) << "Broker does not support MQTT 5, falling back to 3.1.1";
+        protocolVersion = MQTTClientWrapper::MQTT311ProtocolVersion;
+        mosquitto->set_protocol_version(MQTT_PROTOCOL_V311);
+
+        // In event loop mode the failed read takes care of reconnecting, but libmosquitto's thread gives up on
+        // protocol errors and has to be restarted from ours.
+        if (loopMode == MQTTClientWrapper::ThreadedLoopMode) {
+            QMetaObject::invokeMethod(q, "restartThreadedLoop", Qt::QueuedConnection);
+        }
     } else {
         qCInfo(mqttWrapperDC) << "Could not connected to broker!" << rc;
     }
 }
 
+void MQTTClientWrapperPrivate::restartThreadedLoop()
+{
+    // The thread is on its way out, but it might still be waiting on the socket: don't wait for it
+    mosquitto->loop_stop(true);
+
+    int rc;
+    if ((rc = mosquitto_reconnect_async(mosquitto->handle())) != MOSQ_ERR_SUCCESS) {
+        qCWarning(mqttWrapperDC) << "Could not reconnect to broker!" << rc;
+    }
+    if (mosquitto->loop_start() != MOSQ_ERR_SUCCESS) {
+        qCWarning(mqttWrapperDC) << "Could not initiate async mosquitto loop! Something is beyond broken!";
+    }
+}
+
 void MQTTClientWrapperPrivate::on_disconnect(int rc)
 {
+    // Aliases die with the connection: until the next CONNACK, publish full topics
+    topicAliases.reset(0);
+    receiveMaximum.store(0);
+
+    if (loopMode == MQTTClientWrapper::EventLoopMode) {
+        // Either way, the socket we were watching is gone
+        teardownNotifiers();
+
+        if (rc != 0 && status == MQTTClientWrapper::ReconnectingStatus) {
+            // A reconnection attempt failed, just try again later
+            reconnectTimer->start();
+            return;
+        }
+    }
+
     setStatus(MQTTClientWrapper::DisconnectedStatus);
 
     if (rc == 0) {
         // Client requested disconnect.
-        mosquitto->loop_stop();
+        if (loopMode == MQTTClientWrapper::ThreadedLoopMode) {
+            mosquitto->loop_stop();
+        }
     } else {
-        // Unexpected disconnect, Mosquitto will reconnect
+        // Unexpected disconnect, Mosquitto will reconnect (or we will, in event loop mode)
         qCInfo(mqttWrapperDC) << "Unexpected disconnection from broker!" << rc;
         setStatus(MQTTClientWrapper::ReconnectingStatus);
 
         Q_Q(MQTTClientWrapper);
         Q_EMIT q->connectionStarted();
+
+        if (loopMode == MQTTClientWrapper::EventLoopMode) {
+            reconnectTimer->start();
+        }
+    }
+}
+
+bool MQTTClientWrapperPrivate::setupNotifiers()
+{
+    Q_Q(MQTTClientWrapper);
+
+    teardownNotifiers();
+
+    int fd = mosquitto_socket(mosquitto->handle());
+    if (fd < 0) {
+        return false;
+    }
+
+    readNotifier = new QSocketNotifier(fd, QSocketNotifier::Read, q);
+    QObject::connect(readNotifier, &QSocketNotifier::activated, q, [this] {
+        handleLoopResult(mosquitto_loop_read(mosquitto->handle(), 1));
+    });
+    writeNotifier = new QSocketNotifier(fd, QSocketNotifier::Write, q);
+    QObject::connect(writeNotifier, &QSocketNotifier::activated, q, [this] {
+        handleLoopResult(mosquitto_loop_write(mosquitto->handle(), 1));
+    });
+
+    updateWriteNotifier();
+    miscTimer->start();
+
+    return true;
+}
+
+void MQTTClientWrapperPrivate::teardownNotifiers()
+{
+    // We might be inside one of their activated() signals
+    if (readNotifier) {
+        readNotifier->setEnabled(false);
+        readNotifier->deleteLater();
+        readNotifier = nullptr;
+    }
+    if (writeNotifier) {
+        writeNotifier->setEnabled(false);
+        writeNotifier->deleteLater();
+        writeNotifier = nullptr;
+    }
+    miscTimer->stop();
+}
+
+void MQTTClientWrapperPrivate::updateWriteNotifier()
+{
+    // Only wake up for writing when libmosquitto has something queued, otherwise we would spin
+    if (writeNotifier) {
+        writeNotifier->setEnabled(mosquitto_want_write(mosquitto->handle()));
+    }
+}
+
+void MQTTClientWrapperPrivate::handleLoopResult(int rc)
+{
+    if (rc == MOSQ_ERR_SUCCESS) {
+        updateWriteNotifier();
+        return;
+    }
+
+    // The library already notified us, or we are not connected at all
+    if (!readNotifier || reconnectTimer->isActive() || status == MQTTClientWrapper::DisconnectedStatus) {
+        return;
+    }
+
+    qCDebug(mqttWrapperDC) << "Mosquitto loop returned" << rc;
+    on_disconnect(status == MQTTClientWrapper::DisconnectingStatus ? 0 : rc);
+}
+
+void MQTTClientWrapperPrivate::reconnect()
+{
+    qCInfo(mqttWrapperDC) << "Reconnecting to broker";
+
+    int rc;
+    if ((rc = mosquitto_reconnect_async(mosquitto->handle())) != MOSQ_ERR_SUCCESS || !setupNotifiers()) {
+        qCInfo(mqttWrapperDC) << "Could not reconnect to broker, retrying later" << rc;
+        reconnectTimer->start();
     }
 }
 
@@ -137,11 +351,6 @@ void MQTTClientWrapperPrivate::on_log(int level, const char *str)
     qWarning() << "MOSQUITTO LOG!" << level << str;
 }
 
-void MQTTClientWrapperPrivate::on_error()
-{
-    qWarning() << "MOSQUITTO ERROR!";
-}
-
 void MQTTClientWrapperPrivate::on_publish(int mid)
 {
     Q_Q(MQTTClientWrapper);
@@ -164,6 +373,19 @@ MQTTClientWrapper::MQTTClientWrapper(const QUrl &host, const QByteArray &clientI
     d->connackTimer = new QTimer(this);
     d->connackTimer->setInterval(Hyperdrive::Utils::randomizedInterval(CONNACK_TIMEOUT, 1.0));
     d->connackTimer->setSingleShot(true);
+
+    d->miscTimer = new QTimer(this);
+    d->miscTimer->setTimerType(Qt::CoarseTimer);
+    d->miscTimer->setInterval(MISC_INTERVAL);
+    connect(d->miscTimer, &QTimer::timeout, this, [d] {
+        // Keepalives and retries
+        d->handleLoopResult(mosquitto_loop_misc(d->mosquitto->handle()));
+    });
+
+    d->reconnectTimer = new QTimer(this);
+    d->reconnectTimer->setInterval(Hyperdrive::Utils::randomizedInterval(RECONNECT_INTERVAL, 1.0));
+    d->reconnectTimer->setSingleShot(true);
+    connect(d->reconnectTimer, &QTimer::timeout, this, [d] { d->reconnect(); });
 }
 
 MQTTClientWrapper::~MQTTClientWrapper()
@@ -173,10 +395,18 @@ MQTTClientWrapper::~MQTTClientWrapper()
     if (Q_LIKELY(d->mosquitto)) {
         qWarning() << "Stopping mosquitto!";
         d->mosquitto->disconnect();
-        d->mosquitto->loop_stop();
+        if (d->loopMode == EventLoopMode) {
+            // Best effort: flush the DISCONNECT packet, nobody else will
+            mosquitto_loop_write(d->mosquitto->handle(), 1);
+            d->teardownNotifiers();
+        } else {
+            d->mosquitto->loop_stop();
+        }
 
         delete d->mosquitto;
-        mosqpp::lib_cleanup();
+        if (s_mosquittoLibReferences.fetchAndAddOrdered(-1) == 1) {
+            mosquitto_lib_cleanup();
+        }
     }
 }
 
@@ -233,6 +463,42 @@ void MQTTClientWrapper::setKeepAlive(quint64 seconds)
     d->keepAlive = seconds;
 }
 
+void MQTTClientWrapper::setLoopMode(MQTTClientWrapper::LoopMode mode)
+{
+    Q_D(MQTTClientWrapper);
+    d->loopMode = mode;
+}
+
+MQTTClientWrapper::LoopMode MQTTClientWrapper::loopMode() const
+{
+    Q_D(const MQTTClientWrapper);
+    return d->loopMode;
+}
+
+void MQTTClientWrapper::setProtocolVersion(MQTTClientWrapper::ProtocolVersion version)
+{
+    Q_D(MQTTClientWrapper);
+    d->protocolVersion = version;
+}
+
+MQTTClientWrapper::ProtocolVersion MQTTClientWrapper::protocolVersion() const
+{
+    Q_D(const MQTTClientWrapper);
+    return d->protocolVersion;
+}
+
+void MQTTClientWrapper::setTopicAliasMaximum(int maximum)
+{
+    Q_D(MQTTClientWrapper);
+    d->topicAliasMaximum = qBound(0, maximum, 65535);
+}
+
+int MQTTClientWrapper::receiveMaximum() const
+{
+    Q_D(const MQTTClientWrapper);
+    return d->receiveMaximum.load();
+}
+
 void MQTTClientWrapper::setIgnoreSslErrors(bool ignoreSslErrors)
 {
     Q_D(MQTTClientWrapper);
@@ -271,8 +537,14 @@ void MQTTClientWrapper::initImpl()
     Q_D(MQTTClientWrapper);
 
     auto initMosquitto = [this, d] {
+        // Always successful
+        if (s_mosquittoLibReferences.fetchAndAddOrdered(1) == 0) {
+            mosquitto_lib_init();
+        }
+
         // Initialize stuff
         d->mosquitto = new HyperdriveMosquittoClient(d, d->hardwareId.constData(), d->cleanSession);
+        d->mosquitto->set_protocol_version(d->protocolVersion == MQTT5ProtocolVersion ? MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311);
 
         // SSL
         if (!d->pathToCA.isEmpty() && !d->pathToPKey.isEmpty() && !d->pathToCertificate.isEmpty()) {
@@ -290,9 +562,6 @@ void MQTTClientWrapper::initImpl()
             }
         }
 
-        // Always successful
-        mosqpp::lib_init();
-
         qCWarning(mqttWrapperDC) << "Mosquitto is up!";
 
         setReady();
@@ -338,14 +607,49 @@ bool MQTTClientWrapper::connectToBroker()
         case DisconnectingStatus: {
             int rc;
 
-            qCInfo(mqttWrapperDC) << "Starting mosquitto connection" << d->serverUrl.host() << d->serverUrl.port();
+            qCInfo(mqttWrapperDC) << "Starting mosquitto connection" << d->serverUrl;
 
-            if ((rc = d->mosquitto->connect_async(qstrdup(d->serverUrl.host().toLatin1().constData()), d->serverUrl.port(), 60)) != MOSQ_ERR_SUCCESS) {
+            // libmosquitto reuses it for its own reconnections, so it changes only with a new connectToBroker
+            int keepAlive = static_cast<int>(qMin(d->keepAlive, static_cast<quint64>(65535)));
+
+            // libmosquitto copies the host. A unix socket is given as its path, with port 0.
+            QByteArray host;
+            int port;
+            if (d->serverUrl.scheme() == QStringLiteral("unix")) {
+#ifdef HAVE_MOSQUITTO_UNIX_SOCKETS
+                host = QFile::encodeName(d->serverUrl.path());
+                port = 0;
+#else
+                qCWarning(mqttWrapperDC) << "This libmosquitto does not support unix sockets!";
+                Q_EMIT connectionFailed();
+                return false;
+#endif
+            } else {
+                host = d->serverUrl.host().toLatin1();
+                port = d->serverUrl.port();
+            }
+
+            if (d->protocolVersion == MQTT5ProtocolVersion && !d->cleanSession) {
+                // Without a session expiry interval, the broker would forget the session as soon as we disconnect
+                mosquitto_property *properties = NULL;
+                mosquitto_property_add_int32(&properties, MQTT_PROP_SESSION_EXPIRY_INTERVAL, PERSISTENT_SESSION_EXPIRY_INTERVAL);
+                rc = d->mosquitto->connect_async_v5(host.constData(), port, keepAlive, properties);
+                mosquitto_property_free_all(&properties);
+            } else {
+                rc = d->mosquitto->connect_async(host.constData(), port, keepAlive);
+            }
+
+            if (rc != MOSQ_ERR_SUCCESS) {
                 qCWarning(mqttWrapperDC) << "Could not initiate async mosquitto connection! Return code " << rc;
                 Q_EMIT connectionFailed();
                 return false;
             }
-            if (d->mosquitto->loop_start() != MOSQ_ERR_SUCCESS) {
+            if (d->loopMode == EventLoopMode) {
+                if (!d->setupNotifiers()) {
+                    qCWarning(mqttWrapperDC) << "Could not watch the mosquitto socket! Something is beyond broken!";
+                    return false;
+                }
+            } else if (d->mosquitto->loop_start() != MOSQ_ERR_SUCCESS) {
                 qCWarning(mqttWrapperDC) << "Could not initiate async mosquitto loop! Something is beyond broken!";
                 return false;
             }
@@ -382,10 +686,12 @@ bool MQTTClientWrapper::disconnectFromBroker()
             int rc;
 
             d->connackTimer->stop();
+            d->reconnectTimer->stop();
 
             if ((rc = d->mosquitto->disconnect()) != MOSQ_ERR_SUCCESS) {
                 if (rc == MOSQ_ERR_NO_CONN) {
                     qCWarning(mqttWrapperDC) << "Trying to disconnect, but not connected to a broker";
+                    d->teardownNotifiers();
                     d->setStatus(MQTTClientWrapper::DisconnectedStatus);
                     return true;
                 } else {
@@ -394,6 +700,7 @@ bool MQTTClientWrapper::disconnectFromBroker()
                 }
             }
             d->setStatus(MQTTClientWrapper::DisconnectingStatus);
+            d->updateWriteNotifier();
             return true;
         }
         default: {
@@ -416,11 +723,31 @@ int MQTTClientWrapper::publish(const QByteArray& topic, const QByteArray& payloa
     int qos = lqos == MQTTQoS::DefaultQoS ? d->publishQoS : (int)lqos;
     int mid;
 
-    if ((rc = d->mosquitto->publish(&mid, topic.constData(), payload.length(), const_cast<char*>(payload.data()), qos, retained)) != MOSQ_ERR_SUCCESS) {
+    // Topic aliases are only used for QoS 0: libmosquitto would retransmit QoS > 0 messages verbatim on a new
+    // connection, where the alias no longer exists.
+    bool known = false;
+    quint16 alias = qos == 0 ? d->topicAliases.alias(topic, &known) : 0;
+
+    if (alias > 0) {
+        mosquitto_property *properties = NULL;
+        mosquitto_property_add_int16(&properties, MQTT_PROP_TOPIC_ALIAS, alias);
+        // Once the broker knows the alias, the topic can be left out
+        rc = d->mosquitto->publish_v5(&mid, known ? NULL : topic.constData(), payload.length(), payload.constData(), qos, retained, properties);
+        mosquitto_property_free_all(&properties);
+
+        if (rc != MOSQ_ERR_SUCCESS && !known) {
+            d->topicAliases.forget(topic);
+        }
+    } else {
+        rc = d->mosquitto->publish(&mid, topic.constData(), payload.length(), const_cast<char*>(payload.data()), qos, retained);
+    }
+
+    if (rc != MOSQ_ERR_SUCCESS) {
         qCWarning(mqttWrapperDC) << "Failed to start sendMessage, return code " << rc;
         return -rc;
     }
 
+    d->updateWriteNotifier();
     return mid;
 }
 
@@ -444,6 +771,70 @@ void MQTTClientWrapper::subscribe(const QByteArray& topic, MQTTQoS subQoS)
     if ((rc = d->mosquitto->subscribe(NULL, topic.constData(), qos)) != MOSQ_ERR_SUCCESS) {
         qCWarning(mqttWrapperDC) << "Failed to start subscribe, return code " << rc;
     }
+
+    d->updateWriteNotifier();
+}
+
+bool MQTTClientWrapper::subscribe(const QList<QByteArray> &topics, MQTTQoS subQoS)
+{
+    Q_D(MQTTClientWrapper);
+
+    if (Q_UNLIKELY(!d->mosquitto)) {
+        qCWarning(mqttWrapperDC) << "Attempted to call subscribe before initializing the client!";
+        return false;
+    }
+
+    int qos;
+    if (subQoS == MQTTQoS::DefaultQoS) {
+        qos = d->publishQoS;
+    } else {
+        qos = (int)subQoS;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < topics.size(); i += MAX_TOPICS_PER_PACKET) {
+        // topics owns the data, we just need the pointers
+        QVector<char*> batch;
+        for (int j = i; j < topics.size() && j < i + MAX_TOPICS_PER_PACKET; ++j) {
+            batch.append(const_cast<char*>(topics.at(j).constData()));
+        }
+
+        int rc;
+        if ((rc = d->mosquitto->subscribe_multiple(NULL, batch.size(), batch.data(), qos)) != MOSQ_ERR_SUCCESS) {
+            qCWarning(mqttWrapperDC) << "Failed to start batched subscribe, return code " << rc;
+            ok = false;
+        }
+    }
+
+    d->updateWriteNotifier();
+    return ok;
+}
+
+bool MQTTClientWrapper::unsubscribe(const QList<QByteArray> &topics)
+{
+    Q_D(MQTTClientWrapper);
+
+    if (Q_UNLIKELY(!d->mosquitto)) {
+        qCWarning(mqttWrapperDC) << "Attempted to call unsubscribe before initializing the client!";
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < topics.size(); i += MAX_TOPICS_PER_PACKET) {
+        QVector<char*> batch;
+        for (int j = i; j < topics.size() && j < i + MAX_TOPICS_PER_PACKET; ++j) {
+            batch.append(const_cast<char*>(topics.at(j).constData()));
+        }
+
+        int rc;
+        if ((rc = d->mosquitto->unsubscribe_multiple(NULL, batch.size(), batch.data())) != MOSQ_ERR_SUCCESS) {
+            qCWarning(mqttWrapperDC) << "Failed to start batched unsubscribe, return code " << rc;
+            ok = false;
+        }
+    }
+
+    d->updateWriteNotifier();
+    return ok;
 }
 
 }
@@ -21,6 +21,8 @@ class MQTTClientWrapper : public Hemera::AsyncInitObject
 
     Q_PROPERTY(Status status READ status NOTIFY statusChanged)
 
+    Q_PRIVATE_SLOT(d_func(), void restartThreadedLoop())
+
 public:
     enum Status {
         UnknownStatus = 0,
@@ -38,7 +40,20 @@ public:
         DefaultQoS = 99
     };
     Q_ENUM(MQTTQoS);
+    enum LoopMode {
+        /// libmosquitto runs its own network thread, callbacks are delivered as queued signals
+        ThreadedLoopMode = 0,
+        /// The socket is watched by the Qt event loop of the wrapper's thread
+        EventLoopMode = 1
+    };
+    Q_ENUM(LoopMode);
+    enum ProtocolVersion {
+        MQTT311ProtocolVersion = 4,
+        MQTT5ProtocolVersion = 5
+    };
+    Q_ENUM(ProtocolVersion);
 
+    /// host is either tcp://host:port or unix:///path/to/socket
     explicit MQTTClientWrapper(const QUrl &host, QObject *parent);
     explicit MQTTClientWrapper(const QUrl &host, const QByteArray &clientId, QObject *parent = nullptr);
     virtual ~MQTTClientWrapper();
@@ -56,10 +71,25 @@ public:
     /// Note: this will only work if set before initializing the Client.
     void setCleanSession(bool cleanSession = true);
     void setKeepAlive(quint64 seconds = 300);
+    /// Note: this will only work if set before connecting to the broker.
+    void setLoopMode(LoopMode mode);
+    LoopMode loopMode() const;
+    /// Note: this will only work if set before initializing the Client. MQTT 5 falls back to 3.1.1 if the broker refuses it.
+    void setProtocolVersion(ProtocolVersion version);
+    /// The protocol version in use, which might differ from the requested one after a fallback.
+    ProtocolVersion protocolVersion() const;
+    /// Upper bound to the topic aliases used for outgoing QoS 0 messages on MQTT 5. 0 disables them.
+    void setTopicAliasMaximum(int maximum);
+    /// How many QoS > 0 messages the broker accepts in flight on this MQTT 5 connection, 0 on 3.1.1 or while disconnected.
+    int receiveMaximum() const;
     void setLastWill(const QByteArray &topic, const QByteArray &message, MQTTQoS qos, bool retained = false);
 
     int publish(const QByteArray &topic, const QByteArray &payload, MQTTQoS qos = DefaultQoS, bool retained = false);
     void subscribe(const QByteArray &topic, MQTTQoS qos = DefaultQoS);
+    /// Subscribes to all topics with as few SUBSCRIBE packets as possible. Returns false if any of them failed.
+    bool subscribe(const QList<QByteArray> &topics, MQTTQoS qos = DefaultQoS);
+    /// Unsubscribes from all topics with as few UNSUBSCRIBE packets as possible. Returns false if any of them failed.
+    bool unsubscribe(const QList<QByteArray> &topics);
 
 public Q_SLOTS:
     bool connectToBroker();
@@ -6,16 +6,51 @@
 #include <HemeraCore/Operation>
 
 #include <QtCore/QDateTime>
+#include <QtCore/QSocketNotifier>
 #include <QtCore/QTimer>
 
 #include <private/HemeraCore/hemeraasyncinitobject_p.h>
 
-#include <mosquittopp.h>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+
+#include <mosquitto.h>
+#include <mqtt_protocol.h>
 
 namespace Hyperdrive {
 
 class HyperdriveMosquittoClient;
 
+// Outgoing MQTT 5 topic aliases. Aliases exist only within a network connection, so the table is reset
+// on every CONNACK. When full, the least recently used alias gets rebound. Publishes happen on the caller's
+// thread while connections are handled on mosquitto's, hence the lock.
+class TopicAliasTable
+{
+public:
+    TopicAliasTable() : m_maximum(0), m_nextAlias(1), m_clock(0) {}
+
+    void reset(int maximum);
+    int maximum() const;
+    // Returns the alias for topic, or 0 if aliases are disabled. known is set if the broker already has the mapping.
+    quint16 alias(const QByteArray &topic, bool *known);
+    // The mapping for topic never reached the broker
+    void forget(const QByteArray &topic);
+
+private:
+    struct Entry {
+        quint16 alias;
+        quint64 lastUse;
+    };
+
+    mutable QMutex m_mutex;
+    QHash< QByteArray, Entry > m_entries;
+    QList< quint16 > m_freeAliases;
+    int m_maximum;
+    int m_nextAlias;
+    quint64 m_clock;
+};
+
 class MQTTClientWrapperPrivate : public Hemera::AsyncInitObjectPrivate
 {
 public:
@@ -27,7 +62,13 @@ public:
                                                    , cleanSession(false)
                                                    , sessionPresent(false)
                                                    , publishQoS(1)
-                                                   , subscribeQoS(1) {}
+                                                   , subscribeQoS(1)
+                                                   , loopMode(MQTTClientWrapper::ThreadedLoopMode)
+                                                   , readNotifier(nullptr)
+                                                   , writeNotifier(nullptr)
+                                                   , protocolVersion(MQTTClientWrapper::MQTT311ProtocolVersion)
+                                                   , topicAliasMaximum(64)
+                                                   , receiveMaximum(0) {}
 
     Q_DECLARE_PUBLIC(MQTTClientWrapper)
 
@@ -52,6 +93,20 @@ public:
     QDateTime clientCertificateExpiry;
     QTimer *connackTimer;
 
+    // Event loop mode
+    MQTTClientWrapper::LoopMode loopMode;
+    QSocketNotifier *readNotifier;
+    QSocketNotifier *writeNotifier;
+    QTimer *miscTimer;
+    QTimer *reconnectTimer;
+
+    // MQTT 5
+    MQTTClientWrapper::ProtocolVersion protocolVersion;
+    int topicAliasMaximum;
+    // Written from mosquitto's thread on CONNACK
+    QAtomicInt receiveMaximum;
+    TopicAliasTable topicAliases;
+
     // SSL
     QString pathToCA;
     QString pathToPKey;
@@ -59,36 +114,83 @@ public:
 
     void setStatus(MQTTClientWrapper::Status s);
 
+    bool setupNotifiers();
+    void teardownNotifiers();
+    void updateWriteNotifier();
+    void handleLoopResult(int rc);
+    void reconnect();
+
+    void restartThreadedLoop();
+
     // MQTT CALLBACKS
-    void on_connect(int rc);
+    void on_connect(int rc, int flags, const mosquitto_property *properties);
     void on_disconnect(int rc);
     void on_publish(int mid);
     void on_message(const struct mosquitto_message *message);
     void on_subscribe(int mid, int qos_count, const int *granted_qos);
     void on_unsubscribe(int mid);
     void on_log(int level, const char *str);
-    void on_error();
 };
 
-class HyperdriveMosquittoClient : public mosqpp::mosquittopp
+// Thin RAII wrapper around libmosquitto's C API. We don't use mosquittopp, as it does not expose
+// batched subscriptions, the connection flags nor MQTT 5.
+class HyperdriveMosquittoClient
 {
 public:
     explicit HyperdriveMosquittoClient(MQTTClientWrapperPrivate *d, const char *id, bool clean_session)
-        : mosquittopp(id, clean_session)
-        , d(d) {}
-    virtual ~HyperdriveMosquittoClient() {}
-
-    // MQTT CALLBACKS. Just redirect to our private class
-    inline virtual void on_connect(int rc) override { d->on_connect(rc); }
-    inline virtual void on_disconnect(int rc) override { d->on_disconnect(rc); }
-    inline virtual void on_publish(int mid) override { d->on_publish(mid); }
-    inline virtual void on_message(const struct mosquitto_message *message) override { d->on_message(message); }
-    inline virtual void on_subscribe(int mid, int qos_count, const int *granted_qos) override { d->on_subscribe(mid, qos_count, granted_qos); }
-    inline virtual void on_unsubscribe(int mid) override { d->on_unsubscribe(mid); }
-    inline virtual void on_log(int level, const char *str) override { d->on_log(level, str); }
-    inline virtual void on_error() override { d->on_error(); }
+        : m_mosq(mosquitto_new(id, clean_session, this))
+        , d(d)
+    {
+        // The v5 callback is invoked for 3.1.1 connections too, just without properties
+        mosquitto_connect_v5_callback_set(m_mosq, [] (struct mosquitto *, void *obj, int rc, int flags, const mosquitto_property *properties) {
+            static_cast<HyperdriveMosquittoClient*>(obj)->d->on_connect(rc, flags, properties);
+        });
+        mosquitto_disconnect_callback_set(m_mosq, [] (struct mosquitto *, void *obj, int rc) {
+            static_cast<HyperdriveMosquittoClient*>(obj)->d->on_disconnect(rc);
+        });
+        mosquitto_publish_callback_set(m_mosq, [] (struct mosquitto *, void *obj, int mid) {
+            static_cast<HyperdriveMosquittoClient*>(obj)->d->on_publish(mid);
+        });
+        mosquitto_message_callback_set(m_mosq, [] (struct mosquitto *, void *obj, const struct mosquitto_message *message) {
+            static_cast<HyperdriveMosquittoClient*>(obj)->d->on_message(message);
+        });
+        mosquitto_subscribe_callback_set(m_mosq, [] (struct mosquitto *, void *obj, int mid, int qos_count, const int *granted_qos) {
+            static_cast<HyperdriveMosquittoClient*>(obj)->d->on_subscribe(mid, qos_count, granted_qos);
+        });
+        mosquitto_unsubscribe_callback_set(m_mosq, [] (struct mosquitto *, void *obj, int mid) {
+            static_cast<HyperdriveMosquittoClient*>(obj)->d->on_unsubscribe(mid);
+        });
+        mosquitto_log_callback_set(m_mosq, [] (struct mosquitto *, void *obj, int level, const char *str) {
+            static_cast<HyperdriveMosquittoClient*>(obj)->d->on_log(level, str);
+        });
+    }
+    ~HyperdriveMosquittoClient() { mosquitto_destroy(m_mosq); }
+
+    inline struct mosquitto *handle() const { return m_mosq; }
+
+    inline int connect_async(const char *host, int port, int keepalive) { return mosquitto_connect_async(m_mosq, host, port, keepalive); }
+    // libmosquitto keeps a copy of the properties, and sends them again on every reconnection
+    inline int connect_async_v5(const char *host, int port, int keepalive, const mosquitto_property *properties)
+    { return mosquitto_connect_bind_async_v5(m_mosq, host, port, keepalive, NULL, properties); }
+    inline int disconnect() { return mosquitto_disconnect(m_mosq); }
+    inline int loop_start() { return mosquitto_loop_start(m_mosq); }
+    inline int loop_stop(bool force = false) { return mosquitto_loop_stop(m_mosq, force); }
+    inline int tls_set(const char *cafile, const char *capath, const char *certfile, const char *keyfile)
+    { return mosquitto_tls_set(m_mosq, cafile, capath, certfile, keyfile, NULL); }
+    inline int tls_opts_set(int cert_reqs) { return mosquitto_tls_opts_set(m_mosq, cert_reqs, NULL, NULL); }
+    inline int publish(int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
+    { return mosquitto_publish(m_mosq, mid, topic, payloadlen, payload, qos, retain); }
+    inline int publish_v5(int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *properties)
+    { return mosquitto_publish_v5(m_mosq, mid, topic, payloadlen, payload, qos, retain, properties); }
+    inline int set_protocol_version(int version) { return mosquitto_int_option(m_mosq, MOSQ_OPT_PROTOCOL_VERSION, version); }
+    inline int subscribe(int *mid, const char *sub, int qos) { return mosquitto_subscribe(m_mosq, mid, sub, qos); }
+    inline int subscribe_multiple(int *mid, int sub_count, char *const *const sub, int qos)
+    { return mosquitto_subscribe_multiple(m_mosq, mid, sub_count, sub, qos, 0, NULL); }
+    inline int unsubscribe_multiple(int *mid, int sub_count, char *const *const sub)
+    { return mosquitto_unsubscribe_multiple(m_mosq, mid, sub_count, sub, NULL); }
 
 private:
+    struct mosquitto *m_mosq;
     MQTTClientWrapperPrivate *d;
 };
 
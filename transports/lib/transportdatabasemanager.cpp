@@ -12,6 +12,7 @@
 
 #define TARGET_VALUE 0
 #define PAYLOAD_VALUE 1
+#define HASH_VALUE 1
 
 #define EXPIRY_VALUE 0
 
@@ -142,17 +143,17 @@ bool ensureDatabase(const QString &dbPath, const QString &migrationsDirPath)
     return true;
 }
 
-bool Transactions::insertPersistentEntry(const QByteArray &target, const QByteArray &payload)
+bool Transactions::insertPersistentEntry(const QByteArray &target, const QByteArray &hash)
 {
     if (!ensureDatabase()) {
         return false;
     }
 
     QSqlQuery query;
-    query.prepare(QStringLiteral("INSERT INTO persistent_entries (target, payload) "
-                                 "VALUES (:target, :payload)"));
+    query.prepare(QStringLiteral("INSERT INTO persistent_entries (target, hash) "
+                                 "VALUES (:target, :hash)"));
     query.bindValue(QStringLiteral(":target"), QLatin1String(target));
-    query.bindValue(QStringLiteral(":payload"), payload);
+    query.bindValue(QStringLiteral(":hash"), hash);
 
     if (!query.exec()) {
         qCWarning(transportDatabaseManagerDC) << "Insert persistent entry query failed!" << query.lastError();
@@ -162,17 +163,17 @@ bool Transactions::insertPersistentEntry(const QByteArray &target, const QByteAr
     return true;
 }
 
-bool Transactions::updatePersistentEntry(const QByteArray &target, const QByteArray &payload)
+bool Transactions::updatePersistentEntry(const QByteArray &target, const QByteArray &hash)
 {
     if (!ensureDatabase()) {
         return false;
     }
 
     QSqlQuery query;
-    query.prepare(QStringLiteral("UPDATE persistent_entries SET payload=:payload "
+    query.prepare(QStringLiteral("UPDATE persistent_entries SET hash=:hash "
                                  "WHERE target=:target"));
     query.bindValue(QStringLiteral(":target"), QLatin1String(target));
-    query.bindValue(QStringLiteral(":payload"), payload);
+    query.bindValue(QStringLiteral(":hash"), hash);
 
     if (!query.exec()) {
         qCWarning(transportDatabaseManagerDC) << "Update persistent entry query failed!" << query.lastError();
@@ -209,17 +210,103 @@ QHash<QByteArray, QByteArray> Transactions::allPersistentEntries()
     }
 
     QSqlQuery query;
-    query.prepare(QStringLiteral("SELECT target, payload FROM persistent_entries"));
+    query.prepare(QStringLiteral("SELECT target, hash FROM persistent_entries"));
 
     if (!query.exec()) {
         qCWarning(transportDatabaseManagerDC) << "All persistent entries query failed!" << query.lastError();
         return ret;
     }
 
+    while (query.next()) {
+        ret.insert(query.value(TARGET_VALUE).toByteArray(), query.value(HASH_VALUE).toByteArray());
+    }
+
+    return ret;
+}
+
+bool Transactions::updateSyncedHash(const QByteArray &target, const QByteArray &hash)
+{
+    if (!ensureDatabase()) {
+        return false;
+    }
+
+    QSqlQuery query;
+    query.prepare(QStringLiteral("UPDATE persistent_entries SET synced_hash=:hash "
+                                 "WHERE target=:target"));
+    query.bindValue(QStringLiteral(":target"), QLatin1String(target));
+    query.bindValue(QStringLiteral(":hash"), hash);
+
+    if (!query.exec()) {
+        qCWarning(transportDatabaseManagerDC) << "Update synced hash query failed!" << query.lastError();
+        return false;
+    }
+
+    return true;
+}
+
+bool Transactions::resetSyncedHashes()
+{
+    if (!ensureDatabase()) {
+        return false;
+    }
+
+    QSqlQuery query;
+    if (!query.exec(QStringLiteral("UPDATE persistent_entries SET synced_hash=NULL"))) {
+        qCWarning(transportDatabaseManagerDC) << "Reset synced hashes query failed!" << query.lastError();
+        return false;
+    }
+
+    return true;
+}
+
+QHash<QByteArray, QByteArray> Transactions::allSyncedHashes()
+{
+    QHash<QByteArray, QByteArray> ret;
+
+    if (!ensureDatabase()) {
+        return ret;
+    }
+
+    QSqlQuery query;
+    query.prepare(QStringLiteral("SELECT target, synced_hash FROM persistent_entries WHERE synced_hash IS NOT NULL"));
+
+    if (!query.exec()) {
+        qCWarning(transportDatabaseManagerDC) << "All synced hashes query failed!" << query.lastError();
+        return ret;
+    }
+
+    while (query.next()) {
+        ret.insert(query.value(TARGET_VALUE).toByteArray(), query.value(HASH_VALUE).toByteArray());
+    }
+
+    return ret;
+}
+
+QHash<QByteArray, QByteArray> Transactions::takeLegacyPersistentEntries()
+{
+    QHash<QByteArray, QByteArray> ret;
+
+    if (!ensureDatabase() || !QSqlDatabase::database().tables().contains(QStringLiteral("legacy_persistent_entries"))) {
+        return ret;
+    }
+
+    QSqlQuery query;
+    query.prepare(QStringLiteral("SELECT target, payload FROM legacy_persistent_entries"));
+
+    if (!query.exec()) {
+        qCWarning(transportDatabaseManagerDC) << "Legacy persistent entries query failed!" << query.lastError();
+        return ret;
+    }
+
     while (query.next()) {
         ret.insert(query.value(TARGET_VALUE).toByteArray(), query.value(PAYLOAD_VALUE).toByteArray());
     }
 
+    QSqlQuery dropQuery;
+    if (!dropQuery.exec(QStringLiteral("DROP TABLE legacy_persistent_entries"))) {
+        qCWarning(transportDatabaseManagerDC) << "Could not drop legacy persistent entries!" << dropQuery.lastError();
+    }
+
     return ret;
 }
 
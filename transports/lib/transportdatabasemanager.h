@@ -16,10 +16,17 @@ namespace TransportDatabaseManager
 
 namespace Transactions
 {
-    bool insertPersistentEntry(const QByteArray &target, const QByteArray &payload);
-    bool updatePersistentEntry(const QByteArray &target, const QByteArray &payload);
+    // Persistent entries hold a content hash of the payload, the payload itself lives in Hyperdrive's cache
+    bool insertPersistentEntry(const QByteArray &target, const QByteArray &hash);
+    bool updatePersistentEntry(const QByteArray &target, const QByteArray &hash);
     bool deletePersistentEntry(const QByteArray &target);
     QHash<QByteArray, QByteArray> allPersistentEntries();
+    // Hash of the payload last confirmed by the broker, stored alongside the entry's own hash
+    bool updateSyncedHash(const QByteArray &target, const QByteArray &hash);
+    bool resetSyncedHashes();
+    QHash<QByteArray, QByteArray> allSyncedHashes();
+    // Payloads stored before entries were hashed. The legacy table is dropped once they have been read.
+    QHash<QByteArray, QByteArray> takeLegacyPersistentEntries();
 
     int insertCacheMessage(const CacheMessage &cacheMessage, const QDateTime &expiry = QDateTime());
     bool deleteCacheMessage(int id);
@@ -0,0 +1,62 @@
+#include "mqtttopictrie.h"
+
+namespace Hyperdrive {
+
+MQTTTopicTrie::MQTTTopicTrie()
+{
+    clear();
+}
+
+void MQTTTopicTrie::clear()
+{
+    m_nodes.clear();
+    // The root
+    m_nodes.append(Node{ QVector< QPair< char, int > >(), false });
+}
+
+int MQTTTopicTrie::child(int node, char c) const
+{
+    for (const QPair< char, int > &child : m_nodes.at(node).children) {
+        if (child.first == c) {
+            return child.second;
+        }
+    }
+    return -1;
+}
+
+void MQTTTopicTrie::insert(const QByteArray &interface)
+{
+    int node = 0;
+    for (char c : interface) {
+        int next = child(node, c);
+        if (next < 0) {
+            next = m_nodes.size();
+            m_nodes.append(Node{ QVector< QPair< char, int > >(), false });
+            m_nodes[node].children.append(qMakePair(c, next));
+        }
+        node = next;
+    }
+
+    m_nodes[node].terminal = true;
+}
+
+int MQTTTopicTrie::match(const QByteArray &topic, int offset) const
+{
+    int node = 0;
+    int i = offset;
+    for (; i < topic.size() && topic.at(i) != '/'; ++i) {
+        node = child(node, topic.at(i));
+        if (node < 0) {
+            return -1;
+        }
+    }
+
+    return (i > offset && m_nodes.at(node).terminal) ? i - offset : -1;
+}
+
+bool MQTTTopicTrie::isEmpty() const
+{
+    return m_nodes.size() == 1;
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef HYPERDRIVE_MQTTTOPICTRIE_H
+#define HYPERDRIVE_MQTTTOPICTRIE_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QVector>
+
+namespace Hyperdrive {
+
+// Character trie of interface names. Given a topic in the interface/path form, it tells whether its first
+// level is a known interface by walking it once, without copying anything.
+class MQTTTopicTrie
+{
+public:
+    MQTTTopicTrie();
+
+    void clear();
+    void insert(const QByteArray &interface);
+
+    // Length of the interface matching the first level of topic, starting at offset. -1 if there's none.
+    int match(const QByteArray &topic, int offset = 0) const;
+
+    bool isEmpty() const;
+
+private:
+    struct Node {
+        // Interface names share long prefixes and branch little: a flat array beats a hash here
+        QVector< QPair< char, int > > children;
+        bool terminal;
+    };
+
+    int child(int node, char c) const;
+
+    QVector< Node > m_nodes;
+};
+
+}
+
+#endif // HYPERDRIVE_MQTTTOPICTRIE_H
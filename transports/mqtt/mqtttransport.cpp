@@ -7,8 +7,12 @@
 #include <HemeraCore/Literals>
 #include <HemeraCore/Operation>
 
+#include <HyperspaceCore/Global>
+#include <HyperspaceCore/Wave>
+
 #include <QtCore/QByteArray>
 #include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
 #include <QtCore/QTimer>
 #include <QtCore/QStringList>
@@ -38,6 +42,11 @@
 
 #define CONNECTION_TIMEOUT 15000
 
+#define DEFAULT_OFFLINE_QUEUE_SIZE 1000
+#define DEFAULT_IN_FLIGHT_WINDOW 32
+// Warnings about full offline queues come at most this often
+#define DROP_WARNING_INTERVAL (60 * 1000)
+
 Q_LOGGING_CATEGORY(mqttTransportDC, "hyperdrive.transport.mqtt", DEBUG_MESSAGES_DEFAULT_LEVEL)
 
 namespace Hyperdrive
@@ -47,6 +56,7 @@ MQTTTransport::MQTTTransport(QObject* parent)
     : RemoteTransport(QStringLiteral("MQTT"), parent)
 {
     connect(this, &MQTTTransport::introspectionChanged, this, &MQTTTransport::publishIntrospection);
+    connect(this, &MQTTTransport::introspectionChanged, this, &MQTTTransport::rebuildConsumerTrie);
 }
 
 MQTTTransport::~MQTTTransport()
@@ -58,29 +68,187 @@ void MQTTTransport::initImpl()
     // Load from configuration
     QDir confDir(QLatin1String(Hyperdrive::StaticConfig::hyperspaceConfigurationDir()));
     for (const QString &conf : confDir.entryList(QStringList() << QStringLiteral("transport-mqtt-*.conf"))) {
-        QSettings settings(confDir.absoluteFilePath(conf), QSettings::IniFormat);
-        settings.beginGroup(QStringLiteral("MQTTTransport")); {
-            MQTTClientWrapper *c = new MQTTClientWrapper(settings.value(QStringLiteral("hostUrl")).toUrl(), this);
-            c->setCleanSession(settings.value(QStringLiteral("cleanSession")).toBool());
-            c->setPublishQoS(static_cast<MQTTClientWrapper::MQTTQoS>(settings.value(QStringLiteral("publishQoS")).toInt()));
-            c->setSubscribeQoS(static_cast<MQTTClientWrapper::MQTTQoS>(settings.value(QStringLiteral("subscribeQoS")).toInt()));
-            c->setKeepAlive(settings.value(QStringLiteral("keepAlive")).toInt());
-
-            connect(c->init(), &Hemera::Operation::finished, c, &MQTTClientWrapper::connectToBroker);
-            connect(c, &MQTTClientWrapper::statusChanged, [this, c]  {
-                if (c->status() == MQTTClientWrapper::ConnectedStatus) {
-                    // We need to setup again the subscriptions, unless we have a persistent session on the other end.
-                    setupClientSubscriptions(c);
-                    // And publish the introspection.
-                    publishIntrospectionForClient(c);
+        createClient(confDir.absoluteFilePath(conf));
+    }
+
+    setReady();
+}
+
+// Keys of the MQTTTransport group which can be changed without a new session
+static const char *tunableKeys[] = { "publishQoS", "subscribeQoS", "offlineQueueSize", "inFlightWindow" };
+
+QVariantMap MQTTTransport::sessionConfiguration(const QString &configurationPath)
+{
+    QVariantMap ret;
+    QSettings settings(configurationPath, QSettings::IniFormat);
+    settings.beginGroup(QStringLiteral("MQTTTransport")); {
+        for (const QString &key : settings.childKeys()) {
+            bool tunable = false;
+            for (const char *tunableKey : tunableKeys) {
+                if (key == QLatin1String(tunableKey)) {
+                    tunable = true;
+                    break;
+                }
+            }
+            if (!tunable) {
+                ret.insert(key, settings.value(key));
+            }
+        }
+    } settings.endGroup();
+
+    return ret;
+}
+
+MQTTClientWrapper *MQTTTransport::createClient(const QString &configurationPath)
+{
+    QSettings settings(configurationPath, QSettings::IniFormat);
+    MQTTClientWrapper *c;
+    settings.beginGroup(QStringLiteral("MQTTTransport")); {
+        c = new MQTTClientWrapper(settings.value(QStringLiteral("hostUrl")).toUrl(), this);
+        c->setCleanSession(settings.value(QStringLiteral("cleanSession")).toBool());
+        if (settings.value(QStringLiteral("loopMode")).toString() == QStringLiteral("eventloop")) {
+            c->setLoopMode(MQTTClientWrapper::EventLoopMode);
+        }
+        if (settings.value(QStringLiteral("protocolVersion")).toInt() == 5) {
+            c->setProtocolVersion(MQTTClientWrapper::MQTT5ProtocolVersion);
+        }
+        c->setTopicAliasMaximum(settings.value(QStringLiteral("topicAliasMaximum"), 64).toInt());
+        // Negotiated when connecting: changing it takes a new client
+        c->setKeepAlive(settings.value(QStringLiteral("keepAlive"), 60).toInt());
+    } settings.endGroup();
+
+    ClientQueue queue;
+    queue.nextSequence = 0;
+    queue.droppedMessages = 0;
+    queue.lastDropWarning = 0;
+    m_queues.insert(c, queue);
+    applyClientTunables(c, configurationPath);
+
+    connect(c->init(), &Hemera::Operation::finished, c, &MQTTClientWrapper::connectToBroker);
+    connect(c, &MQTTClientWrapper::statusChanged, [this, c]  {
+        if (c->status() == MQTTClientWrapper::ConnectedStatus && m_queues.contains(c)) {
+            // We need to setup again the subscriptions, unless we have a persistent session on the other end.
+            setupClientSubscriptions(c);
+            // And publish the introspection.
+            publishIntrospectionForClient(c);
+
+            if (!c->sessionPresent()) {
+                // Confirmations for what was in flight will never come: send it again
+                requeueInFlight(c);
+            } else {
+                // libmosquitto retransmits QoS > 0 messages on its own, but QoS 0 ones which didn't make it are gone
+                ClientQueue &queue = m_queues[c];
+                for (QMap< quint64, InFlightMessage >::iterator i = queue.inFlight.begin(); i != queue.inFlight.end();) {
+                    if (i.value().qos == MQTTClientWrapper::AtMostOnceQoS) {
+                        queue.inFlightSequences.remove(i.value().messageId);
+                        i = queue.inFlight.erase(i);
+                    } else {
+                        ++i;
+                    }
                 }
-            });
+            }
+
+            // Flush what piled up while we were offline
+            drainQueue(c);
+        }
+    });
+    connect(c, &MQTTClientWrapper::messageReceived, this, [this, c] (const QByteArray &topic, const QByteArray &payload) {
+        onMessageReceived(c, topic, payload);
+    });
+    connect(c, &MQTTClientWrapper::publishConfirmed, this, [this, c] (int mid) {
+        if (!m_queues.contains(c)) {
+            // Removed, waiting for deletion
+            return;
+        }
+        ClientQueue &queue = m_queues[c];
+        QHash< int, quint64 >::iterator i = queue.inFlightSequences.find(mid);
+        if (i != queue.inFlightSequences.end()) {
+            queue.inFlight.remove(i.value());
+            queue.inFlightSequences.erase(i);
+        }
+        drainQueue(c);
+    });
 
-            m_clients.append(c);
-        } settings.endGroup();
+    m_clients.append(c);
+    m_configurationToClient.insert(configurationPath, c);
+    m_sessionConfigurations.insert(c, sessionConfiguration(configurationPath));
+    return c;
+}
+
+void MQTTTransport::applyClientTunables(MQTTClientWrapper *c, const QString &configurationPath)
+{
+    QSettings settings(configurationPath, QSettings::IniFormat);
+    settings.beginGroup(QStringLiteral("MQTTTransport")); {
+        c->setPublishQoS(static_cast<MQTTClientWrapper::MQTTQoS>(settings.value(QStringLiteral("publishQoS")).toInt()));
+        c->setSubscribeQoS(static_cast<MQTTClientWrapper::MQTTQoS>(settings.value(QStringLiteral("subscribeQoS")).toInt()));
+        ClientQueue &queue = m_queues[c];
+        // Messages kept while the broker is unreachable. The oldest ones get dropped first.
+        queue.maximumPending = qMax(1, settings.value(QStringLiteral("offlineQueueSize"), DEFAULT_OFFLINE_QUEUE_SIZE).toInt());
+        trimPending(c);
+        // Messages handed over to the client before waiting for confirmations
+        queue.inFlightWindow = qMax(1, settings.value(QStringLiteral("inFlightWindow"), DEFAULT_IN_FLIGHT_WINDOW).toInt());
+    } settings.endGroup();
+}
+
+void MQTTTransport::removeClient(MQTTClientWrapper *c)
+{
+    m_clients.removeOne(c);
+    m_queues.remove(c);
+    m_sessionConfigurations.remove(c);
+    for (QHash< QString, MQTTClientWrapper* >::iterator i = m_configurationToClient.begin(); i != m_configurationToClient.end(); ++i) {
+        if (i.value() == c) {
+            m_configurationToClient.erase(i);
+            break;
+        }
     }
 
-    setReady();
+    c->disconnectFromBroker();
+    c->deleteLater();
+}
+
+bool MQTTTransport::reloadConfiguration()
+{
+    QDir confDir(QLatin1String(Hyperdrive::StaticConfig::hyperspaceConfigurationDir()));
+    QSet< QString > configurations;
+    for (const QString &conf : confDir.entryList(QStringList() << QStringLiteral("transport-mqtt-*.conf"))) {
+        configurations.insert(confDir.absoluteFilePath(conf));
+    }
+
+    // Brokers which went away
+    for (const QString &configurationPath : m_configurationToClient.keys()) {
+        if (!configurations.contains(configurationPath)) {
+            qCInfo(mqttTransportDC) << "Removing client for" << configurationPath;
+            removeClient(m_configurationToClient.value(configurationPath));
+        }
+    }
+
+    for (const QString &configurationPath : configurations) {
+        MQTTClientWrapper *c = m_configurationToClient.value(configurationPath);
+        if (!c) {
+            qCInfo(mqttTransportDC) << "Adding client for" << configurationPath;
+            createClient(configurationPath);
+        } else if (sessionConfiguration(configurationPath) != m_sessionConfigurations.value(c)) {
+            // A new session is needed. What's still queued or unconfirmed goes to the new one.
+            qCInfo(mqttTransportDC) << "Recreating client for" << configurationPath;
+            requeueInFlight(c);
+            QQueue< CacheMessage > pending = m_queues.value(c).pending;
+            removeClient(c);
+            c = createClient(configurationPath);
+            for (const CacheMessage &cacheMessage : pending) {
+                enqueue(c, cacheMessage);
+            }
+        } else {
+            applyClientTunables(c, configurationPath);
+            if (c->status() == MQTTClientWrapper::ConnectedStatus) {
+                // Subscribing again updates the granted QoS
+                setupClientSubscriptions(c);
+            }
+            // There might be room for more now
+            drainQueue(c);
+        }
+    }
+
+    return true;
 }
 
 void MQTTTransport::setupClientSubscriptions(MQTTClientWrapper* client)
@@ -89,11 +257,43 @@ void MQTTTransport::setupClientSubscriptions(MQTTClientWrapper* client)
     client->subscribe(client->rootClientTopic() + "/#");
 }
 
+void MQTTTransport::rebuildConsumerTrie()
+{
+    m_consumerTrie.clear();
+    for (QHash< QByteArray, Hyperdrive::Interface >::const_iterator i = introspection().constBegin(); i != introspection().constEnd(); ++i) {
+        if (i.value().interfaceQuality() == Interface::Quality::Consumer) {
+            m_consumerTrie.insert(i.key());
+        }
+    }
+}
+
+void MQTTTransport::onMessageReceived(MQTTClientWrapper *c, const QByteArray &topic, const QByteArray &payload)
+{
+    // We get our own publishes back through the root subscription: weed them out before doing any work
+    QByteArray root = c->rootClientTopic();
+    if (!topic.startsWith(root) || topic.size() <= root.size() + 1 || topic.at(root.size()) != '/'
+        || m_consumerTrie.match(topic, root.size() + 1) < 0) {
+        qCDebug(mqttTransportDC) << "Ignoring message on" << topic << ", it doesn't belong to a consumer interface";
+        return;
+    }
+
+    // Same as the Astarte transport: a write wave targeting /interface/path
+    Hyperspace::Wave w;
+    w.setMethod("WRITE");
+    w.setTarget(topic.mid(root.size()));
+    w.setPayload(payload);
+    qCDebug(mqttTransportDC) << "Sending wave" << w.method() << w.target();
+    routeWave(w, -1);
+}
+
 void MQTTTransport::rebound(const Hyperspace::Rebound& r, int fd)
 {
-    Hyperspace::Rebound rebound = r;
+    Q_UNUSED(fd)
 
-    // TODO: What to do here?
+    // Publishers don't expect an answer, but failures are worth knowing about
+    if (r.response() != Hyperspace::ResponseCode::OK) {
+        qCWarning(mqttTransportDC) << "Wave" << r.id() << "failed!" << static_cast<quint16>(r.response());
+    }
 }
 
 void MQTTTransport::fluctuation(const Hyperspace::Fluctuation &fluctuation)
@@ -106,9 +306,114 @@ void MQTTTransport::cacheMessage(const CacheMessage &cacheMessage)
     qCDebug(mqttTransportDC) << "Received cache message from: " << cacheMessage.target() << cacheMessage.payload();
     // Publish it!
     for (MQTTClientWrapper *c : m_clients) {
-        // Convert to string representation regardless
-        c->publish(c->rootClientTopic() + cacheMessage.target(), cacheMessage.payload());
-    }}
+        enqueue(c, cacheMessage);
+        drainQueue(c);
+    }
+}
+
+MQTTClientWrapper::MQTTQoS MQTTTransport::qosFor(const CacheMessage &cacheMessage)
+{
+    // Same mapping as the Astarte transport
+    if (cacheMessage.interfaceType() == Hyperdrive::Interface::Type::Properties) {
+        return MQTTClientWrapper::ExactlyOnceQoS;
+    }
+
+    switch (static_cast<Hyperspace::Reliability>(cacheMessage.attributes().value("reliability").toInt())) {
+        case Hyperspace::Reliability::Guaranteed:
+            return MQTTClientWrapper::AtLeastOnceQoS;
+        case Hyperspace::Reliability::Unique:
+            return MQTTClientWrapper::ExactlyOnceQoS;
+        default:
+            return MQTTClientWrapper::AtMostOnceQoS;
+    }
+}
+
+void MQTTTransport::enqueue(MQTTClientWrapper *c, const CacheMessage &cacheMessage)
+{
+    ClientQueue &queue = m_queues[c];
+
+    if (c->status() != MQTTClientWrapper::ConnectedStatus
+        && cacheMessage.attributes().value("retention").toInt() == static_cast<int>(Hyperspace::Retention::Discard)) {
+        // Not worth keeping around
+        ++queue.droppedMessages;
+        return;
+    }
+
+    queue.pending.enqueue(cacheMessage);
+    trimPending(c);
+}
+
+void MQTTTransport::trimPending(MQTTClientWrapper *c)
+{
+    ClientQueue &queue = m_queues[c];
+    if (queue.pending.count() <= queue.maximumPending) {
+        return;
+    }
+
+    // The oldest ones go first
+    while (queue.pending.count() > queue.maximumPending) {
+        queue.pending.dequeue();
+        ++queue.droppedMessages;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (now - queue.lastDropWarning >= DROP_WARNING_INTERVAL) {
+        queue.lastDropWarning = now;
+        qCWarning(mqttTransportDC) << "Offline queue for" << c->rootClientTopic() << "is full, dropped so far:" << queue.droppedMessages;
+    }
+}
+
+void MQTTTransport::requeueInFlight(MQTTClientWrapper *c)
+{
+    ClientQueue &queue = m_queues[c];
+    if (queue.inFlight.isEmpty()) {
+        return;
+    }
+
+    // They go back in front of the queue, in the order they were published
+    QMap< quint64, InFlightMessage >::const_iterator i = queue.inFlight.constEnd();
+    while (i != queue.inFlight.constBegin()) {
+        --i;
+        queue.pending.prepend(i.value().message);
+    }
+
+    qCInfo(mqttTransportDC) << "Queueing again" << queue.inFlight.count() << "unconfirmed messages for" << c->rootClientTopic();
+    queue.inFlight.clear();
+    queue.inFlightSequences.clear();
+    trimPending(c);
+}
+
+void MQTTTransport::drainQueue(MQTTClientWrapper *c)
+{
+    if (c->status() != MQTTClientWrapper::ConnectedStatus) {
+        return;
+    }
+
+    ClientQueue &queue = m_queues[c];
+    while (!queue.pending.isEmpty() && queue.inFlight.count() < queue.inFlightWindow) {
+        CacheMessage cacheMessage = queue.pending.head();
+        MQTTClientWrapper::MQTTQoS qos = qosFor(cacheMessage);
+
+        int rc = c->publish(c->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), qos);
+        if (rc < 0) {
+            // Keep it for when the client is back in shape
+            qCWarning(mqttTransportDC) << "Could not publish on" << c->rootClientTopic() << ", keeping" << queue.pending.count() << "messages queued";
+            return;
+        }
+
+        queue.pending.dequeue();
+        InFlightMessage inFlight;
+        inFlight.message = cacheMessage;
+        inFlight.qos = qos;
+        inFlight.messageId = rc;
+        // A wrapped around id still in flight is stale: libmosquitto reused it, so it won't be confirmed
+        if (queue.inFlightSequences.contains(rc)) {
+            queue.inFlight.remove(queue.inFlightSequences.value(rc));
+        }
+        queue.inFlightSequences.insert(rc, queue.nextSequence);
+        queue.inFlight.insert(queue.nextSequence++, inFlight);
+    }
+}
 
 void MQTTTransport::bigBang()
 {
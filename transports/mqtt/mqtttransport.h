@@ -6,13 +6,20 @@
 #define HYPERDRIVE_MQTTTRANSPORT_H
 
 #include <hyperdriveremotetransport.h>
+#include <hyperdrivemqttclientwrapper.h>
 
+#include "mqtttopictrie.h"
+
+#include <cachemessage.h>
+
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QQueue>
 #include <QtCore/QSet>
+#include <QtCore/QVariantMap>
 
 namespace Hyperdrive {
 
-class MQTTClientWrapper;
-
 class MQTTTransport : public Hyperdrive::RemoteTransport
 {
     Q_OBJECT
@@ -26,6 +33,8 @@ public:
     virtual void cacheMessage(const CacheMessage& cacheMessage) override final;
     virtual void bigBang() override final;
 
+    virtual bool reloadConfiguration() override final;
+
 protected:
     virtual void initImpl() override final;
 
@@ -33,9 +42,46 @@ private Q_SLOTS:
     void setupClientSubscriptions(MQTTClientWrapper *client);
     void publishIntrospection();
     void publishIntrospectionForClient(MQTTClientWrapper *c);
+    void drainQueue(MQTTClientWrapper *c);
+    void rebuildConsumerTrie();
+    void onMessageReceived(MQTTClientWrapper *c, const QByteArray &topic, const QByteArray &payload);
 
 private:
+    // Kept until confirmed, so that it can be queued again if the broker session is lost
+    struct InFlightMessage {
+        CacheMessage message;
+        MQTTClientWrapper::MQTTQoS qos;
+        int messageId;
+    };
+    // Delivery state of each broker, so that one being down doesn't affect the others
+    struct ClientQueue {
+        QQueue< CacheMessage > pending;
+        // In publishing order: message ids wrap around, so they are mapped to a sequence number which doesn't
+        QMap< quint64, InFlightMessage > inFlight;
+        QHash< int, quint64 > inFlightSequences;
+        quint64 nextSequence;
+        int maximumPending;
+        int inFlightWindow;
+        quint64 droppedMessages;
+        qint64 lastDropWarning;
+    };
+
+    static MQTTClientWrapper::MQTTQoS qosFor(const CacheMessage &cacheMessage);
+    static QVariantMap sessionConfiguration(const QString &configurationPath);
+    MQTTClientWrapper *createClient(const QString &configurationPath);
+    void applyClientTunables(MQTTClientWrapper *c, const QString &configurationPath);
+    void removeClient(MQTTClientWrapper *c);
+    void enqueue(MQTTClientWrapper *c, const CacheMessage &cacheMessage);
+    void requeueInFlight(MQTTClientWrapper *c);
+    void trimPending(MQTTClientWrapper *c);
+
     QList< MQTTClientWrapper* > m_clients;
+    QHash< MQTTClientWrapper*, ClientQueue > m_queues;
+    // Which configuration file each client comes from, and the settings which need a new session to change
+    QHash< QString, MQTTClientWrapper* > m_configurationToClient;
+    QHash< MQTTClientWrapper*, QVariantMap > m_sessionConfigurations;
+    // Consumer interfaces, the only ones we accept inbound data for
+    MQTTTopicTrie m_consumerTrie;
 };
 }
 
@@ -0,0 +1,231 @@
+#include "astartecrypto.h"
+#include "astartecrypto_p.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QTemporaryDir>
+
+#include <QtTest/QSignalSpy>
+#include <QtTest/QTest>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <stdio.h>
+
+// Generates a keystore the way pairing does, through ThreadedKeyOperation, and checks what lands on disk.
+// Generation is timed once per algorithm, run with -median N to average it. Then the keystore goes through
+// mutual TLS handshakes, timed as well: OpenSSL on both ends, as libmosquitto does towards the broker.
+class TestAstarteCrypto : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void keyStore_data();
+    void keyStore();
+    void tlsHandshake_data();
+    void tlsHandshake();
+};
+
+// A certificate for the keystore, as if the CSR had been signed by itself
+static X509 *selfSignedCertificate(X509_REQ *csr, EVP_PKEY *privateKey)
+{
+    X509 *certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_get_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_get_notAfter(certificate), 3600);
+    X509_set_subject_name(certificate, X509_REQ_get_subject_name(csr));
+    X509_set_issuer_name(certificate, X509_REQ_get_subject_name(csr));
+    X509_set_pubkey(certificate, privateKey);
+
+    // Ed25519 has its digest built in
+    const EVP_MD *digest = EVP_sha256();
+#ifdef EVP_PKEY_ED25519
+    if (EVP_PKEY_base_id(privateKey) == EVP_PKEY_ED25519) {
+        digest = NULL;
+    }
+#endif
+    if (!X509_sign(certificate, privateKey, digest)) {
+        X509_free(certificate);
+        return NULL;
+    }
+    return certificate;
+}
+
+// Both ends present the same certificate, and trust it
+static SSL_CTX *newTlsContext(const SSL_METHOD *method, X509 *certificate, EVP_PKEY *privateKey)
+{
+    SSL_CTX *context = SSL_CTX_new(method);
+    if (!context) {
+        return NULL;
+    }
+    if (SSL_CTX_use_certificate(context, certificate) != 1 || SSL_CTX_use_PrivateKey(context, privateKey) != 1 ||
+        X509_STORE_add_cert(SSL_CTX_get_cert_store(context), certificate) != 1) {
+        SSL_CTX_free(context);
+        return NULL;
+    }
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+    return context;
+}
+
+// A full handshake over a BIO pair, so that sockets and the event loop stay out of the timing
+static bool runTlsHandshake(SSL_CTX *serverContext, SSL_CTX *clientContext)
+{
+    SSL *server = SSL_new(serverContext);
+    SSL *client = SSL_new(clientContext);
+    BIO *serverBio;
+    BIO *clientBio;
+    BIO_new_bio_pair(&serverBio, 0, &clientBio, 0);
+    SSL_set_bio(server, serverBio, serverBio);
+    SSL_set_bio(client, clientBio, clientBio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+
+    // Each round lets both ends consume what the other wrote
+    bool serverDone = false;
+    bool clientDone = false;
+    bool ok = true;
+    for (int round = 0; round < 16 && ok && !(serverDone && clientDone); ++round) {
+        if (!clientDone) {
+            int ret = SSL_do_handshake(client);
+            clientDone = ret == 1;
+            ok = clientDone || SSL_get_error(client, ret) == SSL_ERROR_WANT_READ;
+        }
+        if (ok && !serverDone) {
+            int ret = SSL_do_handshake(server);
+            serverDone = ret == 1;
+            ok = serverDone || SSL_get_error(server, ret) == SSL_ERROR_WANT_READ;
+        }
+    }
+
+    ok = ok && serverDone && clientDone &&
+         SSL_get_verify_result(server) == X509_V_OK && SSL_get_verify_result(client) == X509_V_OK;
+
+    SSL_free(client);
+    SSL_free(server);
+    return ok;
+}
+
+void TestAstarteCrypto::initTestCase()
+{
+    // Initializes OpenSSL, without touching the system keystore until init()
+    QVERIFY(Astarte::Crypto::instance());
+}
+
+void TestAstarteCrypto::keyStore_data()
+{
+    QTest::addColumn< int >("algorithm");
+    QTest::addColumn< int >("keyType");
+
+    QTest::newRow("RSA 2048") << static_cast<int>(Astarte::Crypto::RSA2048KeyAlgorithm) << EVP_PKEY_RSA;
+    QTest::newRow("ECDSA P-256") << static_cast<int>(Astarte::Crypto::ECDSAP256KeyAlgorithm) << EVP_PKEY_EC;
+#ifdef EVP_PKEY_ED25519
+    QTest::newRow("Ed25519") << static_cast<int>(Astarte::Crypto::Ed25519KeyAlgorithm) << EVP_PKEY_ED25519;
+#endif
+}
+
+void TestAstarteCrypto::keyStore()
+{
+    QFETCH(int, algorithm);
+    QFETCH(int, keyType);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString privateKeyFile = dir.filePath(QStringLiteral("astartekey.pem"));
+    QString publicKeyFile = dir.filePath(QStringLiteral("astartekey.pub"));
+    QString csrFile = dir.filePath(QStringLiteral("astartekey.csr"));
+
+    QBENCHMARK_ONCE {
+        Astarte::ThreadedKeyOperation *op = new Astarte::ThreadedKeyOperation(static_cast<Astarte::Crypto::KeyAlgorithm>(algorithm),
+                                                                              QStringLiteral("testdevice"), privateKeyFile,
+                                                                              publicKeyFile, csrFile, this);
+        QSignalSpy finishedSpy(op, &Hemera::Operation::finished);
+        QVERIFY(finishedSpy.wait(60000));
+        QVERIFY2(!op->isError(), qPrintable(op->errorMessage()));
+    }
+
+    FILE *file = fopen(QFile::encodeName(privateKeyFile).constData(), "r");
+    QVERIFY(file);
+    EVP_PKEY *privateKey = PEM_read_PrivateKey(file, NULL, NULL, NULL);
+    fclose(file);
+    QVERIFY(privateKey);
+    QCOMPARE(EVP_PKEY_base_id(privateKey), keyType);
+    EVP_PKEY_free(privateKey);
+
+    file = fopen(QFile::encodeName(publicKeyFile).constData(), "r");
+    QVERIFY(file);
+    EVP_PKEY *publicKey = PEM_read_PUBKEY(file, NULL, NULL, NULL);
+    fclose(file);
+    QVERIFY(publicKey);
+    QCOMPARE(EVP_PKEY_base_id(publicKey), keyType);
+
+    // The CSR must be signed by the key it carries
+    file = fopen(QFile::encodeName(csrFile).constData(), "r");
+    QVERIFY(file);
+    X509_REQ *csr = PEM_read_X509_REQ(file, NULL, NULL, NULL);
+    fclose(file);
+    QVERIFY(csr);
+    QCOMPARE(X509_REQ_verify(csr, publicKey), 1);
+    X509_REQ_free(csr);
+    EVP_PKEY_free(publicKey);
+}
+
+void TestAstarteCrypto::tlsHandshake_data()
+{
+    keyStore_data();
+}
+
+void TestAstarteCrypto::tlsHandshake()
+{
+    QFETCH(int, algorithm);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString privateKeyFile = dir.filePath(QStringLiteral("astartekey.pem"));
+    QString csrFile = dir.filePath(QStringLiteral("astartekey.csr"));
+
+    Astarte::ThreadedKeyOperation *op = new Astarte::ThreadedKeyOperation(static_cast<Astarte::Crypto::KeyAlgorithm>(algorithm),
+                                                                          QStringLiteral("testdevice"), privateKeyFile,
+                                                                          dir.filePath(QStringLiteral("astartekey.pub")), csrFile, this);
+    QSignalSpy finishedSpy(op, &Hemera::Operation::finished);
+    QVERIFY(finishedSpy.wait(60000));
+    QVERIFY2(!op->isError(), qPrintable(op->errorMessage()));
+
+    FILE *file = fopen(QFile::encodeName(privateKeyFile).constData(), "r");
+    QVERIFY(file);
+    EVP_PKEY *privateKey = PEM_read_PrivateKey(file, NULL, NULL, NULL);
+    fclose(file);
+    QVERIFY(privateKey);
+
+    file = fopen(QFile::encodeName(csrFile).constData(), "r");
+    QVERIFY(file);
+    X509_REQ *csr = PEM_read_X509_REQ(file, NULL, NULL, NULL);
+    fclose(file);
+    QVERIFY(csr);
+
+    X509 *certificate = selfSignedCertificate(csr, privateKey);
+    X509_REQ_free(csr);
+    QVERIFY(certificate);
+
+    SSL_CTX *serverContext = newTlsContext(TLS_server_method(), certificate, privateKey);
+    SSL_CTX *clientContext = newTlsContext(TLS_client_method(), certificate, privateKey);
+    X509_free(certificate);
+    EVP_PKEY_free(privateKey);
+    QVERIFY(serverContext);
+    QVERIFY(clientContext);
+
+    // No session is kept, every iteration pays for the signatures of both ends
+    QBENCHMARK {
+        QVERIFY(runTlsHandshake(serverContext, clientContext));
+    }
+
+    SSL_CTX_free(clientContext);
+    SSL_CTX_free(serverContext);
+}
+
+QTEST_GUILESS_MAIN(TestAstarteCrypto)
+
+#include "testastartecrypto.moc"
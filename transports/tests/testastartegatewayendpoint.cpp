@@ -0,0 +1,84 @@
+#include "astartegatewayendpoint.h"
+
+#include <QtCore/QTemporaryDir>
+
+#include <QtNetwork/QLocalServer>
+
+#include <QtTest/QSignalSpy>
+#include <QtTest/QTest>
+
+// Which broker address GatewayEndpoint picks for a gateway on this board or elsewhere
+class TestAstarteGatewayEndpoint : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void brokerUrl_data();
+    void brokerUrl();
+};
+
+void TestAstarteGatewayEndpoint::brokerUrl_data()
+{
+    QTest::addColumn< QUrl >("gateway");
+    QTest::addColumn< bool >("alwaysUse");
+    QTest::addColumn< bool >("socketExists");
+    QTest::addColumn< bool >("expectSocket");
+
+    // Detection: the socket is used only for a gateway on this board
+    QTest::newRow("localhost") << QUrl(QStringLiteral("tcp://localhost")) << false << true << true;
+    QTest::newRow("127.0.0.1") << QUrl(QStringLiteral("tcp://127.0.0.1")) << false << true << true;
+    QTest::newRow("::1") << QUrl(QStringLiteral("tcp://[::1]")) << false << true << true;
+    QTest::newRow("localhost without socket") << QUrl(QStringLiteral("tcp://localhost")) << false << false << false;
+    QTest::newRow("remote") << QUrl(QStringLiteral("tcp://192.0.2.1")) << false << true << false;
+
+    // Configured: the socket is used whatever the host, as long as it exists
+    QTest::newRow("remote, configured") << QUrl(QStringLiteral("tcp://192.0.2.1")) << true << true << true;
+    QTest::newRow("127.0.0.1, configured without socket") << QUrl(QStringLiteral("tcp://127.0.0.1")) << true << false << false;
+}
+
+void TestAstarteGatewayEndpoint::brokerUrl()
+{
+    QFETCH(QUrl, gateway);
+    QFETCH(bool, alwaysUse);
+    QFETCH(bool, socketExists);
+    QFETCH(bool, expectSocket);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString socketPath = dir.filePath(QStringLiteral("mqtt.sock"));
+
+    QLocalServer server;
+    if (socketExists) {
+        QVERIFY(server.listen(socketPath));
+    }
+
+    // Our socket stands in for the system gateway's one
+    Astarte::GatewayEndpoint endpoint(gateway);
+    endpoint.setLocalSocketPath(socketPath, alwaysUse);
+
+    Hemera::Operation *op = endpoint.init();
+    QSignalSpy finishedSpy(op, &Hemera::Operation::finished);
+    QVERIFY(finishedSpy.wait(5000));
+    QVERIFY(!op->isError());
+
+    QUrl broker = endpoint.mqttBrokerUrl();
+
+#ifdef HAVE_MOSQUITTO_UNIX_SOCKETS
+    if (expectSocket) {
+        QCOMPARE(broker.scheme(), QStringLiteral("unix"));
+        QCOMPARE(broker.path(), socketPath);
+        return;
+    }
+#else
+    Q_UNUSED(expectSocket)
+#endif
+
+    // Older libmosquitto can't use the socket at all
+    QCOMPARE(broker.scheme(), QStringLiteral("tcp"));
+    QCOMPARE(broker.host(), gateway.host());
+    QCOMPARE(broker.port(), 1885);
+}
+
+QTEST_GUILESS_MAIN(TestAstarteGatewayEndpoint)
+
+#include "testastartegatewayendpoint.moc"
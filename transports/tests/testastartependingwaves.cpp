@@ -0,0 +1,126 @@
+#include "astarte/astartependingwaves.h"
+
+#include <QtTest/QTest>
+
+// Inbound waves waiting for their rebound: what gets orphaned, and when
+class TestAstartePendingWaves : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void insertAndTake();
+    void insertAgain();
+    void capacity();
+    void expiry();
+};
+
+// Collects the ids of the orphaned waves, in the order they were dropped
+static void recordOrphans(AstartePendingWaves *pendingWaves, QList< quint64 > *orphans)
+{
+    QObject::connect(pendingWaves, &AstartePendingWaves::waveOrphaned, pendingWaves, [orphans] (const Hyperspace::Wave &wave) {
+        orphans->append(wave.id());
+    });
+}
+
+void TestAstartePendingWaves::insertAndTake()
+{
+    AstartePendingWaves pendingWaves;
+    Hyperspace::Wave wave;
+    pendingWaves.insert(wave, "command");
+    QCOMPARE(pendingWaves.count(), 1);
+
+    Hyperspace::Wave taken;
+    QByteArray commandId;
+    QVERIFY(pendingWaves.take(wave.id(), &taken, &commandId));
+    QCOMPARE(taken.id(), wave.id());
+    QCOMPARE(commandId, QByteArray("command"));
+    QCOMPARE(pendingWaves.count(), 0);
+
+    // A rebound comes once
+    QVERIFY(!pendingWaves.take(wave.id(), &taken, &commandId));
+    QCOMPARE(pendingWaves.orphanedWaves(), Q_UINT64_C(0));
+}
+
+void TestAstartePendingWaves::insertAgain()
+{
+    QList< quint64 > orphans;
+    AstartePendingWaves pendingWaves;
+    pendingWaves.setCapacity(1);
+    recordOrphans(&pendingWaves, &orphans);
+
+    // The same wave sent again replaces the pending one, and makes nothing else an orphan
+    Hyperspace::Wave wave;
+    pendingWaves.insert(wave, "first");
+    pendingWaves.insert(wave, "second");
+    QCOMPARE(pendingWaves.count(), 1);
+    QVERIFY(orphans.isEmpty());
+
+    Hyperspace::Wave taken;
+    QByteArray commandId;
+    QVERIFY(pendingWaves.take(wave.id(), &taken, &commandId));
+    QCOMPARE(commandId, QByteArray("second"));
+
+    // Nothing of the replaced entry stays behind to be evicted
+    pendingWaves.insert(Hyperspace::Wave());
+    QCOMPARE(pendingWaves.count(), 1);
+    QVERIFY(orphans.isEmpty());
+}
+
+void TestAstartePendingWaves::capacity()
+{
+    QList< quint64 > orphans;
+    AstartePendingWaves pendingWaves;
+    pendingWaves.setCapacity(2);
+    recordOrphans(&pendingWaves, &orphans);
+
+    // The second wave expires first, even though it came later
+    Hyperspace::Wave longLived;
+    pendingWaves.setTimeout(60000);
+    pendingWaves.insert(longLived);
+    Hyperspace::Wave shortLived;
+    pendingWaves.setTimeout(1000);
+    pendingWaves.insert(shortLived);
+
+    Hyperspace::Wave third;
+    pendingWaves.insert(third);
+
+    QCOMPARE(pendingWaves.count(), 2);
+    QCOMPARE(pendingWaves.orphanedWaves(), Q_UINT64_C(1));
+    QCOMPARE(orphans.size(), 1);
+    QCOMPARE(orphans.first(), shortLived.id());
+
+    Hyperspace::Wave taken;
+    QByteArray commandId;
+    QVERIFY(pendingWaves.take(longLived.id(), &taken, &commandId));
+    QVERIFY(pendingWaves.take(third.id(), &taken, &commandId));
+}
+
+void TestAstartePendingWaves::expiry()
+{
+    QList< quint64 > orphans;
+    AstartePendingWaves pendingWaves;
+    recordOrphans(&pendingWaves, &orphans);
+
+    Hyperspace::Wave shortLived;
+    pendingWaves.setTimeout(1000);
+    pendingWaves.insert(shortLived, "short");
+    Hyperspace::Wave longLived;
+    pendingWaves.setTimeout(60000);
+    pendingWaves.insert(longLived, "long");
+
+    // Expired waves are looked for every few seconds
+    QTRY_COMPARE_WITH_TIMEOUT(orphans.size(), 1, 10000);
+    QCOMPARE(orphans.first(), shortLived.id());
+    QCOMPARE(pendingWaves.orphanedWaves(), Q_UINT64_C(1));
+    QCOMPARE(pendingWaves.count(), 1);
+
+    Hyperspace::Wave taken;
+    QByteArray commandId;
+    QVERIFY(!pendingWaves.take(shortLived.id(), &taken, &commandId));
+    QVERIFY(pendingWaves.take(longLived.id(), &taken, &commandId));
+    QCOMPARE(commandId, QByteArray("long"));
+}
+
+QTEST_GUILESS_MAIN(TestAstartePendingWaves)
+
+#include "testastartependingwaves.moc"
@@ -0,0 +1,129 @@
+#include "astarte/astartetransportcache.h"
+
+#include <transportdatabasemanager.h>
+
+#include <HemeraCore/Operation>
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QTemporaryDir>
+
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlQuery>
+
+#include <QtTest/QSignalSpy>
+#include <QtTest/QTest>
+
+#define TARGET_A "/com.example.Properties/a"
+#define TARGET_B "/com.example.Properties/b"
+
+using namespace Hyperdrive::TransportDatabaseManager;
+
+// Persistent entries are kept as content hashes. The database starts at the schema where they held whole
+// payloads, and is migrated the way an upgraded device would be.
+class TestAstarteTransportCache : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void legacyEntries();
+    void changeDetection();
+    void syncedEntries();
+
+private:
+    QTemporaryDir m_dir;
+};
+
+void TestAstarteTransportCache::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+    QString dbPath = m_dir.filePath(QStringLiteral("persistence.db"));
+
+    // The schema before hashing: only the first two migrations
+    QDir legacyMigrations(m_dir.path());
+    QVERIFY(legacyMigrations.mkdir(QStringLiteral("legacy-migrations")));
+    QVERIFY(legacyMigrations.cd(QStringLiteral("legacy-migrations")));
+    QDir migrations(QStringLiteral(ASTARTE_MIGRATIONS_DIR));
+    for (const QString &migration : migrations.entryList(QStringList{QStringLiteral("00[12]_*.sql")}, QDir::Files)) {
+        QVERIFY(QFile::copy(migrations.filePath(migration), legacyMigrations.filePath(migration)));
+    }
+
+    QVERIFY(ensureDatabase(dbPath, legacyMigrations.path()));
+    {
+        QSqlQuery query;
+        QVERIFY(query.exec(QStringLiteral("INSERT INTO persistent_entries (target, payload) VALUES ('" TARGET_A "', 'payload a')")));
+        QVERIFY(query.exec(QStringLiteral("INSERT INTO persistent_entries (target, payload) VALUES ('" TARGET_B "', 'payload b')")));
+    }
+    QSqlDatabase::database().close();
+    QSqlDatabase::removeDatabase(QLatin1String(QSqlDatabase::defaultConnection));
+
+    // What the cache opens from now on is the migrated database
+    QVERIFY(ensureDatabase(dbPath, migrations.path()));
+
+    Hemera::Operation *op = AstarteTransportCache::instance()->init();
+    QSignalSpy finishedSpy(op, &Hemera::Operation::finished);
+    QVERIFY(finishedSpy.wait(5000));
+    QVERIFY(!op->isError());
+}
+
+void TestAstarteTransportCache::legacyEntries()
+{
+    AstarteTransportCache *cache = AstarteTransportCache::instance();
+
+    QCOMPARE(cache->persistentTargets().size(), 2);
+    QVERIFY(cache->isEntryUnchanged(TARGET_A, "payload a"));
+    QVERIFY(cache->isEntryUnchanged(TARGET_B, "payload b"));
+    QVERIFY(!cache->isEntryUnchanged(TARGET_A, "payload b"));
+
+    // Payloads left the database, their hashes took their place
+    QVERIFY(!QSqlDatabase::database().tables().contains(QStringLiteral("legacy_persistent_entries")));
+    QHash< QByteArray, QByteArray > stored = Transactions::allPersistentEntries();
+    QCOMPARE(stored.size(), 2);
+    QCOMPARE(stored.value(TARGET_A), AstarteTransportCache::contentHash("payload a"));
+    QCOMPARE(stored.value(TARGET_A).size(), 16);
+}
+
+void TestAstarteTransportCache::changeDetection()
+{
+    AstarteTransportCache *cache = AstarteTransportCache::instance();
+
+    cache->insertOrUpdatePersistentEntry(TARGET_A, "new payload a");
+    QVERIFY(cache->isEntryUnchanged(TARGET_A, "new payload a"));
+    QVERIFY(!cache->isEntryUnchanged(TARGET_A, "payload a"));
+    QCOMPARE(Transactions::allPersistentEntries().value(TARGET_A), AstarteTransportCache::contentHash("new payload a"));
+
+    cache->removePersistentEntry(TARGET_B);
+    QVERIFY(!cache->isCached(TARGET_B));
+    QVERIFY(!cache->isEntryUnchanged(TARGET_B, "payload b"));
+    QVERIFY(!Transactions::allPersistentEntries().contains(TARGET_B));
+
+    // Empty payloads are values too, and differ from a missing entry
+    QVERIFY(!cache->isEntryUnchanged(TARGET_B, QByteArray()));
+    cache->insertOrUpdatePersistentEntry(TARGET_B, QByteArray());
+    QVERIFY(cache->isEntryUnchanged(TARGET_B, QByteArray()));
+}
+
+void TestAstarteTransportCache::syncedEntries()
+{
+    AstarteTransportCache *cache = AstarteTransportCache::instance();
+    cache->resetSyncedEntries();
+
+    // Synced means the broker confirmed the payload the entry holds now
+    cache->insertOrUpdatePersistentEntry(TARGET_A, "synced");
+    cache->markEntrySynced(TARGET_A, "synced");
+    QVERIFY(cache->isEntrySynced(TARGET_A));
+    QVERIFY(cache->hasSyncedEntries());
+    QCOMPARE(Transactions::allSyncedHashes().value(TARGET_A), AstarteTransportCache::contentHash("synced"));
+
+    cache->insertOrUpdatePersistentEntry(TARGET_A, "changed since");
+    QVERIFY(!cache->isEntrySynced(TARGET_A));
+
+    cache->resetSyncedEntries();
+    QVERIFY(!cache->hasSyncedEntries());
+    QVERIFY(Transactions::allSyncedHashes().isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TestAstarteTransportCache)
+
+#include "testastartetransportcache.moc"
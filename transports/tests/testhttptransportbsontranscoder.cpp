@@ -0,0 +1,227 @@
+#include "http/httptransportbsontranscoder.h"
+
+#include <QtTest/QTest>
+
+#define BSON_DOUBLE 0x01
+#define BSON_STRING 0x02
+#define BSON_DOCUMENT 0x03
+#define BSON_ARRAY 0x04
+#define BSON_BINARY 0x05
+#define BSON_BOOLEAN 0x08
+#define BSON_DATETIME 0x09
+#define BSON_NULL 0x0A
+#define BSON_INT32 0x10
+#define BSON_INT64 0x12
+
+// HTTP bodies to BSON and back, and what happens to bodies and documents which are not well formed
+class TestHTTPTransportBSONTranscoder : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void jsonRoundTrip_data();
+    void jsonRoundTrip();
+    void malformedJson_data();
+    void malformedJson();
+    void nestingLimit();
+    void textBodies_data();
+    void textBodies();
+    void binaryBody();
+    void truncatedBson();
+    void malformedBson_data();
+    void malformedBson();
+};
+
+// The type of the first element of a document
+static int valueType(const QByteArray &bson)
+{
+    return bson.size() > 4 ? static_cast<uchar>(bson.at(4)) : -1;
+}
+
+void TestHTTPTransportBSONTranscoder::jsonRoundTrip_data()
+{
+    QTest::addColumn< QByteArray >("json");
+    QTest::addColumn< QByteArray >("expected");
+    QTest::addColumn< int >("type");
+
+    // Aggregates
+    QTest::newRow("nested document") << QByteArray(R"({"v": {"a": [1, [2, {"b": null}], "x"], "c": {"d": true}}})")
+                                     << QByteArray(R"({"a":[1,[2,{"b":null}],"x"],"c":{"d":true}})") << BSON_DOCUMENT;
+    QTest::newRow("bare array") << QByteArray("[ 1 ,2,\n3 ]") << QByteArray("[1,2,3]") << BSON_ARRAY;
+    QTest::newRow("empty document") << QByteArray(R"({"v": {}})") << QByteArray("{}") << BSON_DOCUMENT;
+    QTest::newRow("empty array") << QByteArray("[]") << QByteArray("[]") << BSON_ARRAY;
+    QTest::newRow("value key") << QByteArray(R"({"value": false})") << QByteArray("false") << BSON_BOOLEAN;
+    QTest::newRow("v wins over value") << QByteArray(R"({"value": 1, "v": "x", "other": [1]})") << QByteArray(R"("x")") << BSON_STRING;
+    QTest::newRow("null") << QByteArray("null") << QByteArray("null") << BSON_NULL;
+
+    // Strings
+    QTest::newRow("escapes") << QByteArray(R"("a\"b\\c\/d\b\f\n\r\t")") << QByteArray(R"("a\"b\\c/d\b\f\n\r\t")") << BSON_STRING;
+    QTest::newRow("control character") << QByteArray(R"("\u0001")") << QByteArray(R"("\u0001")") << BSON_STRING;
+    QTest::newRow("two bytes") << QByteArray(R"("\u00e9")") << QByteArray("\"\xc3\xa9\"") << BSON_STRING;
+    QTest::newRow("three bytes") << QByteArray(R"("\u20ac")") << QByteArray("\"\xe2\x82\xac\"") << BSON_STRING;
+    QTest::newRow("surrogate pair") << QByteArray(R"("\ud83d\ude00")") << QByteArray("\"\xf0\x9f\x98\x80\"") << BSON_STRING;
+    QTest::newRow("raw utf-8") << QByteArray("\"\xf0\x9f\x98\x80\"") << QByteArray("\"\xf0\x9f\x98\x80\"") << BSON_STRING;
+    QTest::newRow("date") << QByteArray(R"("2020-01-02T03:04:05.678Z")") << QByteArray(R"("2020-01-02T03:04:05.678Z")") << BSON_DATETIME;
+    QTest::newRow("not a date") << QByteArray(R"("2020-01-02 is a date")") << QByteArray(R"("2020-01-02 is a date")") << BSON_STRING;
+
+    // Integer boundaries
+    QTest::newRow("int32 max") << QByteArray("2147483647") << QByteArray("2147483647") << BSON_INT32;
+    QTest::newRow("int32 min") << QByteArray("-2147483648") << QByteArray("-2147483648") << BSON_INT32;
+    QTest::newRow("int32 max + 1") << QByteArray("2147483648") << QByteArray("2147483648") << BSON_INT64;
+    QTest::newRow("int32 min - 1") << QByteArray("-2147483649") << QByteArray("-2147483649") << BSON_INT64;
+    QTest::newRow("int64 max") << QByteArray("9223372036854775807") << QByteArray("9223372036854775807") << BSON_INT64;
+    QTest::newRow("int64 min") << QByteArray("-9223372036854775808") << QByteArray("-9223372036854775808") << BSON_INT64;
+    QTest::newRow("int64 max + 1") << QByteArray("9223372036854775808") << QByteArray("9.2233720368547758e+18") << BSON_DOUBLE;
+
+    // Integral values narrow to Int32, as QJsonDocument did
+    QTest::newRow("integral fraction") << QByteArray("2.0") << QByteArray("2") << BSON_INT32;
+    QTest::newRow("integral exponent") << QByteArray("1e3") << QByteArray("1000") << BSON_INT32;
+    QTest::newRow("fraction") << QByteArray("-2.5") << QByteArray("-2.5") << BSON_DOUBLE;
+    QTest::newRow("integral beyond int32") << QByteArray("3e9") << QByteArray("3000000000") << BSON_DOUBLE;
+}
+
+void TestHTTPTransportBSONTranscoder::jsonRoundTrip()
+{
+    QFETCH(QByteArray, json);
+    QFETCH(QByteArray, expected);
+    QFETCH(int, type);
+
+    QByteArray bson = HTTPTransportBSONTranscoder::jsonToBSON(json);
+    QVERIFY(!bson.isEmpty());
+    QCOMPARE(valueType(bson), type);
+
+    QCOMPARE(HTTPTransportBSONTranscoder::bsonValueToJSON(bson, "v"), expected);
+    QCOMPARE(HTTPTransportBSONTranscoder::bsonToJSON(bson), QByteArray("{\"v\":" + expected + '}'));
+    QVERIFY(HTTPTransportBSONTranscoder::bsonValueToJSON(bson, "w").isEmpty());
+}
+
+void TestHTTPTransportBSONTranscoder::malformedJson_data()
+{
+    QTest::addColumn< QByteArray >("json");
+
+    QTest::newRow("empty") << QByteArray();
+    QTest::newRow("whitespace") << QByteArray(" \n");
+    QTest::newRow("no value") << QByteArray(R"({"a": 1})");
+    QTest::newRow("trailing garbage") << QByteArray(R"({"v": 1} x)");
+    QTest::newRow("unterminated document") << QByteArray(R"({"v": {"a": 1})");
+    QTest::newRow("unterminated array") << QByteArray(R"({"v": [1, 2})");
+    QTest::newRow("trailing comma") << QByteArray("[1,]");
+    QTest::newRow("missing colon") << QByteArray(R"({"v" 1})");
+    QTest::newRow("unquoted key") << QByteArray("{v: 1}");
+    QTest::newRow("truncated string") << QByteArray(R"({"v": "abc)");
+    QTest::newRow("truncated escape") << QByteArray(R"("abc\)");
+    QTest::newRow("truncated literal") << QByteArray("tru");
+    QTest::newRow("unknown escape") << QByteArray(R"("\q")");
+    QTest::newRow("raw control character") << QByteArray("\"a\x01" "b\"");
+    QTest::newRow("short unicode escape") << QByteArray(R"("\u12")");
+    QTest::newRow("bad hex digits") << QByteArray(R"("\uzzzz")");
+    QTest::newRow("signed hex digits") << QByteArray(R"("\u+fff")");
+    QTest::newRow("lone high surrogate") << QByteArray(R"("\ud83d")");
+    QTest::newRow("high surrogate and character") << QByteArray(R"("\ud83dA")");
+    QTest::newRow("lone low surrogate") << QByteArray(R"("\ude00")");
+    QTest::newRow("nul in key") << QByteArray(R"({"v": {"a\u0000b": 1}})");
+    QTest::newRow("lone minus") << QByteArray("-");
+    QTest::newRow("two dots") << QByteArray("1.2.3");
+    QTest::newRow("dangling exponent") << QByteArray("1e");
+}
+
+void TestHTTPTransportBSONTranscoder::malformedJson()
+{
+    QFETCH(QByteArray, json);
+
+    QVERIFY(HTTPTransportBSONTranscoder::jsonToBSON(json).isEmpty());
+}
+
+void TestHTTPTransportBSONTranscoder::nestingLimit()
+{
+    // 64 levels are fine, one more is refused rather than recursing further
+    QByteArray deepest = QByteArray(64, '[') + QByteArray(64, ']');
+    QByteArray bson = HTTPTransportBSONTranscoder::jsonToBSON(deepest);
+    QVERIFY(!bson.isEmpty());
+    QCOMPARE(HTTPTransportBSONTranscoder::bsonValueToJSON(bson, "v"), deepest);
+
+    QVERIFY(HTTPTransportBSONTranscoder::jsonToBSON(QByteArray(65, '[') + QByteArray(65, ']')).isEmpty());
+}
+
+void TestHTTPTransportBSONTranscoder::textBodies_data()
+{
+    QTest::addColumn< QByteArray >("text");
+    QTest::addColumn< QByteArray >("expected");
+    QTest::addColumn< int >("type");
+
+    QTest::newRow("boolean") << QByteArray("true") << QByteArray("true") << BSON_BOOLEAN;
+    QTest::newRow("integer") << QByteArray("-42") << QByteArray("-42") << BSON_INT32;
+    QTest::newRow("int64") << QByteArray("3000000000") << QByteArray("3000000000") << BSON_INT64;
+    // Unlike JSON bodies, text never narrowed a fraction
+    QTest::newRow("integral fraction") << QByteArray("2.0") << QByteArray("2") << BSON_DOUBLE;
+    QTest::newRow("date") << QByteArray("2020-01-02T03:04:05.678Z") << QByteArray(R"("2020-01-02T03:04:05.678Z")") << BSON_DATETIME;
+    QTest::newRow("not a number") << QByteArray("1-2") << QByteArray(R"("1-2")") << BSON_STRING;
+    QTest::newRow("latin-1") << QByteArray("caf\xe9") << QByteArray("\"caf\xc3\xa9\"") << BSON_STRING;
+    QTest::newRow("quotes") << QByteArray(R"(say "hi")") << QByteArray(R"("say \"hi\"")") << BSON_STRING;
+}
+
+void TestHTTPTransportBSONTranscoder::textBodies()
+{
+    QFETCH(QByteArray, text);
+    QFETCH(QByteArray, expected);
+    QFETCH(int, type);
+
+    QByteArray bson = HTTPTransportBSONTranscoder::textToBSON(text);
+    QCOMPARE(valueType(bson), type);
+    QCOMPARE(HTTPTransportBSONTranscoder::bsonValueToJSON(bson, "v"), expected);
+}
+
+void TestHTTPTransportBSONTranscoder::binaryBody()
+{
+    QByteArray bson = HTTPTransportBSONTranscoder::binaryToBSON(QByteArray("\x00\xff", 2));
+    QCOMPARE(valueType(bson), BSON_BINARY);
+    QCOMPARE(HTTPTransportBSONTranscoder::bsonValueToJSON(bson, "v"), QByteArray(R"("AP8=")"));
+}
+
+void TestHTTPTransportBSONTranscoder::truncatedBson()
+{
+    QByteArray bson = HTTPTransportBSONTranscoder::jsonToBSON(R"({"v": {"a": [1, 2.5, "x", 3000000000], "b": {"c": null}}})");
+    QVERIFY(!bson.isEmpty());
+
+    // Every prefix is refused, without reading past its end
+    for (int size = 0; size < bson.size(); ++size) {
+        QByteArray truncated = bson.left(size);
+        QVERIFY2(HTTPTransportBSONTranscoder::bsonToJSON(truncated).isEmpty(), qPrintable(QString::number(size)));
+        QVERIFY2(HTTPTransportBSONTranscoder::bsonValueToJSON(truncated, "v").isEmpty(), qPrintable(QString::number(size)));
+    }
+}
+
+void TestHTTPTransportBSONTranscoder::malformedBson_data()
+{
+    QTest::addColumn< int >("offset");
+    QTest::addColumn< char >("byte");
+
+    // {"v": "ab"}: document size, type, "v", string size, "ab", document terminator
+    QTest::newRow("document size below minimum") << 0 << '\x04';
+    QTest::newRow("document size past the end") << 0 << '\x7f';
+    QTest::newRow("unknown type") << 4 << '\x7f';
+    QTest::newRow("name not terminated") << 6 << 'w';
+    QTest::newRow("empty string size") << 7 << '\x00';
+    QTest::newRow("string size past the end") << 7 << '\x64';
+    QTest::newRow("negative string size") << 10 << '\x80';
+    QTest::newRow("string not terminated") << 13 << 'c';
+    QTest::newRow("document not terminated") << 14 << 'x';
+}
+
+void TestHTTPTransportBSONTranscoder::malformedBson()
+{
+    QFETCH(int, offset);
+    QFETCH(char, byte);
+
+    QByteArray bson = HTTPTransportBSONTranscoder::jsonToBSON(R"("ab")");
+    QCOMPARE(bson.size(), 15);
+    QCOMPARE(HTTPTransportBSONTranscoder::bsonToJSON(bson), QByteArray(R"({"v":"ab"})"));
+
+    bson[offset] = byte;
+    QVERIFY(HTTPTransportBSONTranscoder::bsonToJSON(bson).isEmpty());
+    QVERIFY(HTTPTransportBSONTranscoder::bsonValueToJSON(bson, "v").isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TestHTTPTransportBSONTranscoder)
+
+#include "testhttptransportbsontranscoder.moc"
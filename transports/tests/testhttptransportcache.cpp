@@ -0,0 +1,161 @@
+#include "http/httptransportcache.h"
+
+#include <QtCore/QJsonObject>
+
+#include <QtTest/QTest>
+
+// Prefix lookups, trees and their tags, on the cache which serves GETs on properties
+class TestHTTPTransportCache : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void hasTree_data();
+    void hasTree();
+    void tree();
+    void invalidation();
+    void removal();
+    void benchmarkTree_data();
+    void benchmarkTree();
+};
+
+void TestHTTPTransportCache::initTestCase()
+{
+    HTTPTransportCache *cache = HTTPTransportCache::instance();
+    cache->insertOrUpdatePersistentEntry("/com.example.Props/a/x", "1");
+    cache->insertOrUpdatePersistentEntry("/com.example.Props/a/y", "2");
+    cache->insertOrUpdatePersistentEntry("/com.example.Props/b", "3");
+    // Siblings sharing a prefix with the interface above, but not a path
+    cache->insertOrUpdatePersistentEntry("/com.example.Props2/c", "4");
+    cache->insertOrUpdatePersistentEntry("/com.example.Prop/d", "5");
+    cache->insertOrUpdatePersistentEntry("/com.example.Props.v2/e", "6");
+}
+
+void TestHTTPTransportCache::hasTree_data()
+{
+    QTest::addColumn< QByteArray >("target");
+    QTest::addColumn< bool >("expected");
+
+    QTest::newRow("interface") << QByteArray("/com.example.Props") << true;
+    QTest::newRow("trailing slash") << QByteArray("/com.example.Props/") << true;
+    QTest::newRow("subtree") << QByteArray("/com.example.Props/a") << true;
+    QTest::newRow("leaf") << QByteArray("/com.example.Props/a/x") << false;
+    QTest::newRow("not at a path boundary") << QByteArray("/com.example.Pro") << false;
+    QTest::newRow("unknown") << QByteArray("/com.example.Unknown") << false;
+}
+
+void TestHTTPTransportCache::hasTree()
+{
+    QFETCH(QByteArray, target);
+    QFETCH(bool, expected);
+
+    QCOMPARE(HTTPTransportCache::instance()->hasTree(target), expected);
+}
+
+void TestHTTPTransportCache::tree()
+{
+    HTTPTransportCache *cache = HTTPTransportCache::instance();
+
+    // Only the entries below the target, nested by path
+    QJsonDocument expected = QJsonDocument::fromJson(R"({"a": {"x": "1", "y": "2"}, "b": "3"})");
+    QCOMPARE(cache->tree("/com.example.Props"), expected);
+    QCOMPARE(cache->renderedTree("/com.example.Props"), expected.toJson(QJsonDocument::Compact));
+    QCOMPARE(cache->tree("/com.example.Props/a"), QJsonDocument::fromJson(R"({"x": "1", "y": "2"})"));
+    QCOMPARE(cache->tree("/com.example.Props2"), QJsonDocument::fromJson(R"({"c": "4"})"));
+}
+
+void TestHTTPTransportCache::invalidation()
+{
+    HTTPTransportCache *cache = HTTPTransportCache::instance();
+
+    QByteArray rendered = cache->renderedTree("/com.example.Props");
+    QByteArray treeTag = cache->treeTag("/com.example.Props");
+    QByteArray subtreeTag = cache->treeTag("/com.example.Props/a");
+    QByteArray entryTag = cache->entryTag("/com.example.Props/a/x");
+
+    // The same payload again changes nothing
+    cache->insertOrUpdatePersistentEntry("/com.example.Props/a/x", "1");
+    QCOMPARE(cache->treeTag("/com.example.Props"), treeTag);
+    QCOMPARE(cache->entryTag("/com.example.Props/a/x"), entryTag);
+
+    // Neither does a change in a sibling interface
+    cache->insertOrUpdatePersistentEntry("/com.example.Props2/c", "40");
+    cache->insertOrUpdatePersistentEntry("/com.example.Props.v2/e", "60");
+    QCOMPARE(cache->treeTag("/com.example.Props"), treeTag);
+    QCOMPARE(cache->renderedTree("/com.example.Props"), rendered);
+
+    // A change below the target renders it again, and changes the tags of every tree holding it
+    cache->insertOrUpdatePersistentEntry("/com.example.Props/a/x", "10");
+    QVERIFY(cache->treeTag("/com.example.Props") != treeTag);
+    QVERIFY(cache->treeTag("/com.example.Props/a") != subtreeTag);
+    QVERIFY(cache->entryTag("/com.example.Props/a/x") != entryTag);
+    QCOMPARE(cache->renderedTree("/com.example.Props"),
+             QJsonDocument::fromJson(R"({"a": {"x": "10", "y": "2"}, "b": "3"})").toJson(QJsonDocument::Compact));
+
+    // But not the tags of the trees beside it
+    QByteArray siblingTag = cache->entryTag("/com.example.Props/b");
+    cache->insertOrUpdatePersistentEntry("/com.example.Props/a/y", "20");
+    QCOMPARE(cache->entryTag("/com.example.Props/b"), siblingTag);
+}
+
+void TestHTTPTransportCache::removal()
+{
+    HTTPTransportCache *cache = HTTPTransportCache::instance();
+
+    QByteArray treeTag = cache->treeTag("/com.example.Props");
+    cache->removePersistentEntry("/com.example.Props/b");
+    QVERIFY(!cache->isCached("/com.example.Props/b"));
+    QVERIFY(cache->treeTag("/com.example.Props") != treeTag);
+    QCOMPARE(cache->renderedTree("/com.example.Props"),
+             QJsonDocument::fromJson(R"({"a": {"x": "10", "y": "20"}})").toJson(QJsonDocument::Compact));
+
+    // Removing what isn't there is not a change
+    treeTag = cache->treeTag("/com.example.Props");
+    cache->removePersistentEntry("/com.example.Props/b");
+    QCOMPARE(cache->treeTag("/com.example.Props"), treeTag);
+
+    cache->removePersistentEntry("/com.example.Props/a/x");
+    cache->removePersistentEntry("/com.example.Props/a/y");
+    QVERIFY(!cache->hasTree("/com.example.Props"));
+    QCOMPARE(cache->renderedTree("/com.example.Props"), QByteArray("{}"));
+}
+
+void TestHTTPTransportCache::benchmarkTree_data()
+{
+    QTest::addColumn< bool >("rendered");
+
+    QTest::newRow("tree") << false;
+    QTest::newRow("rendered tree") << true;
+}
+
+void TestHTTPTransportCache::benchmarkTree()
+{
+    QFETCH(bool, rendered);
+
+    // A large device: a GET on one interface root must not pay for all the others
+    HTTPTransportCache *cache = HTTPTransportCache::instance();
+    for (int i = 0; i < 50; ++i) {
+        QByteArray interface = "/com.example.bench.Interface" + QByteArray::number(i);
+        for (int j = 0; j < 200; ++j) {
+            cache->insertOrUpdatePersistentEntry(interface + "/group" + QByteArray::number(j % 10) + "/value" + QByteArray::number(j),
+                                                 QByteArray::number(j));
+        }
+    }
+
+    const QByteArray target("/com.example.bench.Interface25");
+    if (rendered) {
+        QBENCHMARK {
+            cache->renderedTree(target);
+        }
+    } else {
+        QBENCHMARK {
+            cache->tree(target);
+        }
+    }
+    QCOMPARE(cache->tree(target).object().size(), 10);
+}
+
+QTEST_GUILESS_MAIN(TestHTTPTransportCache)
+
+#include "testhttptransportcache.moc"
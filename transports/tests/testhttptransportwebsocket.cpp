@@ -0,0 +1,265 @@
+#include "http/httptransportwebsocket.h"
+
+#include <QtTest/QTest>
+
+typedef HTTPTransportWebSocket::Opcode Opcode;
+typedef HTTPTransportWebSocket::CloseCode CloseCode;
+
+#define FIN 0x80
+#define RSV1 0x40
+
+// RFC 6455 framing as the HTTP transport sees it from clients
+class TestHTTPTransportWebSocket : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void acceptKey();
+    void serverFrames();
+    void message();
+    void byteByByte();
+    void fragmentation();
+    void controlFramesBetweenFragments();
+    void pingBetweenFragmentsAtLimit();
+    void splitUtf8();
+    void closeHandshake();
+    void protocolErrors_data();
+    void protocolErrors();
+};
+
+// A client frame: clients always mask, unless told otherwise
+static QByteArray clientFrame(quint8 firstByte, const QByteArray &payload, bool masked = true)
+{
+    static const char mask[] = "\x12\x34\x56\x78";
+
+    QByteArray ret;
+    ret.append(static_cast<char>(firstByte));
+
+    const char maskBit = masked ? '\x80' : '\x00';
+    quint64 length = payload.size();
+    if (length < 126) {
+        ret.append(static_cast<char>(maskBit | length));
+    } else if (length <= 0xFFFF) {
+        ret.append(static_cast<char>(maskBit | 126));
+        ret.append(static_cast<char>(length >> 8));
+        ret.append(static_cast<char>(length));
+    } else {
+        ret.append(static_cast<char>(maskBit | 127));
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            ret.append(static_cast<char>(length >> shift));
+        }
+    }
+
+    if (!masked) {
+        return ret + payload;
+    }
+
+    ret.append(mask, 4);
+    for (int i = 0; i < payload.size(); ++i) {
+        ret.append(static_cast<char>(payload.at(i) ^ mask[i % 4]));
+    }
+    return ret;
+}
+
+// Only the header of a frame claiming a 64 bit length
+static QByteArray hugeFrameHeader(quint8 firstByte, quint64 length)
+{
+    QByteArray ret;
+    ret.append(static_cast<char>(firstByte));
+    ret.append(static_cast<char>(0x80 | 127));
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        ret.append(static_cast<char>(length >> shift));
+    }
+    return ret + QByteArray("\x12\x34\x56\x78");
+}
+
+static quint8 op(Opcode opcode, bool fin = true)
+{
+    return (fin ? FIN : 0) | static_cast<quint8>(opcode);
+}
+
+void TestHTTPTransportWebSocket::acceptKey()
+{
+    // The handshake example of RFC 6455
+    QCOMPARE(HTTPTransportWebSocket::acceptKey("dGhlIHNhbXBsZSBub25jZQ=="), QByteArray("s3pPLMBiTxaQ9kYGJzzPo+xo="));
+}
+
+void TestHTTPTransportWebSocket::serverFrames()
+{
+    // Never masked, with the shortest length encoding
+    QCOMPARE(HTTPTransportWebSocket::frame(Opcode::Text, "hi"), QByteArray("\x81\x02hi"));
+    QCOMPARE(HTTPTransportWebSocket::frame(Opcode::Binary, QByteArray(125, 'x')).size(), 2 + 125);
+    QCOMPARE(HTTPTransportWebSocket::frame(Opcode::Binary, QByteArray(126, 'x')).left(4), QByteArray("\x82\x7e\x00\x7e", 4));
+    QCOMPARE(HTTPTransportWebSocket::frame(Opcode::Binary, QByteArray(65536, 'x')).left(10),
+             QByteArray("\x82\x7f\x00\x00\x00\x00\x00\x01\x00\x00", 10));
+    QCOMPARE(HTTPTransportWebSocket::closeFrame(CloseCode::MessageTooBig), QByteArray("\x88\x02\x03\xf1"));
+}
+
+void TestHTTPTransportWebSocket::message()
+{
+    HTTPTransportWebSocket webSocket(1024);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Text), "hello") + clientFrame(op(Opcode::Text), QByteArray(300, 'x')), &messages));
+    QCOMPARE(messages.size(), 2);
+    QCOMPARE(static_cast<int>(messages.at(0).opcode), static_cast<int>(Opcode::Text));
+    QCOMPARE(messages.at(0).payload, QByteArray("hello"));
+    QCOMPARE(messages.at(1).payload, QByteArray(300, 'x'));
+}
+
+void TestHTTPTransportWebSocket::byteByByte()
+{
+    HTTPTransportWebSocket webSocket(1024);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    // A 16 bit length, cut anywhere, header included
+    QByteArray data = clientFrame(op(Opcode::Text), QByteArray(200, 'y'));
+    for (int i = 0; i < data.size(); ++i) {
+        QVERIFY(webSocket.feed(data.mid(i, 1), &messages));
+        QCOMPARE(messages.size(), i == data.size() - 1 ? 1 : 0);
+    }
+    QCOMPARE(messages.first().payload, QByteArray(200, 'y'));
+}
+
+void TestHTTPTransportWebSocket::fragmentation()
+{
+    HTTPTransportWebSocket webSocket(1024);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Text, false), "Hel"), &messages));
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Continuation, false), "lo "), &messages));
+    QVERIFY(messages.isEmpty());
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Continuation), "world"), &messages));
+    QCOMPARE(messages.size(), 1);
+    QCOMPARE(static_cast<int>(messages.first().opcode), static_cast<int>(Opcode::Text));
+    QCOMPARE(messages.first().payload, QByteArray("Hello world"));
+
+    // The next message starts from scratch
+    messages.clear();
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Binary, false), "a") + clientFrame(op(Opcode::Continuation), "b"), &messages));
+    QCOMPARE(messages.size(), 1);
+    QCOMPARE(static_cast<int>(messages.first().opcode), static_cast<int>(Opcode::Binary));
+    QCOMPARE(messages.first().payload, QByteArray("ab"));
+}
+
+void TestHTTPTransportWebSocket::controlFramesBetweenFragments()
+{
+    HTTPTransportWebSocket webSocket(1024);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Text, false), "one ")
+                           + clientFrame(op(Opcode::Ping), "are you there")
+                           + clientFrame(op(Opcode::Continuation, false), "two ")
+                           + clientFrame(op(Opcode::Pong), QByteArray())
+                           + clientFrame(op(Opcode::Continuation), "three"), &messages));
+
+    // Control frames come as they arrive, the message once complete
+    QCOMPARE(messages.size(), 3);
+    QCOMPARE(static_cast<int>(messages.at(0).opcode), static_cast<int>(Opcode::Ping));
+    QCOMPARE(messages.at(0).payload, QByteArray("are you there"));
+    QCOMPARE(static_cast<int>(messages.at(1).opcode), static_cast<int>(Opcode::Pong));
+    QCOMPARE(static_cast<int>(messages.at(2).opcode), static_cast<int>(Opcode::Text));
+    QCOMPARE(messages.at(2).payload, QByteArray("one two three"));
+}
+
+void TestHTTPTransportWebSocket::pingBetweenFragmentsAtLimit()
+{
+    HTTPTransportWebSocket webSocket(16);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    // The limit is about messages: a ping doesn't count against the one being reassembled
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Text, false), QByteArray(16, 'z'))
+                           + clientFrame(op(Opcode::Ping), "ping")
+                           + clientFrame(op(Opcode::Continuation), QByteArray()), &messages));
+    QCOMPARE(messages.size(), 2);
+    QCOMPARE(messages.at(1).payload, QByteArray(16, 'z'));
+}
+
+void TestHTTPTransportWebSocket::splitUtf8()
+{
+    HTTPTransportWebSocket webSocket(1024);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    // Fragments can cut a character, only the whole message must be valid
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Text, false), "caf\xc3"), &messages));
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Continuation), "\xa9"), &messages));
+    QCOMPARE(messages.size(), 1);
+    QCOMPARE(messages.first().payload, QByteArray("caf\xc3\xa9"));
+}
+
+void TestHTTPTransportWebSocket::closeHandshake()
+{
+    HTTPTransportWebSocket webSocket(1024);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    // A close with a code and a reason, then one without a body: both are handed over as they are
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Close), QByteArray("\x03\xe8") + "bye"), &messages));
+    QVERIFY(webSocket.feed(clientFrame(op(Opcode::Close), QByteArray()), &messages));
+    QCOMPARE(messages.size(), 2);
+    QCOMPARE(static_cast<int>(messages.at(0).opcode), static_cast<int>(Opcode::Close));
+    QCOMPARE(messages.at(0).payload, QByteArray("\x03\xe8" "bye"));
+    QVERIFY(messages.at(1).payload.isEmpty());
+
+    // Our answer echoes a normal closure
+    QCOMPARE(HTTPTransportWebSocket::closeFrame(CloseCode::Normal), QByteArray("\x88\x02\x03\xe8"));
+}
+
+void TestHTTPTransportWebSocket::protocolErrors_data()
+{
+    QTest::addColumn< int >("maximumMessageSize");
+    QTest::addColumn< QByteArray >("data");
+    QTest::addColumn< int >("closeCode");
+
+    const int protocolError = static_cast<int>(CloseCode::ProtocolError);
+    const int invalidPayload = static_cast<int>(CloseCode::InvalidPayload);
+    const int messageTooBig = static_cast<int>(CloseCode::MessageTooBig);
+
+    // Framing
+    QTest::newRow("unmasked") << 1024 << clientFrame(op(Opcode::Text), "hi", false) << protocolError;
+    QTest::newRow("reserved bit") << 1024 << clientFrame(RSV1 | op(Opcode::Text), "hi") << protocolError;
+    QTest::newRow("reserved data opcode") << 1024 << clientFrame(FIN | 0x3, "hi") << protocolError;
+    QTest::newRow("reserved control opcode") << 1024 << clientFrame(FIN | 0xB, "hi") << protocolError;
+    QTest::newRow("most significant length bit") << 1024 << hugeFrameHeader(op(Opcode::Binary), Q_UINT64_C(0x8000000000000000)) << protocolError;
+
+    // Fragments
+    QTest::newRow("continuation first") << 1024 << clientFrame(op(Opcode::Continuation), "hi") << protocolError;
+    QTest::newRow("message between fragments") << 1024
+        << clientFrame(op(Opcode::Text, false), "a") + clientFrame(op(Opcode::Text), "b") << protocolError;
+    QTest::newRow("fragmented ping") << 1024 << clientFrame(op(Opcode::Ping, false), "hi") << protocolError;
+    QTest::newRow("fragmented close") << 1024 << clientFrame(op(Opcode::Close, false), QByteArray()) << protocolError;
+    QTest::newRow("large control frame") << 1024 << clientFrame(op(Opcode::Ping), QByteArray(126, 'p')) << protocolError;
+
+    // Text must be UTF-8, once complete
+    QTest::newRow("invalid utf-8") << 1024 << clientFrame(op(Opcode::Text), "\xff") << invalidPayload;
+    QTest::newRow("truncated utf-8") << 1024 << clientFrame(op(Opcode::Text), "caf\xc3") << invalidPayload;
+    QTest::newRow("truncated fragmented utf-8") << 1024
+        << clientFrame(op(Opcode::Text, false), "caf") + clientFrame(op(Opcode::Continuation), "\xc3") << invalidPayload;
+
+    // Sizes
+    QTest::newRow("message too big") << 16 << clientFrame(op(Opcode::Binary), QByteArray(17, 'x')) << messageTooBig;
+    QTest::newRow("fragments too big") << 16
+        << clientFrame(op(Opcode::Binary, false), QByteArray(10, 'x')) + clientFrame(op(Opcode::Continuation), QByteArray(7, 'x'))
+        << messageTooBig;
+    QTest::newRow("64 bit length") << 1024 << hugeFrameHeader(op(Opcode::Binary), Q_UINT64_C(0x7FFFFFFFFFFFFFFF)) << messageTooBig;
+    QTest::newRow("64 bit length, zero limit") << 0 << hugeFrameHeader(op(Opcode::Binary), Q_UINT64_C(0x100000000)) << messageTooBig;
+    QTest::newRow("negative limit") << -1 << clientFrame(op(Opcode::Binary), "x") << messageTooBig;
+}
+
+void TestHTTPTransportWebSocket::protocolErrors()
+{
+    QFETCH(int, maximumMessageSize);
+    QFETCH(QByteArray, data);
+    QFETCH(int, closeCode);
+
+    HTTPTransportWebSocket webSocket(maximumMessageSize);
+    QList< HTTPTransportWebSocket::Message > messages;
+
+    // Refused with the code the peer is closed with, as soon as the offending frame header is complete
+    QVERIFY(!webSocket.feed(data, &messages));
+    QCOMPARE(static_cast<int>(webSocket.closeCode()), closeCode);
+    QVERIFY(messages.isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TestHTTPTransportWebSocket)
+
+#include "testhttptransportwebsocket.moc"
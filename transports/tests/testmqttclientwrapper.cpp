@@ -0,0 +1,158 @@
+#include "hyperdrivemqttclientwrapper.h"
+
+#include <QtTest/QSignalSpy>
+#include <QtTest/QTest>
+
+#define DEFAULT_BROKER "tcp://localhost:1883"
+#define MESSAGES 10000
+#define TIMEOUT 60000
+
+// Round trips through a real broker, in both loop modes and over both TCP and unix sockets.
+// The throughput rows report their time through QBENCHMARK_ONCE.
+class TestMQTTClientWrapper : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void roundTrip_data();
+    void roundTrip();
+    void publishThroughput_data();
+    void publishThroughput();
+
+private:
+    void addBrokerRows();
+    Hyperdrive::MQTTClientWrapper *connectedClient(const QUrl &broker, Hyperdrive::MQTTClientWrapper::LoopMode loopMode,
+                                                   const QByteArray &clientId);
+};
+
+void TestMQTTClientWrapper::initTestCase()
+{
+    qRegisterMetaType< Hyperdrive::MQTTClientWrapper::Status >();
+}
+
+void TestMQTTClientWrapper::addBrokerRows()
+{
+    QTest::addColumn< QUrl >("broker");
+    QTest::addColumn< Hyperdrive::MQTTClientWrapper::LoopMode >("loopMode");
+
+    QUrl tcpBroker(qEnvironmentVariableIsEmpty("HYPERDRIVE_TEST_BROKER") ? QStringLiteral(DEFAULT_BROKER)
+                                                                         : QString::fromLocal8Bit(qgetenv("HYPERDRIVE_TEST_BROKER")));
+    QTest::newRow("tcp, threaded") << tcpBroker << Hyperdrive::MQTTClientWrapper::ThreadedLoopMode;
+    QTest::newRow("tcp, event loop") << tcpBroker << Hyperdrive::MQTTClientWrapper::EventLoopMode;
+
+#ifdef HAVE_MOSQUITTO_UNIX_SOCKETS
+    QString socketPath = QString::fromLocal8Bit(qgetenv("HYPERDRIVE_TEST_BROKER_SOCKET"));
+    if (!socketPath.isEmpty()) {
+        QUrl unixBroker;
+        unixBroker.setScheme(QStringLiteral("unix"));
+        unixBroker.setPath(socketPath);
+        QTest::newRow("unix, threaded") << unixBroker << Hyperdrive::MQTTClientWrapper::ThreadedLoopMode;
+        QTest::newRow("unix, event loop") << unixBroker << Hyperdrive::MQTTClientWrapper::EventLoopMode;
+    }
+#endif
+}
+
+Hyperdrive::MQTTClientWrapper *TestMQTTClientWrapper::connectedClient(const QUrl &broker, Hyperdrive::MQTTClientWrapper::LoopMode loopMode,
+                                                                      const QByteArray &clientId)
+{
+    Hyperdrive::MQTTClientWrapper *client = new Hyperdrive::MQTTClientWrapper(broker, clientId, this);
+    client->setLoopMode(loopMode);
+    client->setCleanSession(true);
+
+    Hemera::Operation *op = client->init();
+    QSignalSpy initSpy(op, &Hemera::Operation::finished);
+    if (!initSpy.wait(5000) || op->isError()) {
+        delete client;
+        return nullptr;
+    }
+
+    QSignalSpy statusSpy(client, &Hyperdrive::MQTTClientWrapper::statusChanged);
+    client->connectToBroker();
+    while (client->status() != Hyperdrive::MQTTClientWrapper::ConnectedStatus) {
+        if (!statusSpy.wait(5000)) {
+            delete client;
+            return nullptr;
+        }
+    }
+
+    return client;
+}
+
+void TestMQTTClientWrapper::roundTrip_data()
+{
+    addBrokerRows();
+}
+
+void TestMQTTClientWrapper::roundTrip()
+{
+    QFETCH(QUrl, broker);
+    QFETCH(Hyperdrive::MQTTClientWrapper::LoopMode, loopMode);
+
+    QByteArray clientId = "hyperdrive-test-" + QByteArray::number(QCoreApplication::applicationPid());
+    Hyperdrive::MQTTClientWrapper *client = connectedClient(broker, loopMode, clientId);
+    if (!client) {
+        QSKIP(qPrintable(QStringLiteral("No broker at %1").arg(broker.toString())));
+    }
+
+    QByteArray topic = clientId + "/roundtrip";
+    client->subscribe(topic, Hyperdrive::MQTTClientWrapper::AtLeastOnceQoS);
+    // Messages to ourselves come back only once the subscription is in place
+    QSignalSpy receivedSpy(client, &Hyperdrive::MQTTClientWrapper::messageReceived);
+    bool subscribed = false;
+    for (int attempt = 0; attempt < 10 && !subscribed; ++attempt) {
+        client->publish(topic, "ping", Hyperdrive::MQTTClientWrapper::AtLeastOnceQoS);
+        subscribed = receivedSpy.wait(500);
+    }
+    QVERIFY(subscribed);
+    // Late pings might still be on their way
+    QTest::qWait(500);
+    receivedSpy.clear();
+
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(client->publish(topic, QByteArray::number(i), Hyperdrive::MQTTClientWrapper::AtLeastOnceQoS) >= 0);
+    }
+    QTRY_COMPARE_WITH_TIMEOUT(receivedSpy.count(), 100, TIMEOUT);
+    for (int i = 0; i < 100; ++i) {
+        QCOMPARE(receivedSpy.at(i).at(0).toByteArray(), topic);
+        QCOMPARE(receivedSpy.at(i).at(1).toByteArray(), QByteArray::number(i));
+    }
+
+    client->disconnectFromBroker();
+    delete client;
+}
+
+void TestMQTTClientWrapper::publishThroughput_data()
+{
+    addBrokerRows();
+}
+
+void TestMQTTClientWrapper::publishThroughput()
+{
+    QFETCH(QUrl, broker);
+    QFETCH(Hyperdrive::MQTTClientWrapper::LoopMode, loopMode);
+
+    QByteArray clientId = "hyperdrive-bench-" + QByteArray::number(QCoreApplication::applicationPid());
+    Hyperdrive::MQTTClientWrapper *client = connectedClient(broker, loopMode, clientId);
+    if (!client) {
+        QSKIP(qPrintable(QStringLiteral("No broker at %1").arg(broker.toString())));
+    }
+
+    QByteArray topic = clientId + "/throughput";
+    QByteArray payload(64, 'x');
+    QSignalSpy confirmedSpy(client, &Hyperdrive::MQTTClientWrapper::publishConfirmed);
+
+    QBENCHMARK_ONCE {
+        for (int i = 0; i < MESSAGES; ++i) {
+            QVERIFY(client->publish(topic, payload, Hyperdrive::MQTTClientWrapper::AtLeastOnceQoS) >= 0);
+        }
+        QTRY_COMPARE_WITH_TIMEOUT(confirmedSpy.count(), MESSAGES, TIMEOUT);
+    }
+
+    client->disconnectFromBroker();
+    delete client;
+}
+
+QTEST_GUILESS_MAIN(TestMQTTClientWrapper)
+
+#include "testmqttclientwrapper.moc"
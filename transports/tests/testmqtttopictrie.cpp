@@ -0,0 +1,95 @@
+#include "mqtt/mqtttopictrie.h"
+
+#include <QtTest/QTest>
+
+// Resolving the interface of inbound topics
+class TestMQTTTopicTrie : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void match_data();
+    void match();
+    void clear();
+    void benchmarkMatch_data();
+    void benchmarkMatch();
+};
+
+void TestMQTTTopicTrie::match_data()
+{
+    QTest::addColumn< QByteArray >("topic");
+    QTest::addColumn< int >("offset");
+    QTest::addColumn< int >("length");
+
+    QTest::newRow("interface") << QByteArray("com.example.Sensors/temperature") << 0 << 19;
+    QTest::newRow("prefix of another interface") << QByteArray("com.example.Sensor/temperature") << 0 << 18;
+    QTest::newRow("no path") << QByteArray("com.example.Sensors") << 0 << 19;
+    QTest::newRow("deep path") << QByteArray("org.other/a/b/c") << 0 << 9;
+    QTest::newRow("offset") << QByteArray("device/com.example.Commands/run") << 7 << 20;
+
+    QTest::newRow("longer than an interface") << QByteArray("com.example.Sensorsx/temperature") << 0 << -1;
+    QTest::newRow("inner node") << QByteArray("com.example.Sens/temperature") << 0 << -1;
+    QTest::newRow("unknown") << QByteArray("com.unknown.Interface/value") << 0 << -1;
+    QTest::newRow("empty level") << QByteArray("/com.example.Sensors") << 0 << -1;
+    QTest::newRow("empty") << QByteArray() << 0 << -1;
+    QTest::newRow("offset past the interface") << QByteArray("com.example.Sensors/temperature") << 1 << -1;
+}
+
+void TestMQTTTopicTrie::match()
+{
+    QFETCH(QByteArray, topic);
+    QFETCH(int, offset);
+    QFETCH(int, length);
+
+    Hyperdrive::MQTTTopicTrie trie;
+    trie.insert("com.example.Sensors");
+    trie.insert("com.example.Sensor");
+    trie.insert("com.example.Commands");
+    trie.insert("org.other");
+
+    QCOMPARE(trie.match(topic, offset), length);
+}
+
+void TestMQTTTopicTrie::clear()
+{
+    Hyperdrive::MQTTTopicTrie trie;
+    QVERIFY(trie.isEmpty());
+
+    trie.insert("com.example.Sensors");
+    QVERIFY(!trie.isEmpty());
+    QCOMPARE(trie.match("com.example.Sensors/temperature"), 19);
+
+    // A new introspection starts from scratch
+    trie.clear();
+    QVERIFY(trie.isEmpty());
+    QCOMPARE(trie.match("com.example.Sensors/temperature"), -1);
+}
+
+void TestMQTTTopicTrie::benchmarkMatch_data()
+{
+    QTest::addColumn< QByteArray >("topic");
+
+    QTest::newRow("consumer interface") << QByteArray("com.example.device.Interface99/some/deep/path");
+    QTest::newRow("unknown interface") << QByteArray("com.example.device.Unknown/some/deep/path");
+}
+
+void TestMQTTTopicTrie::benchmarkMatch()
+{
+    QFETCH(QByteArray, topic);
+
+    // An introspection of a large device, with the usual long common prefix
+    Hyperdrive::MQTTTopicTrie trie;
+    for (int i = 0; i < 200; ++i) {
+        trie.insert("com.example.device.Interface" + QByteArray::number(i));
+    }
+
+    int length = 0;
+    QBENCHMARK {
+        length = trie.match(topic);
+    }
+    QCOMPARE(length > 0, topic.contains("Interface"));
+}
+
+QTEST_GUILESS_MAIN(TestMQTTTopicTrie)
+
+#include "testmqtttopictrie.moc"
@@ -96,6 +96,14 @@ int main(int argc, char *argv[])\
 \
         sd_notify(0, "STATUS=Name transport is reloading...");\
         qCDebug(transportDC) << "Reloading Name transport...";\
+        /* Keep sessions and caches alive if the transport can take the new configuration as it is */\
+        if (transport->isReady() && transport->reloadConfiguration()) {\
+            qCDebug(transportDC) << "Configuration reloaded in place";\
+            sd_notify(0, "STATUS=Name transport reloaded");\
+            snHup.setEnabled(true);\
+            return;\
+        }\
+        qCDebug(transportDC) << "Restarting Name transport...";\
         QObject::connect(transport, &QObject::destroyed, [&] {\
             startItUp();\
             snHup.setEnabled(true);\